@@ -10,5 +10,6 @@
 	bgt	.L2
 	eors	r3, r3
 .L2:
+	movs	r0, r3
         bx      lr
 	.size ">", .-">"
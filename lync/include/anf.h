@@ -2,23 +2,31 @@
 #define LYN_ANF_H
 
 #include "meta.h"
+#include "span.h"
+#include "string_table.h"
 
+#include <cstdint>
 #include <string_view>
+#include <type_traits>
 #include <variant>
 #include <vector>
 
 namespace lyn {
 
-struct basic_block;
+// Range of local ids in anf_context::operands
+struct anf_operands {
+  std::uint32_t first = 0;
+  std::uint32_t size = 0;
+};
 
 struct anf_receive {
-  std::vector<int> args;
+  anf_operands args;
 };
 
 struct anf_adjust_stack {};
 
 struct anf_global {
-  std::string_view name;
+  symbol name;
   int id;
 };
 
@@ -28,8 +36,10 @@ struct anf_constant {
 };
 
 struct anf_call {
-  std::variant<int, std::string_view> call_target;
-  std::vector<int> arg_ids;
+  // Local holding the called function, 0 when calling the global name
+  int target;
+  symbol name;
+  anf_operands args;
   int res_id;
   bool is_tail;
 };
@@ -39,6 +49,7 @@ struct anf_assoc {
   int id;
 };
 
+// Blocks are numbered per definition
 struct anf_cond {
   int cond_id;
   int then_block;
@@ -54,7 +65,7 @@ struct anf_jump {
 };
 
 struct anf_global_assign {
-  std::string_view name;
+  symbol name;
   int id;
 };
 
@@ -63,20 +74,106 @@ using all_anf_types =
               anf_cond, anf_return, anf_assoc, anf_jump, anf_global_assign>;
 using anf_expr = derive_pack_t<std::variant, all_anf_types>;
 
+// Range of instructions in anf_context::instrs
 struct basic_block {
-  std::vector<anf_expr> content;
+  std::uint32_t first = 0;
+  std::uint32_t size = 0;
 };
 
+// Range of blocks in anf_context::blocks
 struct anf_def {
-  std::string_view name;
-  std::vector<basic_block> blocks;
+  symbol name;
+  std::uint32_t first_block;
+  std::uint32_t block_count;
   bool global;
 };
 
+// The instructions of all definitions are stored in a single flat array, the
+// blocks of a definition refer to consecutive ranges of it. Operand lists of
+// all instructions share one pool as well.
 struct anf_context {
+  span<basic_block> blocks_of(const anf_def &def) {
+    return {std::data(blocks) + def.first_block, def.block_count};
+  }
+  span<const basic_block> blocks_of(const anf_def &def) const {
+    return {std::data(blocks) + def.first_block, def.block_count};
+  }
+  span<anf_expr> instrs_of(const basic_block &block) {
+    return {std::data(instrs) + block.first, block.size};
+  }
+  span<const anf_expr> instrs_of(const basic_block &block) const {
+    return {std::data(instrs) + block.first, block.size};
+  }
+  span<const int> operands_of(anf_operands ops) const {
+    return {std::data(operands) + ops.first, ops.size};
+  }
+  std::string_view name_of(symbol name) const { return (*stbl)[name]; }
+
   std::vector<anf_def> defs;
+  std::vector<basic_block> blocks;
+  std::vector<anf_expr> instrs;
+  std::vector<int> operands;
+  // Names of globals are symbols of this table
+  const string_table *stbl = nullptr;
+  // Lowest id used by any of the definitions, tables of locals are offset by
+  // it
+  int first_id = 0;
 };
 
+// Calls fun with every id read by instr. Id 0 stands for the missing value of
+// an empty let body and is skipped.
+template <class Fun>
+void for_each_use(const anf_context &ctx, const anf_expr &instr, Fun &&fun) {
+  const auto use = [&](int id) {
+    if (id)
+      fun(id);
+  };
+  std::visit(
+      [&](auto &&val) {
+        using val_t = std::decay_t<decltype(val)>;
+        if constexpr (std::is_same_v<val_t, anf_call>) {
+          use(val.target);
+          for (const int arg : ctx.operands_of(val.args))
+            use(arg);
+        }
+        if constexpr (std::is_same_v<val_t, anf_cond>)
+          use(val.cond_id);
+        if constexpr (std::is_same_v<val_t, anf_return>)
+          use(val.value);
+        if constexpr (std::is_same_v<val_t, anf_assoc>)
+          use(val.alias);
+        if constexpr (std::is_same_v<val_t, anf_global_assign>)
+          use(val.id);
+      },
+      instr);
+}
+
+// Calls fun with every id assigned by instr
+template <class Fun>
+void for_each_def(const anf_context &ctx, const anf_expr &instr, Fun &&fun) {
+  std::visit(
+      [&](auto &&val) {
+        using val_t = std::decay_t<decltype(val)>;
+        if constexpr (std::is_same_v<val_t, anf_receive>) {
+          for (const int param : ctx.operands_of(val.args))
+            fun(param);
+        }
+        if constexpr (std::is_same_v<val_t, anf_global> ||
+                      std::is_same_v<val_t, anf_constant> ||
+                      std::is_same_v<val_t, anf_assoc>)
+          fun(val.id);
+        if constexpr (std::is_same_v<val_t, anf_call>) {
+          if (!val.is_tail)
+            fun(val.res_id);
+        }
+      },
+      instr);
+}
+
+// Appends the definitions of source to target, which need to share their
+// string table
+void append_anf(anf_context &target, const anf_context &source);
+
 } // namespace lyn
 
 #endif
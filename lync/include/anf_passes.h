@@ -0,0 +1,29 @@
+#ifndef LYN_ANF_PASSES_H
+#define LYN_ANF_PASSES_H
+
+namespace lyn {
+
+struct anf_context;
+class symbol_table;
+
+// Optimizations of the intermediate format, run by genanf. Passes creating
+// values take the next free id and return it again once they are done.
+
+// Evaluates calls of primitives whose arguments are known and removes the
+// branches not taken by conditions that are known. Calls of locals holding a
+// known global function are turned into calls of its name.
+int fold_constants(anf_context &ctx, const symbol_table &symtab, int next_id);
+
+// Copies the blocks of definitions of at most threshold instructions into
+// their callers, or of at most twice as many if they are called only once.
+// Recursive definitions are never inlined, a threshold of 0 disables
+// inlining.
+int inline_calls(anf_context &ctx, int threshold, int next_id);
+
+// Turns tail calls of definitions to themselves into jumps back to their
+// start, after assigning the arguments to the parameters.
+int loop_self_tail_calls(anf_context &ctx, int next_id);
+
+} // namespace lyn
+
+#endif
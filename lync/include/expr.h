@@ -2,7 +2,9 @@
 #define LYN_EXPR_H
 
 #include "meta.h"
+#include "source_manager.h"
 #include "span.h"
+#include "string_table.h"
 #include <cstddef>
 #include <memory>
 #include <string>
@@ -12,12 +14,6 @@
 
 namespace lyn {
 
-struct source_location {
-  std::string_view file_name;
-  int line = 1;
-  int col = 1;
-};
-
 struct expr;
 struct type;
 
@@ -32,35 +28,40 @@ struct constant_expr {
 };
 
 struct variable_expr {
-  std::string_view name;
+  symbol name;
   int id = 0;
 };
 
+// The alternatives of expr are kept at two pointers at most, which keeps an
+// expr at 32 bytes. Arrays are stored as compact_span for this reason.
 struct apply_expr {
   expr *func;
-  span<expr *> args;
+  compact_span<expr *> args;
 };
 
 struct lambda_expr {
-  span<variable_expr> params;
+  compact_span<variable_expr> params;
   expr *body;
 };
 
 struct let_binding {
-  std::string_view name;
+  symbol name;
   int id;
   expr *body;
 };
 
 struct let_expr {
-  span<let_binding> bindings;
-  span<expr *> body;
+  compact_span<let_binding> bindings;
+  compact_span<expr *> body;
 };
 
 struct if_expr {
+  expr *then() const { return branches[0]; }
+  expr *els() const { return branches[1]; }
+
   expr *cond;
-  expr *then;
-  expr *els;
+  // The then and else branch
+  expr **branches;
 };
 
 using all_exprs = type_list<constant_expr, variable_expr, apply_expr,
@@ -69,7 +70,6 @@ using all_exprs = type_list<constant_expr, variable_expr, apply_expr,
 struct expr {
   derive_pack_t<std::variant, all_exprs> content;
   source_location sloc;
-  struct type *type = nullptr;
 };
 
 struct type_expr;
@@ -88,10 +88,15 @@ struct type_expr {
 };
 
 struct toplevel_expr {
-  std::string_view name;
+  symbol name;
   int id;
   type_expr *type_value;
   expr *value;
+  // Lowest id of the locals bound inside value, tables of locals are offset
+  // by it
+  int first_local_id = 0;
+  // Type of value inferred by typecheck
+  struct type *value_type = nullptr;
 };
 
 } // namespace lyn
@@ -0,0 +1,61 @@
+#ifndef LYN_ID_TABLE_H
+#define LYN_ID_TABLE_H
+
+#include <cassert>
+#include <cstddef>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace lyn {
+
+// Maps ids to values, replacing hash maps keyed by ids. Ids handed out by
+// symbol_table::gen_id are dense, so values are stored in a flat vector
+// indexed by the id minus the first id of the table. The table grows on
+// demand, missing entries hold the empty value.
+template <class T> class id_table {
+public:
+  explicit id_table(int first_id = 0, T empty = T{})
+      : first_id{first_id}, empty{std::move(empty)} {}
+
+  // Removes all entries, keeping the memory for reuse
+  void reset(int new_first_id) {
+    values.clear();
+    first_id = new_first_id;
+  }
+
+  T &operator[](int id) {
+    assert(id >= first_id);
+    const std::size_t idx = id - first_id;
+    if (idx >= std::size(values))
+      values.resize(idx + 1, empty);
+    return values[idx];
+  }
+
+  const T &at(int id) const {
+    if (id < first_id || static_cast<std::size_t>(id - first_id) >=
+                             std::size(values) ||
+        values[id - first_id] == empty)
+      throw std::out_of_range{"id_table::at"};
+    return values[id - first_id];
+  }
+
+  // Returns the empty value for missing entries
+  const T &get(int id) const {
+    if (id < first_id ||
+        static_cast<std::size_t>(id - first_id) >= std::size(values))
+      return empty;
+    return values[id - first_id];
+  }
+
+  int get_first_id() const { return first_id; }
+
+private:
+  int first_id;
+  T empty;
+  std::vector<T> values;
+};
+
+} // namespace lyn
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef LYN_INTERFACE_H
+#define LYN_INTERFACE_H
+
+#include "source_buffer.h"
+#include "string_table.h"
+#include <cstdint>
+#include <cstdio>
+#include <memory_resource>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace lyn {
+
+struct toplevel_expr;
+struct type_expr;
+
+// Binary module interfaces (.lyni files) describe the functions a module
+// defines, so other modules can use them without parsing their declarations
+// from source. All fields are 32 bit integers in host byte order:
+//
+//   interface_header
+//   interface_entry[entry_count]
+//   interface_type[type_count]
+//   std::uint32_t children[child_count]
+//   char strings[string_size]
+//
+// Types form a DAG where children only refer to types with a lower index.
+// Function types list their parameters followed by the result, like
+// func_type_expr does.
+inline constexpr char interface_magic[4] = {'L', 'Y', 'N', 'I'};
+inline constexpr std::uint32_t interface_version = 2;
+inline constexpr std::string_view interface_extension = ".lyni";
+
+struct interface_header {
+  char magic[4];
+  std::uint32_t version;
+  std::uint32_t entry_count;
+  std::uint32_t type_count;
+  std::uint32_t child_count;
+  std::uint32_t string_size;
+};
+
+struct interface_entry {
+  std::uint32_t name_offset;
+  std::uint32_t name_size;
+  std::uint32_t type;
+};
+
+enum class interface_type_kind : std::uint32_t {
+  int_,
+  bool_,
+  unit,
+  function,
+};
+
+struct interface_type {
+  interface_type_kind kind;
+  std::uint32_t children_begin;
+  std::uint32_t children_size;
+};
+
+struct interface_decl {
+  std::string_view name;
+  type_expr *type;
+};
+
+// Writes the interface of all functions defined in exprs, which need to be
+// typechecked. Definitions whose type is not fully known are left out.
+bool write_interface(const std::vector<toplevel_expr> &exprs,
+                     const string_table &stbl, FILE *out);
+
+// Reads an interface file. The names of the returned declarations point into
+// the buffer, the type expressions are allocated from alloc.
+std::optional<std::vector<interface_decl>>
+read_interface(const source_buffer &buffer, std::pmr::memory_resource &alloc);
+
+} // namespace lyn
+
+#endif
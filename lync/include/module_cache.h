@@ -0,0 +1,47 @@
+#ifndef LYN_MODULE_CACHE_H
+#define LYN_MODULE_CACHE_H
+
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace lyn {
+
+struct type_expr;
+
+// Remembers the parsed contents of included files that consist of
+// declarations and further includes only. Later includes of such a file can
+// splice in the cached declarations instead of reading and parsing it again.
+// The cache may be shared between compilations running in parallel.
+class module_cache {
+public:
+  struct item {
+    // Declared name, or the canonical path of a nested include
+    std::string name;
+    // Declared type, nullptr for a nested include
+    type_expr *type;
+  };
+
+  struct module {
+    std::vector<item> items;
+  };
+
+  // Returns the cached module for a canonical path or nullptr. Returned
+  // modules stay valid for the lifetime of the cache.
+  const module *find(const std::string &path) const;
+  // Adds a module, copying its type expressions into the cache.
+  void insert(const std::string &path, module mod);
+
+private:
+  type_expr *copy(const type_expr &expr);
+
+  mutable std::mutex mutex;
+  std::pmr::monotonic_buffer_resource alloc;
+  std::unordered_map<std::string, module> modules;
+};
+
+} // namespace lyn
+
+#endif
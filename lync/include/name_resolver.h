@@ -0,0 +1,30 @@
+#ifndef LYN_NAME_RESOLVER_H
+#define LYN_NAME_RESOLVER_H
+
+#include "expr.h"
+#include "passes.h"
+#include "string_table.h"
+#include "symbol_table.h"
+
+namespace lyn {
+
+// Binds the names used in an expression to ids while it is traversed,
+// keeping track of its lexical scopes. Shared by alpha_convert and the fused
+// resolve_and_typecheck pass.
+class name_resolver {
+public:
+  explicit name_resolver(compilation_context &cc) : cc{cc} {}
+
+  // Looks up the id of variable, reporting unbound names at sloc
+  bool resolve(variable_expr &variable, source_location sloc);
+  scope push_scope() const { return cc.symtab.push_scope(); }
+  void bind(symbol name, int &id) { id = cc.symtab.register_local(name); }
+  void pop_scope(scope s) { cc.symtab.pop_scope(s); }
+
+private:
+  compilation_context &cc;
+};
+
+} // namespace lyn
+
+#endif
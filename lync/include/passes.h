@@ -1,20 +1,37 @@
 #ifndef LYN_PASSES_H
 #define LYN_PASSES_H
 
+#include "source_buffer.h"
+#include "source_manager.h"
 #include "string_table.h"
 #include "symbol_table.h"
 #include <cstdio>
+#include <memory>
 #include <memory_resource>
 #include <optional>
+#include <string>
 #include <vector>
 
 namespace lyn {
 
+class module_cache;
+
 struct compilation_context {
   string_table stbl;
   symbol_table symtab;
   std::pmr::monotonic_buffer_resource expr_alloc;
   std::pmr::monotonic_buffer_resource type_alloc;
+  // Source files read while parsing, source locations refer to them
+  source_manager sources;
+  // Diagnostics of all passes are written here
+  FILE *diag = stderr;
+  // Optional cache of included modules, possibly shared with other contexts
+  module_cache *modules = nullptr;
+  // Canonical paths of all files included while parsing
+  std::vector<std::string> included_files;
+  // Size up to which genanf inlines definitions into their callers, see
+  // inline_calls
+  int inline_threshold = 8;
 };
 
 struct toplevel_expr;
@@ -24,19 +41,38 @@ struct symbol_table;
 
 std::optional<std::vector<toplevel_expr>>
 parse(FILE *f, std::string_view file_name, compilation_context &cc);
-bool alpha_convert(std::vector<toplevel_expr> &exprs, symbol_table &table);
-bool typecheck(std::vector<toplevel_expr> &exprs, const symbol_table &stable,
-               std::pmr::monotonic_buffer_resource &alloc);
+std::optional<std::vector<toplevel_expr>>
+parse(source_buffer buffer, std::string_view file_name,
+      compilation_context &cc);
+bool alpha_convert(std::vector<toplevel_expr> &exprs, compilation_context &cc);
+// Building blocks of alpha_convert for sessions, which register globals
+// themselves and convert one definition at a time
+void register_primitives(compilation_context &cc);
+void register_globals(std::vector<toplevel_expr> &exprs,
+                      compilation_context &cc);
+bool alpha_convert(toplevel_expr &def, compilation_context &cc);
+bool typecheck(std::vector<toplevel_expr> &exprs, compilation_context &cc);
+// Performs alpha_convert and typecheck in a single traversal of every
+// definition. Reports the first error in program order.
+bool resolve_and_typecheck(std::vector<toplevel_expr> &exprs,
+                           compilation_context &cc);
 
 struct delete_anf {
   void operator()(anf_context *ctx);
 };
 
 std::unique_ptr<anf_context, delete_anf>
-genanf(std::vector<toplevel_expr> &exprs, string_table &stbl,
-       const symbol_table &symtab);
+genanf(std::vector<toplevel_expr> &exprs, compilation_context &cc);
 void print_anf(anf_context &ctx, FILE *out);
-void genasm(anf_context &ctx, FILE *out);
+// Where genasm keeps the values of a definition. Keeping every value on the
+// stack is only meant for debugging the register allocator.
+enum class value_placement {
+  registers,
+  stack,
+};
+// Calls of primitives not shadowed by a global in symtab are emitted inline
+void genasm(anf_context &ctx, const symbol_table &symtab, FILE *out,
+            value_placement placement = value_placement::registers);
 
 } // namespace lyn
 
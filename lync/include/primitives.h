@@ -18,6 +18,11 @@ enum class primitive_type {
 struct primitive_info {
   std::string_view name;
   primitive_type type;
+  // Calls without side effects, which may be removed if their result is
+  // unused
+  bool pure = true;
+  // Division, which only has no side effects if the divisor is not 0
+  bool divides = false;
 };
 
 inline constexpr int number_of_primitives = 24;
@@ -0,0 +1,107 @@
+#ifndef LYN_REGALLOC_H
+#define LYN_REGALLOC_H
+
+#include "anf.h"
+#include "id_table.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace lyn {
+
+// Where a value is kept during its whole lifetime
+struct value_location {
+  enum kind_t : std::uint8_t {
+    // Values which are never used
+    none,
+    reg,
+    slot,
+  };
+  kind_t kind = none;
+  // Register number or index of the spill slot
+  int index = 0;
+};
+
+// Registers and spill slots of the values of a definition
+struct register_assignment {
+  id_table<value_location> locations;
+  // Mask of the registers r4-r7 used by the definition, which it has to
+  // preserve for its caller
+  unsigned saved_registers = 0;
+  // Whether lr has to be saved, as it is clobbered by calls. Leaf functions
+  // return with lr intact.
+  bool saves_lr = false;
+  // Number of slots of the frame, values whose lifetimes do not overlap
+  // share a slot
+  int spill_slots = 0;
+  // Whether r2 and r3 are kept free for loading spilled values and storing
+  // globals
+  bool scratch_registers = false;
+};
+
+// Assigns the values of a definition to the registers r0-r7, or to spill
+// slots if too many values are live at once. Definitions which spill values
+// or store globals leave r2 and r3 to the code generator as scratch
+// registers. Values live across calls are only kept in r4-r7, which the
+// callee preserves.
+class register_allocator {
+public:
+  // Calls of the symbols marked in inline_calls are emitted inline and only
+  // write their result
+  register_allocator(const anf_context &ctx, std::vector<bool> inline_calls);
+
+  // Throws std::out_of_range if def uses values of other definitions
+  const register_assignment &run(const anf_def &def);
+
+private:
+  struct live_interval {
+    int start;
+    int end;
+    bool used;
+    bool crosses_call;
+    // Register the value should preferably be kept in, -1 for none
+    int hint_reg;
+    // Value whose register should preferably be reused, -1 for none
+    int hint_value;
+  };
+  struct value_ref {
+    unsigned generation = 0;
+    int index = 0;
+  };
+
+  int index_of(int id);
+  bool is_inline_call(const anf_call &call) const {
+    return !call.target && symbol_index(call.name) < std::size(inline_calls) &&
+           inline_calls[symbol_index(call.name)];
+  }
+  void compute_liveness(span<const basic_block> blocks);
+  void build_intervals(span<const basic_block> blocks);
+  void scan();
+  void spill(int value);
+  void assign_spill_slots();
+
+  const anf_context &ctx;
+  std::vector<bool> inline_calls;
+  register_assignment result;
+  // Values of the current definition are numbered densely
+  unsigned generation = 0;
+  id_table<value_ref> value_indices;
+  std::vector<int> value_ids;
+  std::vector<live_interval> intervals;
+  // Bit sets of values per block
+  std::size_t words_per_set = 0;
+  std::vector<std::uint64_t> live_in;
+  std::vector<std::uint64_t> live_out;
+  std::vector<std::uint64_t> used_before_def;
+  std::vector<std::uint64_t> defined;
+  // Positions of the calls clobbering r0-r3
+  std::vector<int> call_positions;
+  std::vector<int> order;
+  std::vector<int> active;
+  std::vector<int> spilled;
+  std::vector<int> slot_owners;
+};
+
+} // namespace lyn
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef LYN_SESSION_H
+#define LYN_SESSION_H
+
+#include "anf.h"
+#include "expr.h"
+#include "passes.h"
+#include "source_buffer.h"
+#include "typecheck.h"
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <string_view>
+#include <vector>
+
+namespace lyn {
+
+// A long running compilation, keeping the symbol table, the type
+// environment and the intermediate representation of every definition in
+// memory. Toplevel forms can be sent to the session one at a time, (re-)
+// defining a function only checks and generates code for it and the
+// definitions depending on it.
+class session {
+public:
+  explicit session(FILE *diag = stderr);
+  session(const session &other) = delete;
+  session &operator=(const session &other) = delete;
+
+  // Merges the toplevel forms in buffer into the session, later definitions
+  // and declarations replace earlier ones. Returns the names of all
+  // definitions that were checked again, in the order they were first
+  // defined. On error the session is left unchanged.
+  std::optional<std::vector<symbol>> update(source_buffer buffer,
+                                            std::string_view file_name);
+
+  // Collects the intermediate representation of the given definitions and
+  // the functions lifted out of them
+  anf_context code_for(const std::vector<symbol> &names) const;
+
+  compilation_context &context() { return cc; }
+
+private:
+  struct definition {
+    toplevel_expr decl = {};
+    // Global ids referenced by the value of the definition
+    std::vector<int> references = {};
+    std::unique_ptr<anf_context, delete_anf> code = nullptr;
+  };
+
+  const definition *find(int id) const;
+  std::vector<int>
+  collect_affected(const std::unordered_map<int, definition> &changed) const;
+
+  compilation_context cc;
+  typecheck_t checker;
+  // Indexed by global id, starting at the first global id
+  std::vector<definition> definitions;
+};
+
+} // namespace lyn
+
+#endif
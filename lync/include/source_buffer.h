@@ -0,0 +1,45 @@
+#ifndef LYN_SOURCE_BUFFER_H
+#define LYN_SOURCE_BUFFER_H
+
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <string_view>
+
+namespace lyn {
+
+// Holds the complete contents of a source file in memory. Regular files are
+// memory mapped if the platform supports it, everything else is read in
+// blocks.
+class source_buffer {
+public:
+  source_buffer() = default;
+  source_buffer(const source_buffer &other) = delete;
+  source_buffer(source_buffer &&other) noexcept;
+  source_buffer &operator=(const source_buffer &other) = delete;
+  source_buffer &operator=(source_buffer &&other) noexcept;
+  ~source_buffer();
+
+  static std::optional<source_buffer> open(const char *path);
+  static std::optional<source_buffer> read(FILE *file);
+  static source_buffer copy(std::string_view text);
+
+  const char *data() const { return m_data; }
+  std::size_t size() const { return m_size; }
+  const char *begin() const { return m_data; }
+  const char *end() const { return m_data + m_size; }
+  std::string_view view() const { return {m_data, m_size}; }
+
+private:
+  void reset();
+
+  const char *m_data = "";
+  std::size_t m_size = 0u;
+  bool m_mapped = false;
+  std::unique_ptr<char[]> m_storage;
+};
+
+} // namespace lyn
+
+#endif
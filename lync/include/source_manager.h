@@ -0,0 +1,51 @@
+#ifndef LYN_SOURCE_MANAGER_H
+#define LYN_SOURCE_MANAGER_H
+
+#include "source_buffer.h"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace lyn {
+
+// Location in the source as stored in the syntax tree: the id of the file in
+// its source_manager and the byte offset into it
+struct source_location {
+  std::uint32_t file = 0;
+  std::uint32_t offset = 0;
+};
+
+// Human readable form of a source_location
+struct source_position {
+  std::string_view file_name;
+  int line = 1;
+  int col = 1;
+};
+
+// Keeps the source files read by a compilation alive, so locations only need
+// to store offsets. Lines and columns are only computed when a diagnostic
+// needs them.
+class source_manager {
+public:
+  // Takes ownership of buffer and returns the id of the new file
+  std::uint32_t add(source_buffer buffer, std::string_view file_name);
+  const source_buffer &buffer(std::uint32_t file) const {
+    return files[file].buffer;
+  }
+  source_position position(source_location sloc) const;
+
+private:
+  struct file {
+    source_buffer buffer;
+    std::string name;
+    // Offsets of the first character of every line, built on first use
+    mutable std::vector<std::uint32_t> line_starts = {};
+  };
+
+  std::vector<file> files;
+};
+
+} // namespace lyn
+
+#endif
@@ -1,8 +1,11 @@
 #ifndef LYN_SPAN_H
 #define LYN_SPAN_H
 
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
+#include <new>
 #include <type_traits>
 #include <utility>
 #include <vector>
@@ -47,6 +50,59 @@ span<typename Container::value_type> spanify(Alloc &alloc,
           std::size(vec)};
 }
 
+// Like span, but only a single pointer wide. The size is stored in front of
+// the elements, so the span can only refer to arrays created by
+// compact_spanify.
+template <class T> class compact_span {
+public:
+  using value_type = T;
+
+  compact_span() = default;
+
+  T *data() const { return m_data; }
+  std::size_t size() const {
+    return m_data ? *reinterpret_cast<const std::uint32_t *>(
+                        reinterpret_cast<const char *>(m_data) - header_size)
+                  : 0u;
+  }
+  bool empty() const { return !m_data; }
+  T *begin() const { return m_data; }
+  T *end() const { return m_data + size(); }
+
+  T &front() const { return *begin(); }
+  T &back() const { return *(end() - 1); }
+  T &operator[](std::size_t idx) const { return m_data[idx]; }
+
+private:
+  template <class Alloc, class Container>
+  friend compact_span<typename Container::value_type>
+  compact_spanify(Alloc &alloc, const Container &vec);
+
+  // Keeps the elements following the size aligned
+  static constexpr std::size_t header_size =
+      alignof(T) > sizeof(std::uint32_t) ? alignof(T) : sizeof(std::uint32_t);
+
+  T *m_data = nullptr;
+};
+
+template <class Alloc, class Container>
+compact_span<typename Container::value_type>
+compact_spanify(Alloc &alloc, const Container &vec) {
+  using T = typename Container::value_type;
+  static_assert(std::is_trivially_destructible<T>::value);
+  compact_span<T> result;
+  if (std::empty(vec))
+    return result;
+  constexpr std::size_t header_size = compact_span<T>::header_size;
+  char *const storage = static_cast<char *>(alloc.allocate(
+      header_size + sizeof(T) * std::size(vec),
+      std::max(alignof(T), alignof(std::uint32_t))));
+  new (storage) std::uint32_t(static_cast<std::uint32_t>(std::size(vec)));
+  result.m_data = static_cast<T *>(std::memcpy(
+      storage + header_size, std::data(vec), sizeof(T) * std::size(vec)));
+  return result;
+}
+
 } // namespace lyn
 
 #endif
@@ -1,23 +1,51 @@
 #ifndef LYN_STRING_TABLE_H
 #define LYN_STRING_TABLE_H
 
+#include <cstdint>
 #include <cstring>
 #include <memory_resource>
+#include <optional>
 #include <string_view>
+#include <vector>
 
 namespace lyn {
 
+// Handle of an interned string. Handles are dense, starting at zero, so they
+// can be used to index tables directly. Two handles from the same
+// string_table compare equal iff the strings they refer to are equal.
+enum class symbol : std::uint32_t {};
+
+inline std::uint32_t symbol_index(symbol sym) {
+  return static_cast<std::uint32_t>(sym);
+}
+
 class string_table {
 public:
+  symbol intern(std::string_view target);
+  std::optional<symbol> find(std::string_view target) const;
+
+  std::string_view operator[](symbol sym) const {
+    return strings[symbol_index(sym)].str;
+  }
   std::string_view store(std::string_view target) {
-    return std::string_view(
-        static_cast<char *>(std::memcpy(alloc.allocate(std::size(target), 1u),
-                                        target.data(), std::size(target))),
-        std::size(target));
+    return (*this)[intern(target)];
   }
+  std::size_t size() const { return std::size(strings); }
 
 private:
+  struct entry {
+    std::string_view str;
+    std::size_t hash;
+  };
+
+  static std::size_t hash_string(std::string_view str);
+  std::size_t find_slot(std::string_view target, std::size_t hash) const;
+  void grow();
+
   std::pmr::monotonic_buffer_resource alloc;
+  std::vector<entry> strings;
+  // Open addressing hash table, storing handle + 1 with 0 marking a free slot
+  std::vector<std::uint32_t> slots;
 };
 
 } // namespace lyn
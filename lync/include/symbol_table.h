@@ -1,34 +1,59 @@
 #ifndef LYN_SYMBOL_TABLE_H
 #define LYN_SYMBOL_TABLE_H
 
+#include "constants.h"
+#include "string_table.h"
+#include <algorithm>
 #include <cassert>
-#include <string_view>
-#include <unordered_map>
+#include <cstddef>
+#include <utility>
+#include <vector>
 
 namespace lyn {
 
+// Marks the start of a lexical scope, see symbol_table::push_scope
 class scope {
 private:
   friend class symbol_table;
-  std::vector<std::unordered_map<std::string_view, int>::node_type>
-      shadowed_symbols;
+  explicit scope(std::size_t first_shadowed) : first_shadowed{first_shadowed} {}
+  std::size_t first_shadowed;
 };
 
+// Maps names to the ids they are currently bound to. Symbols are dense, so
+// bindings are stored in a vector indexed by symbol. Locals shadowing a
+// binding push the previous one onto a shared log, which pop_scope unwinds,
+// so entering and leaving scopes does not allocate once the log has grown.
 class symbol_table {
 public:
-  int register_primitive(std::string_view name);
-  int register_global(std::string_view name);
-  int register_local(std::string_view name, scope &current_scope);
+  int register_primitive(symbol name);
+  int register_global(symbol name);
+  int register_local(symbol name);
   int gen_id() { return next_id++; }
+  // Marks all ids below end as used, e.g. after a pass handed out ids on its
+  // own
+  void reserve_ids(int end) { next_id = std::max(next_id, end); }
 
   void start_global_registering() { first_global_id = next_id; }
   void start_local_registering() { first_local_id = next_id; }
+  // Registers locals starting at lyn::first_local_id, so globals can still be
+  // registered afterwards. Used by sessions, where new globals show up after
+  // earlier definitions have been converted.
+  void start_interleaved_registering() {
+    next_global_id = next_id;
+    first_local_id = next_id = lyn::first_local_id;
+  }
+
+  // Binds name to id again, or removes its binding if id is 0. Used to roll
+  // back the registration of rejected globals.
+  void restore_binding(symbol name, int id) { binding_of(name) = id; }
 
-  void pop_scope(scope &s);
+  // Locals registered until the matching pop_scope are bound in a new scope
+  scope push_scope() const { return scope{std::size(shadowed)}; }
+  void pop_scope(scope s);
 
-  int operator[](std::string_view name) const {
-    const auto iter = name_to_id.find(name);
-    return iter != std::end(name_to_id) ? iter->second : 0;
+  int operator[](symbol name) const {
+    const std::size_t idx = symbol_index(name);
+    return idx < std::size(bindings) ? bindings[idx] : 0;
   }
 
   int get_next_id() const { return next_id; }
@@ -36,38 +61,50 @@ public:
   int get_first_local_id() const { return first_local_id; }
 
 private:
-  std::unordered_map<std::string_view, int> name_to_id = {};
+  int &binding_of(symbol name) {
+    const std::size_t idx = symbol_index(name);
+    if (idx >= std::size(bindings))
+      bindings.resize(idx + 1);
+    return bindings[idx];
+  }
+
+  // Indexed by symbol, 0 for unbound names
+  std::vector<int> bindings = {};
+  // Bindings shadowed by the locals of all open scopes
+  std::vector<std::pair<symbol, int>> shadowed = {};
   int next_id = 1;
   int first_global_id = 0;
   int first_local_id = 0;
+  int next_global_id = 0;
 };
 
-inline int symbol_table::register_primitive(std::string_view name) {
+inline int symbol_table::register_primitive(symbol name) {
   assert(first_global_id == 0);
   return register_global(name);
 }
 
-inline int symbol_table::register_global(std::string_view name) {
-  assert(first_local_id == 0);
-  const int id = gen_id();
-  name_to_id[name] = id;
+inline int symbol_table::register_global(symbol name) {
+  assert(first_local_id == 0 || next_global_id != 0);
+  const int id = next_global_id ? next_global_id++ : gen_id();
+  binding_of(name) = id;
   return id;
 }
 
-inline int symbol_table::register_local(std::string_view name,
-                                        scope &current_scope) {
-  if (auto node = name_to_id.extract(name)) {
-    current_scope.shadowed_symbols.emplace_back(std::move(node));
-  }
-  const int id = gen_id();
-  name_to_id[name] = id;
-  return id;
+inline int symbol_table::register_local(symbol name) {
+  int &binding = binding_of(name);
+  shadowed.emplace_back(name, binding);
+  binding = gen_id();
+  return binding;
 }
 
-inline void symbol_table::pop_scope(scope &s) {
-  for (auto &&node : s.shadowed_symbols) {
-    name_to_id.erase(node.key());
-    name_to_id.insert(std::move(node));
+inline void symbol_table::pop_scope(scope s) {
+  assert(s.first_shadowed <= std::size(shadowed));
+  // Unwind in reverse, names bound twice in one scope get their outer
+  // binding back
+  while (std::size(shadowed) > s.first_shadowed) {
+    const auto [name, id] = shadowed.back();
+    shadowed.pop_back();
+    bindings[symbol_index(name)] = id;
   }
 }
 
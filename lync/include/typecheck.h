@@ -0,0 +1,81 @@
+#ifndef LYN_TYPECHECK_H
+#define LYN_TYPECHECK_H
+
+#include "expr.h"
+#include "id_table.h"
+#include "source_manager.h"
+#include "string_table.h"
+#include "symbol_table.h"
+#include "types.h"
+#include <cstddef>
+#include <cstdio>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+namespace lyn {
+
+class name_resolver;
+
+// Type environment of the typecheck pass. Sessions keep one alive across
+// updates, so only changed definitions need to be checked again.
+class typecheck_t {
+public:
+  typecheck_t(std::pmr::monotonic_buffer_resource &alloc, FILE *diag,
+              const source_manager &sources, int first_local_id);
+
+  type *visit(expr &target);
+
+  void setup_primitive_types(const symbol_table &symtab,
+                             const string_table &stbl);
+  void register_typevar(int id) {
+    type_for_id(id) = new (alloc_type()) type{type_variable{}};
+  }
+  void register_type(int id, type *t) { type_for_id(id) = t; }
+  // Gives a toplevel definition a fresh type, either its declared type or a
+  // new type variable
+  void register_toplevel(const toplevel_expr &expr);
+  bool check_toplevel(toplevel_expr &expr, const string_table &stbl);
+  // Like check_toplevel, but also resolves the names used by the definition
+  // in the same traversal
+  bool check_toplevel(toplevel_expr &expr, const string_table &stbl,
+                      name_resolver &names);
+
+  type *get_type_for_id(int id) const {
+    return id < first_local_id ? global_types.at(id) : local_types.at(id);
+  }
+
+  type *import_type_expr(const type_expr &expr);
+  // Returns the function type with the given parameters and result. Types
+  // without type variables are hash-consed, so each of them exists once.
+  type *make_function_type(std::vector<type *> &params, type *result);
+
+private:
+  template <class Resolver> type *infer(expr &target, Resolver &names);
+  template <class Resolver>
+  bool check_value(toplevel_expr &expr, const string_table &stbl,
+                   Resolver &names);
+  void *alloc_type() { return alloc.allocate(sizeof(type), alignof(type)); }
+  type *&type_for_id(int id) {
+    return id < first_local_id ? global_types[id] : local_types[id];
+  }
+
+  std::pmr::monotonic_buffer_resource &alloc;
+  FILE *diag;
+  // Source locations of diagnostics are resolved here
+  const source_manager &sources;
+  int first_local_id;
+  // Types of primitives and globals are indexed by id, types of locals are
+  // only kept for the definition being checked
+  id_table<type *> global_types;
+  id_table<type *> local_types;
+  // Hash-consed function types, keyed by the hash of their components
+  std::unordered_multimap<std::size_t, type *> function_types;
+  type *int_t;
+  type *bool_t;
+  type *unit_t;
+};
+
+} // namespace lyn
+
+#endif
@@ -17,10 +17,16 @@ struct unit_type {};
 struct function_type {
   span<type *> params;
   type *result;
+  // Set for hash-consed function types, which contain no type variables
+  bool ground = false;
 };
 
+// Type variables form a union-find forest: a bound variable points towards
+// the representative of its class, rank bounds the height of the tree below
+// an unbound variable.
 struct type_variable {
-  type *target;
+  type *target = nullptr;
+  int rank = 0;
 };
 
 using all_types =
@@ -1,60 +1,326 @@
 #include "expr.h"
+#include "interface.h"
+#include "module_cache.h"
 #include "passes.h"
+#include "session.h"
 #include "string_table.h"
 #include "symbol_table.h"
+#include <atomic>
+#include <climits>
 #include <cstdio>
+#include <cstdlib>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
 namespace {
 
 const char help_text[] =
-    "Usage: lync [options] <input-file>\n"
+    "Usage: lync [options] <input-file>...\n"
     " -o <file>\tSpecifies the output file\n"
     " -d\tDumps the intermediate format instead of generating code\n"
     " -s\tSimply performs a syntax check and exits\n"
-    " -h\tPrints this message\n";
+    " -j <n>\tProcesses up to n input files in parallel\n"
+    " -M\tWrites the included files as Makefile rule to <output>.d\n"
+    " -e\tWrites the module interface of each input file to <input>.lyni\n"
+    " -R\tKeeps every value in its own stack slot instead of allocating\n"
+    "\tregisters, for debugging\n"
+    " -n <n>\tInlines definitions of up to n instructions into their\n"
+    "\tcallers, 0 disables inlining (default 8)\n"
+    " -i\tLoads the input files into a session and reads further\n"
+    "\tdefinitions from stdin, printing the code of every definition that\n"
+    "\thad to be compiled again\n"
+    " -h\tPrints this message\n"
+    "If multiple input files are given, each of them is compiled to its own\n"
+    "output file, replacing the extension of the input with .s (or .anf when\n"
+    "dumping the intermediate format).\n";
+
+enum driver_mode {
+  stop,
+  syntax_only,
+  dump_ir,
+  full_compile,
+};
+
+struct driver_options {
+  driver_mode mode = full_compile;
+  bool write_dependencies = false;
+  bool write_interface = false;
+  lyn::value_placement placement = lyn::value_placement::registers;
+  int inline_threshold = lyn::compilation_context{}.inline_threshold;
+  // Included modules are cached across all input files
+  lyn::module_cache *modules = nullptr;
+};
+
+// An input file processed by the parallel driver. Each job is compiled with
+// its own compilation_context, diagnostics are buffered and printed in the
+// order of the input files once all jobs finished.
+struct job {
+  const char *input_name;
+  std::string output_name;
+  std::string diagnostics = {};
+  bool ok = false;
+};
+
+std::string replace_extension(std::string_view name,
+                              std::string_view extension) {
+  const auto slash = name.find_last_of('/');
+  auto dot = name.find_last_of('.');
+  if (dot == std::string_view::npos ||
+      (slash != std::string_view::npos && dot < slash))
+    dot = std::size(name);
+  return std::string{name.substr(0, dot)} + std::string{extension};
+}
+
+std::string output_name_for(std::string_view input_name, driver_mode mode) {
+  return replace_extension(input_name, mode == dump_ir ? ".anf" : ".s");
+}
+
+bool write_interface(std::string_view input_name,
+                     const std::vector<lyn::toplevel_expr> &decls,
+                     const lyn::compilation_context &cc) {
+  const std::string name =
+      replace_extension(input_name, lyn::interface_extension);
+  FILE *const out = fopen(name.c_str(), "wb");
+  if (!out) {
+    fprintf(cc.diag, "error: Could not open interface file \"%s\"\n",
+            name.c_str());
+    return false;
+  }
+  const bool written = lyn::write_interface(decls, cc.stbl, out);
+  if (fclose(out) != 0 || !written) {
+    fprintf(cc.diag, "error: Could not write interface file \"%s\"\n",
+            name.c_str());
+    return false;
+  }
+  return true;
+}
 
 std::unique_ptr<lyn::anf_context, lyn::delete_anf>
 exec_frontend(FILE *input, std::string_view file_name,
-              lyn::compilation_context &cc) {
+              const driver_options &options, lyn::compilation_context &cc) {
   auto decls = lyn::parse(input, file_name, cc);
   if (!decls)
     return nullptr;
-  if (!lyn::alpha_convert(*decls, cc.symtab))
+  // Syntax checks keep the passes separate, reporting unbound names before
+  // any type error
+  if (options.mode == syntax_only) {
+    if (!lyn::alpha_convert(*decls, cc) || !lyn::typecheck(*decls, cc))
+      return nullptr;
+  } else if (!lyn::resolve_and_typecheck(*decls, cc)) {
     return nullptr;
-  if (!lyn::typecheck(*decls, cc.symtab, cc.type_alloc))
+  }
+  if (options.write_interface && !write_interface(file_name, *decls, cc))
     return nullptr;
-  return lyn::genanf(*decls, cc.stbl, cc.symtab);
+  return lyn::genanf(*decls, cc);
+}
+
+// Writes a Makefile rule making output depend on the input and all files it
+// included. Every included file also gets an empty rule, so make does not
+// fail when one of them is removed.
+bool write_dependencies(const char *input_name, const std::string &output_name,
+                        const lyn::compilation_context &cc) {
+  const std::string dep_name = output_name + ".d";
+  FILE *const out = fopen(dep_name.c_str(), "w");
+  if (!out) {
+    fprintf(cc.diag, "error: Could not open dependency file \"%s\"\n",
+            dep_name.c_str());
+    return false;
+  }
+  const auto print_escaped = [out](std::string_view name) {
+    for (const char c : name) {
+      if (c == ' ' || c == '#')
+        fputc('\\', out);
+      if (c == '$')
+        fputc('$', out);
+      fputc(c, out);
+    }
+  };
+  print_escaped(output_name);
+  fputs(":", out);
+  fputc(' ', out);
+  print_escaped(input_name);
+  for (auto &&name : cc.included_files) {
+    fputs(" \\\n ", out);
+    print_escaped(name);
+  }
+  fputc('\n', out);
+  for (auto &&name : cc.included_files) {
+    fputc('\n', out);
+    print_escaped(name);
+    fputs(":\n", out);
+  }
+  return fclose(out) == 0;
+}
+
+bool compile(const char *input_name, const std::string &output_name,
+             FILE *target, const driver_options &options,
+             lyn::compilation_context &cc) {
+  cc.modules = options.modules;
+  cc.inline_threshold = options.inline_threshold;
+  FILE *const input = fopen(input_name, "r");
+  if (!input) {
+    fprintf(cc.diag, "error: Could not open input file \"%s\"\n", input_name);
+    return false;
+  }
+  const auto anf_ctx = exec_frontend(input, input_name, options, cc);
+  fclose(input);
+  if (!anf_ctx)
+    return false;
+  switch (options.mode) {
+  case syntax_only:
+    break;
+  case dump_ir:
+    lyn::print_anf(*anf_ctx, target);
+    break;
+  case full_compile:
+    lyn::genasm(*anf_ctx, cc.symtab, target, options.placement);
+    break;
+  case stop:
+    lyn::unreachable();
+  }
+  return !options.write_dependencies ||
+         write_dependencies(input_name, output_name, cc);
+}
+
+std::string read_back(FILE *file) {
+  std::string result;
+  std::rewind(file);
+  char buffer[4096];
+  std::size_t read_bytes;
+  while ((read_bytes = std::fread(buffer, 1u, sizeof(buffer), file)) != 0u)
+    result.append(buffer, read_bytes);
+  return result;
+}
+
+void run_job(job &j, const driver_options &options) {
+  lyn::compilation_context cc;
+  FILE *const diag = std::tmpfile();
+  if (diag)
+    cc.diag = diag;
+  FILE *target = nullptr;
+  if (options.mode != syntax_only) {
+    target = fopen(j.output_name.c_str(), "w");
+    if (!target)
+      fprintf(cc.diag, "error: Could not open output file \"%s\"\n",
+              j.output_name.c_str());
+  }
+  if (options.mode == syntax_only || target) {
+    try {
+      j.ok = compile(j.input_name, j.output_name, target, options, cc);
+    } catch (const std::exception &e) {
+      fprintf(cc.diag, "%s: %s\n", j.input_name, e.what());
+    }
+  }
+  if (target) {
+    fclose(target);
+    if (!j.ok)
+      std::remove(j.output_name.c_str());
+  }
+  if (diag) {
+    j.diagnostics = read_back(diag);
+    fclose(diag);
+  }
+}
+
+void run_jobs(std::vector<job> &jobs, const driver_options &options,
+              unsigned worker_count) {
+  std::atomic<std::size_t> next_job = 0;
+  const auto worker = [&] {
+    for (std::size_t i = next_job++; i < std::size(jobs); i = next_job++)
+      run_job(jobs[i], options);
+  };
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < worker_count && i < std::size(jobs); ++i)
+    workers.emplace_back(worker);
+  worker();
+  for (auto &&thread : workers)
+    thread.join();
+}
+
+// Sends an update to the session and prints the code of all definitions
+// that were compiled again
+bool update_session(lyn::session &session, lyn::source_buffer buffer,
+                    std::string_view file_name, FILE *target,
+                    driver_mode mode, lyn::value_placement placement) try {
+  const auto names = session.update(std::move(buffer), file_name);
+  if (!names)
+    return false;
+  auto ctx = session.code_for(*names);
+  if (mode == dump_ir)
+    lyn::print_anf(ctx, target);
+  else if (mode == full_compile)
+    lyn::genasm(ctx, session.context().symtab, target, placement);
+  fflush(target);
+  return true;
+} catch (const std::exception &e) {
+  fprintf(stderr, "%s\n", e.what());
+  return false;
+}
+
+int run_session(char **inputs, char **inputs_end, FILE *target,
+                driver_mode mode, lyn::value_placement placement,
+                int inline_threshold) {
+  lyn::session session;
+  session.context().inline_threshold = inline_threshold;
+  int code = 0;
+  for (; inputs != inputs_end; ++inputs) {
+    auto buffer = lyn::source_buffer::open(*inputs);
+    if (!buffer) {
+      fprintf(stderr, "error: Could not open input file \"%s\"\n", *inputs);
+      return 1;
+    }
+    if (!update_session(session, std::move(*buffer), *inputs, target, mode,
+                        placement))
+      return 1;
+  }
+  // Collect lines until all parentheses are closed, so a definition can span
+  // multiple lines
+  std::string pending;
+  int depth = 0;
+  for (int c; (c = fgetc(stdin)) != EOF;) {
+    pending.push_back(static_cast<char>(c));
+    if (c == '(')
+      ++depth;
+    else if (c == ')')
+      --depth;
+    if (c != '\n' || depth > 0)
+      continue;
+    if (!update_session(session, lyn::source_buffer::copy(pending), "<stdin>",
+                        target, mode, placement))
+      code = 1;
+    pending.clear();
+    depth = 0;
+  }
+  if (!std::empty(pending) &&
+      !update_session(session, lyn::source_buffer::copy(pending), "<stdin>",
+                      target, mode, placement))
+    code = 1;
+  return code;
 }
 
 } // namespace
 
 int main(int argc, char **argv) try {
-  enum mode_t {
-    stop,
-    syntax_only,
-    dump_ir,
-    full_compile,
-  } mode = full_compile;
+  driver_mode mode = full_compile;
   int code = 0;
-  std::string_view input_name;
-  FILE *input = nullptr;
   FILE *target = stdout;
+  const char *target_name = nullptr;
+  bool explicit_target = false;
+  bool write_dependencies = false;
+  bool write_interface = false;
+  bool interactive = false;
+  lyn::value_placement placement = lyn::value_placement::registers;
+  int inline_threshold = lyn::compilation_context{}.inline_threshold;
+  unsigned worker_count = 1;
   int ret;
-  while (ret = getopt(argc, argv, "ho:ds"), ret != -1 && mode != stop) {
+  while (ret = getopt(argc, argv, "ho:dsj:MeiRn:"), ret != -1 && mode != stop) {
     switch (ret) {
     case 'o':
-      if (std::string_view("-") == optarg) {
-        target = stdout;
-      } else {
-        target = fopen(optarg, "w");
-        if (!target) {
-          fprintf(stderr, "Could not open output file \"%s\"\n", optarg);
-          mode = stop;
-          code = 1;
-        }
-      }
+      explicit_target = true;
+      target_name = std::string_view("-") == optarg ? nullptr : optarg;
       break;
     case 'd':
       mode = dump_ir;
@@ -62,6 +328,42 @@ int main(int argc, char **argv) try {
     case 's':
       mode = syntax_only;
       break;
+    case 'M':
+      write_dependencies = true;
+      break;
+    case 'e':
+      write_interface = true;
+      break;
+    case 'i':
+      interactive = true;
+      break;
+    case 'R':
+      placement = lyn::value_placement::stack;
+      break;
+    case 'n': {
+      char *end;
+      const long threshold = std::strtol(optarg, &end, 10);
+      if (*end != '\0' || threshold < 0 || threshold > INT_MAX / 2) {
+        fprintf(stderr, "Invalid inlining threshold \"%s\"\n", optarg);
+        mode = stop;
+        code = 1;
+      } else {
+        inline_threshold = static_cast<int>(threshold);
+      }
+      break;
+    }
+    case 'j': {
+      char *end;
+      const long count = std::strtol(optarg, &end, 10);
+      if (*end != '\0' || count < 1) {
+        fprintf(stderr, "Invalid number of jobs \"%s\"\n", optarg);
+        mode = stop;
+        code = 1;
+      } else {
+        worker_count = static_cast<unsigned>(count);
+      }
+      break;
+    }
     case 'h':
       fputs(help_text, stdout);
       mode = stop;
@@ -73,71 +375,44 @@ int main(int argc, char **argv) try {
       break;
     }
   }
-  lyn::compilation_context cc;
-  switch (mode) {
-  case syntax_only:
-    for (int i = optind; i < argc; ++i) {
-      input_name = argv[i];
-      input = fopen(argv[i], "r");
-      if (!input) {
-        fprintf(stderr, "error: Could not open input file \"%s\"\n", argv[i]);
-        code = 1;
-        continue;
-      }
-      if (!exec_frontend(input, input_name, cc))
-        code = 1;
-      cc.expr_alloc.release();
-      cc.type_alloc.release();
-    }
-    break;
-  case dump_ir:
-    if (optind + 1 < argc) {
-      fputs(
-          "warning: Only the first source file is respected when dumping IR\n",
-          stderr);
-    }
-    if (optind < argc) {
-      input = fopen(argv[optind], "r");
-      input_name = argv[optind];
-      if (!input) {
-        fprintf(stderr, "error: Could not open input file \"%s\"\n",
-                argv[optind]);
-        code = 1;
-      } else {
-        const auto anf_ctx = exec_frontend(input, input_name, cc);
-        if (!anf_ctx) {
-          code = 1;
-          break;
-        }
-        lyn::print_anf(*anf_ctx, target);
-      }
-    }
-    break;
-  case full_compile:
-    if (optind + 1 < argc) {
-      fputs(
-          "warning: Only the first source file is respected when dumping IR\n",
-          stderr);
-    }
-    if (optind < argc) {
-      input = fopen(argv[optind], "r");
-      input_name = argv[optind];
-      if (!input) {
-        fprintf(stderr, "error: Could not open input file \"%s\"\n",
-                argv[optind]);
-        code = 1;
-      } else {
-        const auto anf_ctx = exec_frontend(input, input_name, cc);
-        if (!anf_ctx) {
-          code = 1;
-          break;
-        }
-        lyn::genasm(*anf_ctx, target);
-      }
+  if (mode == stop)
+    return code;
+  if (!interactive && argc - optind > 1 && explicit_target &&
+      mode != syntax_only) {
+    fputs("error: -o cannot be used with multiple input files\n", stderr);
+    return 1;
+  }
+  // The target is only opened once the command line is known to be valid,
+  // so rejected invocations leave it untouched
+  if (target_name) {
+    target = fopen(target_name, "w");
+    if (!target) {
+      fprintf(stderr, "Could not open output file \"%s\"\n", target_name);
+      return 1;
     }
-    break;
-  case stop:
-    break;
+  }
+  if (interactive)
+    return run_session(argv + optind, argv + argc, target, mode, placement,
+                       inline_threshold);
+  if (optind == argc)
+    return code;
+  lyn::module_cache modules;
+  const driver_options options{mode,      write_dependencies, write_interface,
+                               placement, inline_threshold,   &modules};
+  if (optind + 1 == argc) {
+    lyn::compilation_context cc;
+    const std::string output_name =
+        target_name ? target_name : output_name_for(argv[optind], mode);
+    return compile(argv[optind], output_name, target, options, cc) ? 0 : 1;
+  }
+  std::vector<job> jobs;
+  for (int i = optind; i < argc; ++i)
+    jobs.push_back(job{argv[i], output_name_for(argv[i], mode)});
+  run_jobs(jobs, options, worker_count);
+  for (auto &&j : jobs) {
+    fputs(j.diagnostics.c_str(), stderr);
+    if (!j.ok)
+      code = 1;
   }
   return code;
 } catch (const std::exception &e) {
@@ -1,4 +1,5 @@
 #include "expr.h"
+#include "name_resolver.h"
 #include "passes.h"
 #include "primitives.h"
 #include "symbol_table.h"
@@ -6,65 +7,54 @@
 #include <algorithm>
 #include <cstdio>
 #include <string_view>
-#include <unordered_map>
 
 namespace lyn {
 
 namespace {
 
-bool alpha_convert_expr(symbol_table &table, lyn::expr *expr_ptr) {
+bool alpha_convert_expr(name_resolver &names, lyn::expr *expr_ptr) {
   return std::visit(
       [&](auto &&expr) {
         using expr_t = std::decay_t<decltype(expr)>;
         if constexpr (std::is_same_v<expr_t, variable_expr>) {
-          expr.id = table[expr.name];
-          const bool res = expr.id != 0;
-          if (!res) {
-            auto &&sloc = expr_ptr->sloc;
-            fprintf(stderr, "%.*s:%d:%d: error: No binding \"%.*s\" in scope\n",
-                    static_cast<int>(std::size(sloc.file_name)),
-                    std::data(sloc.file_name), sloc.line, sloc.col,
-                    static_cast<int>(std::size(expr.name)),
-                    std::data(expr.name));
-          }
-          return res;
+          return names.resolve(expr, expr_ptr->sloc);
         }
         if constexpr (std::is_same_v<expr_t, apply_expr>) {
-          return alpha_convert_expr(table, expr.func) &&
+          return alpha_convert_expr(names, expr.func) &&
                  std::all_of(std::begin(expr.args), std::end(expr.args),
                              [&](auto &&arg) {
-                               return alpha_convert_expr(table, arg);
+                               return alpha_convert_expr(names, arg);
                              });
         }
         if constexpr (std::is_same_v<expr_t, lambda_expr>) {
-          scope current_scope;
+          const scope current_scope = names.push_scope();
           for (auto &&param : expr.params) {
-            param.id = table.register_local(param.name, current_scope);
+            names.bind(param.name, param.id);
           }
-          const bool result = alpha_convert_expr(table, expr.body) != 0;
-          table.pop_scope(current_scope);
+          const bool result = alpha_convert_expr(names, expr.body) != 0;
+          names.pop_scope(current_scope);
           return result;
         }
         if constexpr (std::is_same_v<expr_t, let_expr>) {
           if (!std::all_of(std::begin(expr.bindings), std::end(expr.bindings),
                            [&](auto &&binding) {
-                             return alpha_convert_expr(table, binding.body);
+                             return alpha_convert_expr(names, binding.body);
                            }))
             return false;
-          scope current_scope;
+          const scope current_scope = names.push_scope();
           for (auto &&binding : expr.bindings) {
-            binding.id = table.register_local(binding.name, current_scope);
+            names.bind(binding.name, binding.id);
           }
           const bool result = std::all_of(
               std::begin(expr.body), std::end(expr.body),
-              [&](auto &&ptr) { return alpha_convert_expr(table, ptr); });
-          table.pop_scope(current_scope);
+              [&](auto &&ptr) { return alpha_convert_expr(names, ptr); });
+          names.pop_scope(current_scope);
           return result;
         }
         if constexpr (std::is_same_v<expr_t, if_expr>) {
-          return alpha_convert_expr(table, expr.cond) &&
-                 alpha_convert_expr(table, expr.then) &&
-                 alpha_convert_expr(table, expr.els);
+          return alpha_convert_expr(names, expr.cond) &&
+                 alpha_convert_expr(names, expr.then()) &&
+                 alpha_convert_expr(names, expr.els());
         }
         return true;
       },
@@ -73,18 +63,47 @@ bool alpha_convert_expr(symbol_table &table, lyn::expr *expr_ptr) {
 
 } // namespace
 
-bool alpha_convert(std::vector<toplevel_expr> &exprs, symbol_table &table) {
+bool name_resolver::resolve(variable_expr &variable, source_location sloc) {
+  variable.id = cc.symtab[variable.name];
+  if (variable.id != 0)
+    return true;
+  const source_position pos = cc.sources.position(sloc);
+  fprintf(cc.diag, "%.*s:%d:%d: error: No binding \"%.*s\" in scope\n",
+          static_cast<int>(std::size(pos.file_name)), std::data(pos.file_name),
+          pos.line, pos.col,
+          static_cast<int>(std::size(cc.stbl[variable.name])),
+          std::data(cc.stbl[variable.name]));
+  return false;
+}
+
+void register_primitives(compilation_context &cc) {
   for (auto &&primitive : primitives) {
-    table.register_primitive(primitive.name);
+    cc.symtab.register_primitive(cc.stbl.intern(primitive.name));
   }
-  table.start_global_registering();
+  cc.symtab.start_global_registering();
+}
+
+void register_globals(std::vector<toplevel_expr> &exprs,
+                      compilation_context &cc) {
+  symbol_table &table = cc.symtab;
+  register_primitives(cc);
   for (auto &&decl : exprs) {
     decl.id = table.register_global(decl.name);
   }
   table.start_local_registering();
-  return std::all_of(std::begin(exprs), std::end(exprs), [&](auto &&decl) {
-    return !decl.value || alpha_convert_expr(table, decl.value);
-  });
+}
+
+bool alpha_convert(toplevel_expr &def, compilation_context &cc) {
+  def.first_local_id = cc.symtab.get_next_id();
+  name_resolver names{cc};
+  return !def.value || alpha_convert_expr(names, def.value);
+}
+
+bool alpha_convert(std::vector<toplevel_expr> &exprs,
+                   compilation_context &cc) {
+  register_globals(exprs, cc);
+  return std::all_of(std::begin(exprs), std::end(exprs),
+                     [&](auto &&decl) { return alpha_convert(decl, cc); });
 }
 
 } // namespace lyn
@@ -1,11 +1,16 @@
 #include "anf.h"
+#include "anf_passes.h"
 #include "expr.h"
+#include "id_table.h"
 #include "passes.h"
+#include "primitives.h"
 #include "symbol_table.h"
 
 #include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <string>
 #include <string_view>
-#include <unordered_map>
 #include <utility>
 #include <variant>
 
@@ -14,68 +19,270 @@ namespace lyn {
 namespace {
 
 struct fun_info {
-  std::string_view name;
+  symbol name;
   const lambda_expr &expr;
   bool global;
+  // Locals of enclosing definitions used by a lifted lambda, range of
+  // anf_generator::free_variables
+  anf_operands free_variables = {};
 };
 
 struct local_info {
-  int ref_count = 0;
-  std::variant<std::monostate, int, std::string_view> rewritable;
+  // Name of the global the local was loaded from, or of the definition of the
+  // lifted lambda bound to it. Calls of it can refer to the global directly.
+  std::optional<symbol> global;
+  // Local standing in for this one in the definition being generated, 0 if
+  // the local is used as is
+  int renamed = 0;
+  // Lambda nesting depth of the local's binding, counted from its toplevel
+  // definition
+  int depth = 0;
+  // For lets binding lambdas: How often the local is referenced, and how
+  // many of these references are calls
+  bool binds_lambda = false;
+  int references = 0;
+  int calls = 0;
+  // Locals of enclosing lambdas passed along when calling the lifted lambda
+  anf_operands free_variables = {};
 };
 
 class anf_generator {
 public:
-  explicit anf_generator(string_table &stbl, const symbol_table &symtab)
-      : stbl{stbl}, symtab{symtab}, next_id{symtab.get_next_id()} {}
+  anf_generator(string_table &stbl, const symbol_table &symtab,
+                int first_local_id)
+      : stbl{stbl}, symtab{symtab}, next_id{symtab.get_next_id()},
+        local_infos{first_local_id} {}
 
-  void push_func(std::string_view name, lambda_expr *ptr) {
+  void push_func(symbol name, lambda_expr *ptr) {
+    find_lifted_lambdas(*ptr);
     funcs_to_generate.push_back(fun_info{name, *ptr, true});
   }
 
   void run();
   int get_next_id() const { return next_id; }
-  std::unordered_map<int, local_info> get_local_infos() && {
-    return std::move(local_infos);
-  }
   anf_context &&get_context() && { return std::move(ctx); }
 
 private:
+  void find_lifted_lambdas(const lambda_expr &expr);
+  void count_references(const lyn::expr &value);
+  void collect_free_variables(const lyn::expr &value);
+  void reference(int id);
+  // Lambdas bound by let which are only ever called are lifted to
+  // definitions of their own, taking their free variables as additional
+  // parameters. Others cannot use locals of enclosing lambdas.
+  bool is_lifted(int id) {
+    const local_info &info = local_infos[id];
+    return info.binds_lambda && info.references == info.calls;
+  }
+  bool is_local(int id) const { return id >= symtab.get_first_local_id(); }
+  // Names of the definitions generated for lambdas contain a character
+  // identifiers cannot, so they never clash with globals of the program
+  symbol lambda_name(int id) {
+    return stbl.intern("fun#" + std::to_string(id));
+  }
   int visit_expr(const lyn::expr &value);
+  // Id 0 is returned for expressions without a value, like empty let bodies
+  local_info &info_for(int id) { return id ? local_infos[id] : no_value; }
+  int local_id(int id) {
+    const int renamed = local_infos[id].renamed;
+    return renamed ? renamed : id;
+  }
   template <class... Args> void emit_instr(Args &&...args) {
-    current_block->content.emplace_back(std::forward<Args>(args)...);
+    blocks[current_block].emplace_back(std::forward<Args>(args)...);
+  }
+  template <class Range, class Fun>
+  anf_operands add_operands(const Range &range, Fun &&fun) {
+    const auto first = static_cast<std::uint32_t>(std::size(ctx.operands));
+    for (auto &&elem : range)
+      ctx.operands.push_back(fun(elem));
+    return {first, static_cast<std::uint32_t>(std::size(ctx.operands) - first)};
   }
+  int new_block();
+  // Moves the blocks of the current definition to ctx
+  void finish_def(symbol name, bool global);
 
   string_table &stbl;
   const symbol_table &symtab;
   int next_id;
 
-  std::unordered_map<int, local_info> local_infos;
+  // Ids of locals and values generated for all functions, offset by the
+  // first local id of the definitions being generated
+  id_table<local_info> local_infos;
+  local_info no_value;
   std::vector<fun_info> funcs_to_generate = {};
   anf_context ctx = {};
-  anf_def *current_def = nullptr;
-  basic_block *current_block = nullptr;
+  // Blocks of the definition being generated. They are filled in an
+  // arbitrary order and copied to ctx once the definition is done, the
+  // instruction vectors are kept for the next definition.
+  std::vector<std::vector<anf_expr>> blocks;
+  std::size_t block_count = 0;
+  int current_block = 0;
+  std::vector<int> pending_args;
   bool tail_pos = true;
+  // Free variables of all lifted lambdas
+  std::vector<int> free_variables;
+  // Free variables found so far for each lambda enclosing the expression
+  // being searched, indexed by nesting depth
+  std::vector<std::vector<int>> open_lambdas;
+  int depth = 0;
 };
 
+void anf_generator::find_lifted_lambdas(const lambda_expr &expr) {
+  count_references(*expr.body);
+  depth = 0;
+  for (auto &&param : expr.params)
+    local_infos[param.id].depth = 0;
+  collect_free_variables(*expr.body);
+}
+
+void anf_generator::count_references(const lyn::expr &value) {
+  std::visit(
+      [this](auto &&expr) {
+        using expr_t = std::decay_t<decltype(expr)>;
+        if constexpr (std::is_same_v<expr_t, variable_expr>) {
+          if (is_local(expr.id))
+            ++local_infos[expr.id].references;
+        }
+        if constexpr (std::is_same_v<expr_t, apply_expr>) {
+          const auto *const func =
+              std::get_if<variable_expr>(&expr.func->content);
+          if (func && is_local(func->id))
+            ++local_infos[func->id].calls;
+          count_references(*expr.func);
+          for (lyn::expr *arg : expr.args)
+            count_references(*arg);
+        }
+        if constexpr (std::is_same_v<expr_t, lambda_expr>)
+          count_references(*expr.body);
+        if constexpr (std::is_same_v<expr_t, let_expr>) {
+          for (auto &&binding : expr.bindings) {
+            local_infos[binding.id].binds_lambda =
+                std::holds_alternative<lambda_expr>(binding.body->content);
+            count_references(*binding.body);
+          }
+          for (lyn::expr *ptr : expr.body)
+            count_references(*ptr);
+        }
+        if constexpr (std::is_same_v<expr_t, if_expr>) {
+          count_references(*expr.cond);
+          count_references(*expr.then());
+          count_references(*expr.els());
+        }
+      },
+      value.content);
+}
+
+// Adds a local to the free variables of all enclosing lambdas nested deeper
+// than its binding
+void anf_generator::reference(int id) {
+  for (int level = local_infos[id].depth + 1; level <= depth; ++level) {
+    std::vector<int> &found = open_lambdas[level];
+    if (std::find(std::begin(found), std::end(found), id) == std::end(found))
+      found.push_back(id);
+  }
+}
+
+// Finds the free variables of the lifted lambdas. Calling a lifted lambda
+// uses its free variables, which are known by then, as a let binding is
+// searched before its body.
+void anf_generator::collect_free_variables(const lyn::expr &value) {
+  std::visit(
+      [this](auto &&expr) {
+        using expr_t = std::decay_t<decltype(expr)>;
+        if constexpr (std::is_same_v<expr_t, variable_expr>) {
+          if (!is_local(expr.id))
+            return;
+          if (!is_lifted(expr.id)) {
+            reference(expr.id);
+            return;
+          }
+          const anf_operands lifted = local_infos[expr.id].free_variables;
+          for (std::uint32_t i = 0; i != lifted.size; ++i)
+            reference(free_variables[lifted.first + i]);
+        }
+        if constexpr (std::is_same_v<expr_t, apply_expr>) {
+          collect_free_variables(*expr.func);
+          for (lyn::expr *arg : expr.args)
+            collect_free_variables(*arg);
+        }
+        if constexpr (std::is_same_v<expr_t, lambda_expr>) {
+          ++depth;
+          if (static_cast<int>(std::size(open_lambdas)) <= depth)
+            open_lambdas.resize(depth + 1);
+          open_lambdas[depth].clear();
+          for (auto &&param : expr.params)
+            local_infos[param.id].depth = depth;
+          collect_free_variables(*expr.body);
+          --depth;
+        }
+        if constexpr (std::is_same_v<expr_t, let_expr>) {
+          for (auto &&binding : expr.bindings) {
+            collect_free_variables(*binding.body);
+            local_infos[binding.id].depth = depth;
+            if (!is_lifted(binding.id))
+              continue;
+            // The free variables of the lambda just searched
+            const std::vector<int> &found = open_lambdas[depth + 1];
+            local_infos[binding.id].free_variables = {
+                static_cast<std::uint32_t>(std::size(free_variables)),
+                static_cast<std::uint32_t>(std::size(found))};
+            free_variables.insert(std::end(free_variables), std::begin(found),
+                                  std::end(found));
+          }
+          for (lyn::expr *ptr : expr.body)
+            collect_free_variables(*ptr);
+        }
+        if constexpr (std::is_same_v<expr_t, if_expr>) {
+          collect_free_variables(*expr.cond);
+          collect_free_variables(*expr.then());
+          collect_free_variables(*expr.els());
+        }
+      },
+      value.content);
+}
+
+int anf_generator::new_block() {
+  if (block_count == std::size(blocks))
+    blocks.emplace_back();
+  return static_cast<int>(block_count++);
+}
+
+void anf_generator::finish_def(symbol name, bool global) {
+  ctx.defs.push_back(
+      anf_def{name, static_cast<std::uint32_t>(std::size(ctx.blocks)),
+              static_cast<std::uint32_t>(block_count), global});
+  for (std::size_t i = 0; i < block_count; ++i) {
+    ctx.blocks.push_back(
+        basic_block{static_cast<std::uint32_t>(std::size(ctx.instrs)),
+                    static_cast<std::uint32_t>(std::size(blocks[i]))});
+    ctx.instrs.insert(std::end(ctx.instrs), std::begin(blocks[i]),
+                      std::end(blocks[i]));
+    blocks[i].clear();
+  }
+  block_count = 0;
+}
+
 void anf_generator::run() {
   for (std::size_t i = 0; i < std::size(funcs_to_generate); ++i) {
-    auto &&info = funcs_to_generate[i];
-    anf_def new_def;
-    new_def.name = info.name;
-    anf_receive prologue;
-    prologue.args.reserve(std::size(info.expr.params));
-    std::transform(std::begin(info.expr.params), std::end(info.expr.params),
-                   std::back_inserter(prologue.args),
-                   [](const variable_expr &expr) { return expr.id; });
-    new_def.blocks.emplace_back();
-    current_def = &new_def;
-    current_block = &new_def.blocks.back();
-    emit_instr(std::move(prologue));
+    const fun_info info = funcs_to_generate[i];
+    current_block = new_block();
+    // Free variables are received after the parameters, under ids of their
+    // own
+    anf_operands params = add_operands(
+        info.expr.params, [](auto &&param) { return param.id; });
+    for (std::uint32_t j = 0; j != info.free_variables.size; ++j) {
+      const int id = free_variables[info.free_variables.first + j];
+      local_infos[id].renamed = next_id++;
+      ctx.operands.push_back(local_infos[id].renamed);
+      ++params.size;
+    }
+    emit_instr(anf_receive{params});
     emit_instr(anf_adjust_stack{});
     tail_pos = true;
     visit_expr(*info.expr.body);
-    ctx.defs.emplace_back(std::move(new_def));
+    finish_def(info.name, info.global);
+    for (std::uint32_t j = 0; j != info.free_variables.size; ++j)
+      local_infos[free_variables[info.free_variables.first + j]].renamed = 0;
   }
 }
 
@@ -90,15 +297,15 @@ int anf_generator::visit_expr(const lyn::expr &value) {
       return constant_id;
     }
     if constexpr (std::is_same_v<expr_t, variable_expr>) {
-      if (expr.id >= symtab.get_first_local_id()) {
-        ++local_infos[expr.id].ref_count;
+      if (is_local(expr.id)) {
+        const int id = local_id(expr.id);
         if (tail_pos)
-          emit_instr(anf_return{expr.id});
-        return expr.id;
+          emit_instr(anf_return{id});
+        return id;
       }
       const auto global_id = next_id++;
       emit_instr(anf_global{expr.name, global_id});
-      local_infos[global_id] = {tail_pos ? 1 : 0, expr.name};
+      info_for(global_id).global = expr.name;
       if (tail_pos)
         emit_instr(anf_return{global_id});
       return global_id;
@@ -106,31 +313,35 @@ int anf_generator::visit_expr(const lyn::expr &value) {
     if constexpr (std::is_same_v<expr_t, apply_expr>) {
       const bool tail_pos_saved = std::exchange(tail_pos, false);
       const int fid = visit_expr(*expr.func);
-      std::vector<int> args;
-      args.reserve(std::size(expr.args));
-      std::transform(std::begin(expr.args), std::end(expr.args),
-                     std::back_inserter(args), [this](lyn::expr *arg) {
-                       const int local_id = visit_expr(*arg);
-                       ++local_infos[local_id].ref_count;
-                       return local_id;
-                     });
+      // Arguments may contain calls themselves, so their ids are collected
+      // on a stack before adding them to the operand pool
+      const std::size_t first_arg = std::size(pending_args);
+      for (lyn::expr *arg : expr.args) {
+        pending_args.push_back(visit_expr(*arg));
+      }
+      const anf_operands lifted = info_for(fid).free_variables;
+      for (std::uint32_t i = 0; i != lifted.size; ++i)
+        pending_args.push_back(local_id(free_variables[lifted.first + i]));
+      const anf_operands args = add_operands(
+          span<int>{std::data(pending_args) + first_arg,
+                    std::size(pending_args) - first_arg},
+          [](int id) { return id; });
+      pending_args.resize(first_arg);
       tail_pos = tail_pos_saved;
       int call_id = 0;
       if (!tail_pos)
         call_id = next_id++;
-      decltype(std::declval<anf_call>().call_target) target = fid;
-      if (std::holds_alternative<std::string_view>(
-              local_infos[fid].rewritable)) {
-        target = std::get<std::string_view>(local_infos[fid].rewritable);
-      } else {
-        ++local_infos[fid].ref_count;
+      anf_call call{fid, {}, args, call_id, tail_pos};
+      if (const auto global = info_for(fid).global) {
+        call.target = 0;
+        call.name = *global;
       }
-      emit_instr(anf_call{target, std::move(args), call_id, tail_pos});
+      emit_instr(call);
       return call_id;
     }
     if constexpr (std::is_same_v<expr_t, lambda_expr>) {
       const int lambda_id = next_id++;
-      const auto fun_name = stbl.store("fun" + std::to_string(lambda_id));
+      const symbol fun_name = lambda_name(lambda_id);
       funcs_to_generate.push_back(fun_info{fun_name, expr, false});
       emit_instr(anf_global{fun_name, lambda_id});
       return lambda_id;
@@ -138,6 +349,15 @@ int anf_generator::visit_expr(const lyn::expr &value) {
     if constexpr (std::is_same_v<expr_t, let_expr>) {
       const auto tail_pos_saved = std::exchange(tail_pos, false);
       for (auto &&binding : expr.bindings) {
+        if (is_lifted(binding.id)) {
+          const int lambda_id = next_id++;
+          const symbol fun_name = lambda_name(lambda_id);
+          funcs_to_generate.push_back(
+              fun_info{fun_name, std::get<lambda_expr>(binding.body->content),
+                       false, local_infos[binding.id].free_variables});
+          local_infos[binding.id].global = fun_name;
+          continue;
+        }
         const int bid = visit_expr(*binding.body);
         emit_instr(anf_assoc{bid, binding.id});
       }
@@ -152,26 +372,19 @@ int anf_generator::visit_expr(const lyn::expr &value) {
     if constexpr (std::is_same_v<expr_t, if_expr>) {
       const auto tail_pos_saved = std::exchange(tail_pos, false);
       const int cond_id = visit_expr(*expr.cond);
-      ++local_infos[cond_id].ref_count;
       tail_pos = tail_pos_saved;
-      // Please be very aware in the below section that inserting into
-      // current_def->blocks might get you a dangling current_block
-      const std::size_t this_block_idx =
-          current_block - current_def->blocks.data();
-      current_def->blocks.emplace_back();
-      current_def->blocks.emplace_back();
+      const int cond_block = current_block;
       int ret_id = -1;
+      int cont_block = -1;
       if (!tail_pos) {
-        current_def->blocks.emplace_back();
+        cont_block = new_block();
         ret_id = next_id++;
       }
-      const int total_blocks = std::size(current_def->blocks);
-      const int then_block = total_blocks - 2;
-      const int else_block = total_blocks - 1;
-      const int cont_block = total_blocks - 3;
+      const int then_block = new_block();
+      const int else_block = new_block();
       const auto emit_branch = [this, cont_block,
                                 ret_id](int block, const lyn::expr &expr) {
-        current_block = &current_def->blocks[block];
+        current_block = block;
         emit_instr(anf_adjust_stack{});
         const int expr_id = visit_expr(expr);
         if (tail_pos)
@@ -179,93 +392,280 @@ int anf_generator::visit_expr(const lyn::expr &value) {
         emit_instr(anf_assoc{expr_id, ret_id});
         emit_instr(anf_jump{cont_block});
       };
-      current_block = &current_def->blocks[this_block_idx];
+      current_block = cond_block;
       emit_instr(anf_cond{cond_id, then_block, else_block});
-      emit_branch(then_block, *expr.then);
-      emit_branch(else_block, *expr.els);
+      emit_branch(then_block, *expr.then());
+      emit_branch(else_block, *expr.els());
       if (tail_pos)
         return 0;
-      current_block = &current_def->blocks[cont_block];
+      current_block = cont_block;
       return ret_id;
     }
   };
   return std::visit(visit_fun, value.content);
 }
 
-struct anf_dead_code_elim {
-  bool can_be_deleted(const anf_expr &expr);
+// Removes instructions whose results are never used. Use counts are exact,
+// so removing an instruction makes the instructions computing its operands
+// dead as well once their last use is gone. Calls are removed if they cannot
+// have side effects. Definitions of lambdas no longer referenced are removed
+// as well.
+class anf_dead_code_elim {
+public:
+  anf_dead_code_elim(anf_context &ctx, const symbol_table &symtab)
+      : ctx{ctx}, symtab{symtab}, use_counts{ctx.first_id},
+        first_def{ctx.first_id}, constants{ctx.first_id} {}
+
   void run();
 
-  std::unordered_map<int, local_info> local_infos;
-  anf_context ctx;
+private:
+  // Id of the value computed by instr if instr may be removed once the value
+  // is unused, 0 otherwise
+  int removable_def(const anf_expr &instr) const;
+  bool is_pure(symbol name) const {
+    return symbol_index(name) < std::size(pure_functions) &&
+           pure_functions[symbol_index(name)];
+  }
+  bool is_pure_call(const anf_call &call) const;
+  void find_pure_functions();
+  void remove_unreferenced_defs();
+
+  anf_context &ctx;
+  const symbol_table &symtab;
+  id_table<int> use_counts;
+  // Instructions defining each id, as index + 1 into ctx.instrs chained
+  // through next_def. Ids joined from both branches of an if have two.
+  id_table<int> first_def;
+  std::vector<int> next_def;
+  // Indexed by symbol
+  std::vector<bool> pure_functions;
+  // Indexed by symbol, whether it is / or %
+  std::vector<bool> divisions;
+  // Values of the ids of constants
+  id_table<std::optional<int>> constants;
 };
 
-bool anf_dead_code_elim::can_be_deleted(const anf_expr &expr) {
+int anf_dead_code_elim::removable_def(const anf_expr &instr) const {
   return std::visit(
-      [this](auto &&expr) {
-        using expr_t = std::decay_t<decltype(expr)>;
-        if (std::is_same_v<expr_t, anf_receive>)
-          // Receives cannot be deleted, they are required for stack management
-          return false;
-        if (std::is_same_v<expr_t, anf_adjust_stack>)
-          return false;
-        if constexpr (std::is_same_v<expr_t, anf_global>)
-          return local_infos[expr.id].ref_count == 0;
-        if constexpr (std::is_same_v<expr_t, anf_constant>)
-          return local_infos[expr.id].ref_count == 0;
-        if (std::is_same_v<expr_t, anf_call>)
-          // TODO: We could inspect the call for being side-effect free here
-          return false;
-        if constexpr (std::is_same_v<expr_t, anf_assoc>)
-          return local_infos[expr.id].ref_count == 0;
-        if (std::is_same_v<expr_t, anf_cond>)
-          return false;
-        if (std::is_same_v<expr_t, anf_return>)
-          return false;
-        if (std::is_same_v<expr_t, anf_jump>)
+      [this](auto &&val) {
+        using val_t = std::decay_t<decltype(val)>;
+        if constexpr (std::is_same_v<val_t, anf_global> ||
+                      std::is_same_v<val_t, anf_constant> ||
+                      std::is_same_v<val_t, anf_assoc>)
+          return val.id;
+        if constexpr (std::is_same_v<val_t, anf_call>)
+          return !val.is_tail && is_pure_call(val) ? val.res_id : 0;
+        // Receives and stack adjustments are required for stack management,
+        // the others have effects
+        return 0;
+      },
+      instr);
+}
+
+// Division by zero is up to the runtime, so / and % are only pure if the
+// divisor is a constant other than 0
+bool anf_dead_code_elim::is_pure_call(const anf_call &call) const {
+  if (call.target)
+    return false;
+  if (is_pure(call.name))
+    return true;
+  const auto args = ctx.operands_of(call.args);
+  if (symbol_index(call.name) >= std::size(divisions) ||
+      !divisions[symbol_index(call.name)] || std::size(args) != 2)
+    return false;
+  const std::optional<int> &divisor = constants.get(args[1]);
+  return divisor && *divisor != 0;
+}
+
+// Primitives are pure except for / and %. Functions are pure if they only
+// make pure calls by name. Functions calling themselves never become pure,
+// as they may not terminate.
+void anf_dead_code_elim::find_pure_functions() {
+  pure_functions.assign(ctx.stbl->size(), false);
+  divisions.assign(ctx.stbl->size(), false);
+  for (auto &&primitive : primitives) {
+    const auto name = ctx.stbl->find(primitive.name);
+    // Globals may shadow primitives
+    if (name && symtab[*name] < symtab.get_first_global_id()) {
+      pure_functions[symbol_index(*name)] = primitive.pure;
+      divisions[symbol_index(*name)] = primitive.divides;
+    }
+  }
+  for (auto &&instr : ctx.instrs)
+    if (const auto *const constant = std::get_if<anf_constant>(&instr))
+      constants[constant->id] = constant->value;
+  const auto is_pure_def = [this](const anf_def &def) {
+    for (auto &&block : ctx.blocks_of(def))
+      for (auto &&instr : ctx.instrs_of(block)) {
+        if (std::holds_alternative<anf_global_assign>(instr))
           return false;
-        if (std::is_same_v<expr_t, anf_global_assign>)
+        const auto *const call = std::get_if<anf_call>(&instr);
+        if (call && !is_pure_call(*call))
           return false;
-      },
-      expr);
+      }
+    return true;
+  };
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (auto &&def : ctx.defs)
+      if (!is_pure(def.name) && is_pure_def(def)) {
+        pure_functions[symbol_index(def.name)] = true;
+        changed = true;
+      }
+  }
+}
+
+// Definitions of lambdas are dropped once no definition which is kept
+// refers to them, like lifted lambdas whose calls were all inlined
+void anf_dead_code_elim::remove_unreferenced_defs() {
+  std::vector<int> def_of_symbol(ctx.stbl->size(), -1);
+  std::vector<bool> referenced(std::size(ctx.defs));
+  std::vector<int> worklist;
+  const auto keep = [&](int def) {
+    if (!referenced[def]) {
+      referenced[def] = true;
+      worklist.push_back(def);
+    }
+  };
+  // Names with several definitions keep all of them, as it is unknown which
+  // of them a reference means
+  for (std::size_t def = 0; def != std::size(ctx.defs); ++def) {
+    int &slot = def_of_symbol[symbol_index(ctx.defs[def].name)];
+    if (slot >= 0) {
+      keep(slot);
+      keep(static_cast<int>(def));
+    } else {
+      slot = static_cast<int>(def);
+    }
+    if (ctx.defs[def].global)
+      keep(static_cast<int>(def));
+  }
+  const auto refer = [&](symbol name) {
+    if (const int def = def_of_symbol[symbol_index(name)]; def >= 0)
+      keep(def);
+  };
+  while (!std::empty(worklist)) {
+    const int def = worklist.back();
+    worklist.pop_back();
+    for (auto &&block : ctx.blocks_of(ctx.defs[def]))
+      for (auto &&instr : ctx.instrs_of(block)) {
+        if (const auto *const call = std::get_if<anf_call>(&instr))
+          if (!call->target)
+            refer(call->name);
+        if (const auto *const global = std::get_if<anf_global>(&instr))
+          refer(global->name);
+      }
+  }
+  std::size_t kept = 0;
+  for (std::size_t def = 0; def != std::size(ctx.defs); ++def)
+    if (referenced[def])
+      ctx.defs[kept++] = ctx.defs[def];
+  ctx.defs.resize(kept);
 }
 
 void anf_dead_code_elim::run() {
-  for (auto &&def : ctx.defs) {
-    for (auto &&block : def.blocks) {
-      const auto block_end = std::end(block.content);
-      block.content.erase(std::remove_if(std::begin(block.content), block_end,
-                                         [this](const anf_expr &expr) {
-                                           return can_be_deleted(expr);
-                                         }),
-                          block_end);
+  find_pure_functions();
+  next_def.assign(std::size(ctx.instrs), 0);
+  std::vector<int> worklist;
+  for (std::size_t i = 0; i < std::size(ctx.instrs); ++i) {
+    for_each_use(ctx, ctx.instrs[i], [this](int id) { ++use_counts[id]; });
+    if (const int id = removable_def(ctx.instrs[i])) {
+      next_def[i] = std::exchange(first_def[id], static_cast<int>(i) + 1);
+      worklist.push_back(static_cast<int>(i));
     }
   }
+  std::vector<bool> removed(std::size(ctx.instrs));
+  while (!std::empty(worklist)) {
+    const int idx = worklist.back();
+    worklist.pop_back();
+    if (removed[idx] || use_counts[removable_def(ctx.instrs[idx])] != 0)
+      continue;
+    removed[idx] = true;
+    for_each_use(ctx, ctx.instrs[idx], [&](int id) {
+      if (--use_counts[id] != 0)
+        return;
+      for (int def = first_def[id]; def; def = next_def[def - 1])
+        worklist.push_back(def - 1);
+    });
+  }
+
+  // Compacts the instructions of all blocks in place
+  std::size_t kept = 0;
+  for (auto &&block : ctx.blocks) {
+    const std::size_t first = kept;
+    for (std::uint32_t i = block.first; i != block.first + block.size; ++i)
+      if (!removed[i])
+        ctx.instrs[kept++] = ctx.instrs[i];
+    block = {static_cast<std::uint32_t>(first),
+             static_cast<std::uint32_t>(kept - first)};
+  }
+  ctx.instrs.resize(kept);
+  remove_unreferenced_defs();
 }
 
 } // namespace
 
 std::unique_ptr<anf_context, delete_anf>
-genanf(std::vector<toplevel_expr> &exprs, string_table &stbl,
-       const symbol_table &symtab) {
-  anf_generator gen(stbl, symtab);
+genanf(std::vector<toplevel_expr> &exprs, compilation_context &cc) {
+  string_table &stbl = cc.stbl;
+  int first_local_id = cc.symtab.get_next_id();
+  for (auto &&expr : exprs)
+    if (expr.value)
+      first_local_id = std::min(first_local_id, expr.first_local_id);
+  anf_generator gen(stbl, cc.symtab, first_local_id);
   for (auto &&expr : exprs) {
     if (!expr.value)
       continue;
     if (!std::holds_alternative<lambda_expr>(expr.value->content)) {
-      fprintf(stderr, "Will not generate anything for %.*s!\n",
-              static_cast<int>(std::size(expr.name)), expr.name.data());
+      fprintf(cc.diag, "Will not generate anything for %.*s!\n",
+              static_cast<int>(std::size(stbl[expr.name])),
+              stbl[expr.name].data());
       continue;
     }
     gen.push_func(expr.name, &std::get<lambda_expr>(expr.value->content));
   }
   gen.run();
-  anf_dead_code_elim eliminator{std::move(gen).get_local_infos(),
-                                std::move(gen).get_context()};
-  eliminator.run();
+  int next_id = gen.get_next_id();
+  std::unique_ptr<anf_context, delete_anf> ctx{
+      new anf_context{std::move(gen).get_context()}};
+  ctx->stbl = &stbl;
+  ctx->first_id = first_local_id;
+  // Inlined definitions are folded along with the arguments of their calls
+  next_id = inline_calls(*ctx, cc.inline_threshold, next_id);
+  next_id = fold_constants(*ctx, cc.symtab, next_id);
+  anf_dead_code_elim{*ctx, cc.symtab}.run();
+  // Runs last, as dead code elimination relies on self calls to recognize
+  // definitions which may not terminate
+  next_id = loop_self_tail_calls(*ctx, next_id);
+  cc.symtab.reserve_ids(next_id);
+  return ctx;
+}
 
-  return std::unique_ptr<anf_context, delete_anf>{
-      new anf_context{std::move(eliminator.ctx)}};
+void append_anf(anf_context &target, const anf_context &source) {
+  const auto block_offset =
+      static_cast<std::uint32_t>(std::size(target.blocks));
+  const auto instr_offset =
+      static_cast<std::uint32_t>(std::size(target.instrs));
+  const auto operand_offset =
+      static_cast<std::uint32_t>(std::size(target.operands));
+  for (anf_def def : source.defs) {
+    def.first_block += block_offset;
+    target.defs.push_back(def);
+  }
+  for (basic_block block : source.blocks) {
+    block.first += instr_offset;
+    target.blocks.push_back(block);
+  }
+  for (anf_expr instr : source.instrs) {
+    if (auto *const receive = std::get_if<anf_receive>(&instr))
+      receive->args.first += operand_offset;
+    if (auto *const call = std::get_if<anf_call>(&instr))
+      call->args.first += operand_offset;
+    target.instrs.push_back(instr);
+  }
+  target.operands.insert(std::end(target.operands),
+                         std::begin(source.operands),
+                         std::end(source.operands));
 }
 
 void delete_anf::operator()(anf_context *ctx) { delete ctx; }
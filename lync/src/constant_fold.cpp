@@ -0,0 +1,379 @@
+#include "anf.h"
+#include "anf_passes.h"
+#include "id_table.h"
+#include "primitives.h"
+#include "symbol_table.h"
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+namespace lyn {
+
+namespace {
+
+// Computes a primitive like the runtime library does. Nothing is returned if
+// the result is up to the runtime.
+std::optional<int> evaluate_primitive(std::string_view name,
+                                      const std::vector<int> &args) {
+  if (name == "true")
+    return 1;
+  if (name == "false" || name == "<>")
+    return 0;
+  // Other primitives loaded as values are functions
+  if (std::empty(args))
+    return std::nullopt;
+  // Words wrap around like on the target
+  const int sa = args[0];
+  const int sb = std::size(args) > 1 ? args[1] : 0;
+  const auto a = static_cast<std::uint32_t>(sa);
+  const auto b = static_cast<std::uint32_t>(sb);
+  const auto word = [](std::uint32_t value) {
+    return static_cast<int>(value);
+  };
+  if (name == "+")
+    return word(a + b);
+  if (name == "-")
+    return word(a - b);
+  if (name == "*")
+    return word(a * b);
+  // The runtime divides unsigned words and leaves division by zero undefined
+  if (name == "/" || name == "%") {
+    if (!b)
+      return std::nullopt;
+    return word(name == "/" ? a / b : a % b);
+  }
+  // Shifts use the lowest byte of the amount, like the Thumb instructions
+  if (name == "shl")
+    return (b & 0xffu) < 32 ? word(a << (b & 0xffu)) : 0;
+  if (name == "shr")
+    return (b & 0xffu) < 32 ? sa >> (b & 0xffu) : (sa < 0 ? -1 : 0);
+  if (name == "lor" || name == "or")
+    return word(a | b);
+  if (name == "land" || name == "and")
+    return word(a & b);
+  if (name == "lxor" || name == "xor")
+    return word(a ^ b);
+  if (name == "neg")
+    return word(0u - a);
+  if (name == "not")
+    return !sa;
+  if (name == "=")
+    return sa == sb;
+  if (name == "!=")
+    return sa != sb;
+  if (name == "<")
+    return sa < sb;
+  if (name == ">")
+    return sa > sb;
+  if (name == "<=")
+    return sa <= sb;
+  if (name == ">=")
+    return sa >= sb;
+  return std::nullopt;
+}
+
+// What is known about the value of an id. Ids assigned in several blocks are
+// known if all reachable assignments agree.
+struct known_value {
+  enum { unassigned, constant, function, varying } state = unassigned;
+  int value = 0;
+  // Global function the id holds
+  symbol name = {};
+};
+
+// Conditional constant propagation: Blocks are evaluated once all of their
+// predecessors are, so every value is known before it is used, and blocks
+// only entered through branches that are never taken are skipped. Then the
+// definition is rewritten, leaving out these blocks and merging the blocks
+// entered unconditionally from a single block into it. Globals loaded as
+// values are propagated like constants, so calls of locals known to hold a
+// global function refer to it by name.
+class constant_folder {
+public:
+  constant_folder(anf_context &ctx, const symbol_table &symtab, int next_id)
+      : ctx{ctx}, symtab{symtab}, next_id{next_id}, values{ctx.first_id} {}
+
+  int run();
+
+private:
+  std::optional<int> constant_of(int id) {
+    if (id < ctx.first_id || values[id].state != known_value::constant)
+      return std::nullopt;
+    return values[id].value;
+  }
+  std::optional<symbol> function_of(int id) {
+    if (id < ctx.first_id || values[id].state != known_value::function)
+      return std::nullopt;
+    return values[id].name;
+  }
+  void assign(int id, known_value value);
+  void assign(int id, std::optional<int> value) {
+    assign(id, value ? known_value{known_value::constant, *value}
+                     : known_value{known_value::varying});
+  }
+  // Name of the global function called, if known
+  std::optional<symbol> called_name(const anf_call &call) {
+    return call.target ? function_of(call.target) : call.name;
+  }
+  std::optional<int> fold(symbol name, anf_operands args);
+  // Calls fun(target, live) for all blocks control may leave block to
+  template <class Fun> void for_each_successor(std::uint32_t block, Fun &&fun);
+  // Returns false if the blocks of def contain a loop
+  bool analyze(const anf_def &def);
+  void evaluate(const anf_expr &instr);
+  void rewrite(anf_def &def);
+  void emit_block(std::uint32_t block, bool merged);
+  void emit_transfer(int target);
+
+  anf_context &ctx;
+  const symbol_table &symtab;
+  int next_id;
+  // Index into primitives by symbol, -1 for names of other functions
+  std::vector<int> primitive_of;
+  id_table<known_value> values;
+  std::vector<int> assigned_ids;
+  std::vector<int> args;
+
+  // State of the definition being folded, indexed by its blocks
+  std::uint32_t first_block = 0;
+  std::vector<int> pending_preds;
+  std::vector<int> live_preds;
+  std::vector<bool> reached;
+  std::vector<bool> entered_unconditionally;
+  std::vector<int> new_index;
+  std::vector<std::uint32_t> ready;
+
+  std::vector<basic_block> new_blocks;
+  std::vector<anf_expr> new_instrs;
+};
+
+void constant_folder::assign(int id, known_value value) {
+  known_value &known = values[id];
+  if (known.state == known_value::unassigned) {
+    assigned_ids.push_back(id);
+    known = value;
+  } else if (value.state != known.state || value.value != known.value ||
+             value.name != known.name) {
+    known.state = known_value::varying;
+  }
+}
+
+std::optional<int> constant_folder::fold(symbol name, anf_operands operands) {
+  if (symbol_index(name) >= std::size(primitive_of) ||
+      primitive_of[symbol_index(name)] < 0)
+    return std::nullopt;
+  args.clear();
+  for (const int id : ctx.operands_of(operands)) {
+    const auto value = constant_of(id);
+    if (!value)
+      return std::nullopt;
+    args.push_back(*value);
+  }
+  return evaluate_primitive(primitives[primitive_of[symbol_index(name)]].name,
+                            args);
+}
+
+template <class Fun>
+void constant_folder::for_each_successor(std::uint32_t block, Fun &&fun) {
+  const auto instrs = ctx.instrs_of(ctx.blocks[first_block + block]);
+  if (std::empty(instrs))
+    return;
+  if (const auto *const cond = std::get_if<anf_cond>(&instrs.back())) {
+    const auto value = constant_of(cond->cond_id);
+    fun(cond->then_block, !value || *value);
+    fun(cond->else_block, !value || !*value);
+  }
+  if (const auto *const jump = std::get_if<anf_jump>(&instrs.back()))
+    fun(jump->target, true);
+}
+
+bool constant_folder::analyze(const anf_def &def) {
+  first_block = def.first_block;
+  pending_preds.assign(def.block_count, 0);
+  live_preds.assign(def.block_count, 0);
+  reached.assign(def.block_count, false);
+  entered_unconditionally.assign(def.block_count, false);
+  for (std::uint32_t block = 0; block != def.block_count; ++block)
+    for_each_successor(block, [this](int target, bool) {
+      ++pending_preds[target];
+    });
+  reached[0] = true;
+  for (std::uint32_t block = 0; block != def.block_count; ++block)
+    if (!pending_preds[block])
+      ready.push_back(block);
+  std::uint32_t evaluated = 0;
+  while (!std::empty(ready)) {
+    const std::uint32_t block = ready.back();
+    ready.pop_back();
+    ++evaluated;
+    if (reached[block])
+      for (auto &&instr : ctx.instrs_of(ctx.blocks[first_block + block]))
+        evaluate(instr);
+    int live_successors = 0;
+    for_each_successor(block, [&](int, bool live) {
+      live_successors += reached[block] && live;
+    });
+    for_each_successor(block, [&](int target, bool live) {
+      if (reached[block] && live) {
+        reached[target] = true;
+        ++live_preds[target];
+        entered_unconditionally[target] = live_successors == 1;
+      }
+      if (--pending_preds[target] == 0)
+        ready.push_back(target);
+    });
+  }
+  return evaluated == def.block_count;
+}
+
+void constant_folder::evaluate(const anf_expr &instr) {
+  std::visit(
+      [this](auto &&val) {
+        using val_t = std::decay_t<decltype(val)>;
+        if constexpr (std::is_same_v<val_t, anf_global>) {
+          if (const auto value = fold(val.name, {}))
+            assign(val.id, value);
+          else
+            assign(val.id, known_value{known_value::function, 0, val.name});
+        }
+        if constexpr (std::is_same_v<val_t, anf_constant>)
+          assign(val.id, val.value);
+        if constexpr (std::is_same_v<val_t, anf_call>) {
+          if (!val.is_tail)
+            if (const auto name = called_name(val))
+              if (const auto value = fold(*name, val.args))
+                assign(val.res_id, value);
+        }
+        if constexpr (std::is_same_v<val_t, anf_assoc>) {
+          if (val.alias >= ctx.first_id &&
+              values[val.alias].state != known_value::unassigned)
+            assign(val.id, values[val.alias]);
+          else
+            assign(val.id, known_value{known_value::varying});
+        }
+      },
+      instr);
+}
+
+void constant_folder::rewrite(anf_def &def) {
+  new_index.assign(def.block_count, -1);
+  int block_count = 0;
+  for (std::uint32_t block = 0; block != def.block_count; ++block)
+    if (reached[block] &&
+        (live_preds[block] != 1 || !entered_unconditionally[block]))
+      new_index[block] = block_count++;
+  def.first_block = static_cast<std::uint32_t>(std::size(new_blocks));
+  def.block_count = static_cast<std::uint32_t>(block_count);
+  for (std::size_t block = 0; block != std::size(new_index); ++block) {
+    if (new_index[block] < 0)
+      continue;
+    const auto first = static_cast<std::uint32_t>(std::size(new_instrs));
+    emit_block(block, false);
+    new_blocks.push_back(basic_block{
+        first, static_cast<std::uint32_t>(std::size(new_instrs)) - first});
+  }
+}
+
+void constant_folder::emit_block(std::uint32_t block, bool merged) {
+  auto instrs = ctx.instrs_of(ctx.blocks[first_block + block]);
+  // The stack of merged blocks is set up by the block they are merged into
+  if (merged && !std::empty(instrs) &&
+      std::holds_alternative<anf_adjust_stack>(instrs.front()))
+    instrs = {std::data(instrs) + 1, std::size(instrs) - 1};
+  for (auto &&instr : instrs)
+    std::visit(
+        [&](auto &&val) {
+          using val_t = std::decay_t<decltype(val)>;
+          if constexpr (std::is_same_v<val_t, anf_global>) {
+            if (const auto value = constant_of(val.id)) {
+              new_instrs.emplace_back(anf_constant{*value, val.id});
+              return;
+            }
+          }
+          if constexpr (std::is_same_v<val_t, anf_call>) {
+            const auto name = called_name(val);
+            if (!name) {
+              new_instrs.push_back(instr);
+              return;
+            }
+            if (const auto value = fold(*name, val.args)) {
+              const int id = val.is_tail ? next_id++ : val.res_id;
+              new_instrs.emplace_back(anf_constant{*value, id});
+              if (val.is_tail)
+                new_instrs.emplace_back(anf_return{id});
+              return;
+            }
+            new_instrs.emplace_back(
+                anf_call{0, *name, val.args, val.res_id, val.is_tail});
+            return;
+          }
+          if constexpr (std::is_same_v<val_t, anf_cond>) {
+            if (const auto value = constant_of(val.cond_id))
+              emit_transfer(*value ? val.then_block : val.else_block);
+            else
+              new_instrs.emplace_back(anf_cond{val.cond_id,
+                                               new_index[val.then_block],
+                                               new_index[val.else_block]});
+            return;
+          }
+          if constexpr (std::is_same_v<val_t, anf_jump>) {
+            emit_transfer(val.target);
+            return;
+          }
+          new_instrs.push_back(instr);
+        },
+        instr);
+}
+
+void constant_folder::emit_transfer(int target) {
+  if (new_index[target] < 0)
+    emit_block(target, true);
+  else
+    new_instrs.emplace_back(anf_jump{new_index[target]});
+}
+
+int constant_folder::run() {
+  primitive_of.assign(ctx.stbl->size(), -1);
+  for (int i = 0; i < number_of_primitives; ++i) {
+    const auto name = ctx.stbl->find(primitives[i].name);
+    // Globals may shadow primitives
+    if (name && symtab[*name] < symtab.get_first_global_id())
+      primitive_of[symbol_index(*name)] = i;
+  }
+  new_blocks.reserve(std::size(ctx.blocks));
+  new_instrs.reserve(std::size(ctx.instrs));
+  for (auto &&def : ctx.defs) {
+    if (analyze(def)) {
+      rewrite(def);
+    } else {
+      const auto blocks = ctx.blocks_of(def);
+      def.first_block = static_cast<std::uint32_t>(std::size(new_blocks));
+      for (auto &&block : blocks) {
+        const auto first = static_cast<std::uint32_t>(std::size(new_instrs));
+        const auto instrs = ctx.instrs_of(block);
+        new_instrs.insert(std::end(new_instrs), std::begin(instrs),
+                          std::end(instrs));
+        new_blocks.push_back(basic_block{first, block.size});
+      }
+    }
+    // Values are only propagated within a definition
+    for (const int id : assigned_ids)
+      values[id] = known_value{};
+    assigned_ids.clear();
+    ready.clear();
+  }
+  ctx.blocks = std::move(new_blocks);
+  ctx.instrs = std::move(new_instrs);
+  return next_id;
+}
+
+} // namespace
+
+int fold_constants(anf_context &ctx, const symbol_table &symtab, int next_id) {
+  return constant_folder{ctx, symtab, next_id}.run();
+}
+
+} // namespace lyn
@@ -1,204 +1,953 @@
 #include "anf.h"
+#include "id_table.h"
+#include "passes.h"
+#include "regalloc.h"
+#include "symbol_table.h"
 
 #include <algorithm>
+#include <cstdio>
 #include <stdexcept>
-#include <unordered_map>
+#include <string_view>
 #include <vector>
 
 namespace lyn {
 
-void genasm(anf_context &ctx, FILE *out) {
-  fputs("\t.arch armv5t\n"
-        "\t.thumb\n"
-        "\t.syntax unified\n"
-        "\t.section \".text\", \"ax\"\n",
-        out);
-  int label_offset = 1;
-  for (auto &&def : ctx.defs) {
-    if (def.global)
-      fprintf(out, "\t.global \"%.*s\"\n",
-              static_cast<int>(std::size(def.name)), def.name.data());
+namespace {
+
+// Stack slot of a local, tagged with the index of the function it belongs to.
+// This way the table of all locals does not need to be cleared between
+// functions.
+struct stack_slot {
+  std::size_t def_idx = -1;
+  int slot = 0;
+};
+
+enum class inline_op {
+  add,
+  sub,
+  mul,
+  shl,
+  shr,
+  bit_or,
+  bit_and,
+  bit_xor,
+  neg,
+  eq,
+  ne,
+  lt,
+  gt,
+  le,
+  ge,
+  bool_not,
+};
+
+// Primitives of liblyn whose code is emitted in place of calling them.
+// Division is left to the library.
+struct inline_primitive {
+  std::string_view name;
+  inline_op op;
+};
+
+const inline_primitive inline_primitives[] = {
+    {"+", inline_op::add},       {"-", inline_op::sub},
+    {"*", inline_op::mul},       {"shl", inline_op::shl},
+    {"shr", inline_op::shr},     {"lor", inline_op::bit_or},
+    {"land", inline_op::bit_and}, {"lxor", inline_op::bit_xor},
+    {"neg", inline_op::neg},     {"=", inline_op::eq},
+    {"!=", inline_op::ne},       {"<", inline_op::lt},
+    {">", inline_op::gt},        {"<=", inline_op::le},
+    {">=", inline_op::ge},       {"not", inline_op::bool_not},
+    {"or", inline_op::bit_or},   {"and", inline_op::bit_and},
+    {"xor", inline_op::bit_xor},
+};
+
+// Inline primitives by symbol
+std::vector<const inline_primitive *>
+find_inline_primitives(const anf_context &ctx, const symbol_table &symtab) {
+  std::vector<const inline_primitive *> result(ctx.stbl->size());
+  for (auto &&primitive : inline_primitives) {
+    const auto name = ctx.stbl->find(primitive.name);
+    // Globals may shadow primitives
+    if (name && symtab[*name] < symtab.get_first_global_id())
+      result[symbol_index(*name)] = &primitive;
+  }
+  return result;
+}
+
+constexpr int ip = 12;
+constexpr int lr = 14;
+
+const char *register_name(int reg) {
+  static const char *const names[] = {"r0", "r1", "r2",  "r3",  "r4", "r5",
+                                      "r6", "r7", "r8",  "r9",  "r10", "r11",
+                                      "ip", "sp", "lr", "pc"};
+  return names[reg];
+}
+
+void emit_move(FILE *out, int dst, int src) {
+  if (dst == src)
+    return;
+  // Moves between low registers have to set the flags on ARMv5
+  fprintf(out, dst < 8 && src < 8 ? "\tmovs %s, %s\n" : "\tmov %s, %s\n",
+          register_name(dst), register_name(src));
+}
+
+// Emits the Thumb code of a primitive computing rd from ra and rb, which may
+// be the same registers. No other low register is touched, as all of them
+// may hold values.
+void emit_primitive(FILE *out, inline_op op, int rd, int ra, int rb) {
+  const char *const d = register_name(rd);
+  const char *const a = register_name(ra);
+  const char *const b = rb >= 0 ? register_name(rb) : nullptr;
+  // Thumb only has two operand forms of these, which overwrite their first
+  // operand
+  const auto two_operands = [&](const char *mnemonic, bool commutative) {
+    if (rd == rb && rd != ra) {
+      if (commutative) {
+        fprintf(out, "\t%s %s, %s\n", mnemonic, d, a);
+        return;
+      }
+      // Computed in ra, which is restored from ip afterwards
+      fprintf(out,
+              "\tmov ip, %s\n"
+              "\t%s %s, %s\n"
+              "\tmovs %s, %s\n"
+              "\tmov %s, ip\n",
+              a, mnemonic, a, b, d, a, a);
+      return;
+    }
+    emit_move(out, rd, ra);
+    fprintf(out, "\t%s %s, %s\n", mnemonic, d, b);
+  };
+  const auto compare = [&](const char *branch) {
+    if (rd != ra && rd != rb) {
+      fprintf(out,
+              "\tmovs %s, #1\n"
+              "\tcmp %s, %s\n"
+              "\t%s 1f\n"
+              "\tmovs %s, #0\n"
+              "1:\n",
+              d, a, b, branch, d);
+      return;
+    }
     fprintf(out,
-            "\t.type \"%.*s\", %%function\n"
-            "\t.thumb_func\n"
-            "\"%.*s\":\n",
-            static_cast<int>(std::size(def.name)), def.name.data(),
-            static_cast<int>(std::size(def.name)), def.name.data());
-
-    std::unordered_map<int, int> local_to_stack_slot;
-    std::unordered_map<std::size_t, int> used_stack_slots;
-    used_stack_slots[0] = 0;
-    for (std::size_t block_idx = 0; block_idx != std::size(def.blocks);
-         ++block_idx) {
-      auto &&block = def.blocks[block_idx];
-      int parent_local_count = used_stack_slots.at(block_idx);
-      int local_count = parent_local_count;
-      int stack_offset = local_count;
-      const auto sp_offset_for_local = [&](int id) {
-        return (local_count - local_to_stack_slot.at(id) - 1) * 4;
-      };
-
-      fprintf(out, ".L%d:\n", static_cast<int>(label_offset + block_idx));
-      for (auto &&expr : block.content)
-        std::visit(
-            [&](auto &&val) {
-              using val_t = std::decay_t<decltype(val)>;
-              if constexpr (std::is_same_v<val_t, anf_receive>) {
-                local_count += std::size(val.args);
-                parent_local_count += std::size(val.args);
-                stack_offset += std::size(val.args);
-              }
-              if constexpr (std::is_same_v<val_t, anf_global>) {
-                local_count += 1;
-              }
-              if constexpr (std::is_same_v<val_t, anf_constant>) {
-                local_count += 1;
-              }
-              if constexpr (std::is_same_v<val_t, anf_call>) {
+            "\tcmp %s, %s\n"
+            "\t%s 1f\n"
+            "\tmovs %s, #0\n"
+            "\tb 2f\n"
+            "1:\n"
+            "\tmovs %s, #1\n"
+            "2:\n",
+            a, b, branch, d, d);
+  };
+  switch (op) {
+  case inline_op::add:
+    fprintf(out, "\tadds %s, %s, %s\n", d, a, b);
+    break;
+  case inline_op::sub:
+    fprintf(out, "\tsubs %s, %s, %s\n", d, a, b);
+    break;
+  case inline_op::mul:
+    // Multiplying a register by itself is unpredictable before ARMv6, so
+    // squares in place multiply by a copy in another register, which is
+    // restored from ip afterwards
+    if (rd == ra && rd == rb) {
+      const char *const t = register_name(rd == 0 ? 1 : 0);
+      fprintf(out,
+              "\tmov ip, %s\n"
+              "\tmovs %s, %s\n"
+              "\tmuls %s, %s\n"
+              "\tmov %s, ip\n",
+              t, t, d, d, t, t);
+      break;
+    }
+    two_operands("muls", true);
+    break;
+  case inline_op::shl:
+    two_operands("lsls", false);
+    break;
+  case inline_op::shr:
+    two_operands("asrs", false);
+    break;
+  case inline_op::bit_or:
+    two_operands("orrs", true);
+    break;
+  case inline_op::bit_and:
+    two_operands("ands", true);
+    break;
+  case inline_op::bit_xor:
+    two_operands("eors", true);
+    break;
+  case inline_op::neg:
+    fprintf(out, "\trsbs %s, %s, #0\n", d, a);
+    break;
+  // The carry of comparing the difference with 1 is clear iff it is 0, which
+  // sbcs turns into -1 or 0
+  case inline_op::eq:
+    fprintf(out,
+            "\tsubs %s, %s, %s\n"
+            "\tcmp %s, #1\n"
+            "\tsbcs %s, %s\n"
+            "\trsbs %s, %s, #0\n",
+            d, a, b, d, d, d, d, d);
+    break;
+  case inline_op::ne:
+    fprintf(out,
+            "\tsubs %s, %s, %s\n"
+            "\tcmp %s, #1\n"
+            "\tsbcs %s, %s\n"
+            "\tadds %s, #1\n",
+            d, a, b, d, d, d, d);
+    break;
+  case inline_op::lt:
+    compare("blt");
+    break;
+  case inline_op::gt:
+    compare("bgt");
+    break;
+  case inline_op::le:
+    compare("ble");
+    break;
+  case inline_op::ge:
+    compare("bge");
+    break;
+  // Booleans are 0 or 1
+  case inline_op::bool_not:
+    fprintf(out,
+            "\trsbs %s, %s, #0\n"
+            "\tadds %s, #1\n",
+            d, a, d);
+    break;
+  }
+}
+
+bool is_comparison(inline_op op) {
+  return op == inline_op::eq || op == inline_op::ne || op == inline_op::lt ||
+         op == inline_op::gt || op == inline_op::le || op == inline_op::ge;
+}
+
+// Condition code of a branch taken if the comparison op holds, or does not
+// hold if negated
+const char *condition_code(inline_op op, bool negated) {
+  switch (op) {
+  case inline_op::eq:
+    return negated ? "ne" : "eq";
+  case inline_op::ne:
+    return negated ? "eq" : "ne";
+  case inline_op::lt:
+    return negated ? "ge" : "lt";
+  case inline_op::gt:
+    return negated ? "le" : "gt";
+  case inline_op::le:
+    return negated ? "gt" : "le";
+  case inline_op::ge:
+    return negated ? "lt" : "ge";
+  default:
+    unreachable();
+  }
+}
+
+// Keeps every value in its own stack slot. The slots of the values defined
+// in a block are reserved when entering it. Only meant for debugging the
+// register allocator.
+class stack_code_generator {
+public:
+  stack_code_generator(const anf_context &ctx, FILE *out,
+                       const std::vector<const inline_primitive *> &inline_code)
+      : ctx{ctx}, out{out}, inline_code{inline_code},
+        local_to_stack_slot{ctx.first_id} {}
+
+  void emit(std::size_t def_idx, int label_offset);
+
+private:
+  const anf_context &ctx;
+  FILE *out;
+  const std::vector<const inline_primitive *> &inline_code;
+  id_table<stack_slot> local_to_stack_slot;
+  std::vector<int> used_stack_slots;
+};
+
+void stack_code_generator::emit(std::size_t def_idx, int label_offset) {
+  const auto blocks = ctx.blocks_of(ctx.defs[def_idx]);
+  const auto has_stack_slot = [&](int id) {
+    return id >= ctx.first_id &&
+           local_to_stack_slot[id].def_idx == def_idx;
+  };
+  const auto stack_slot_of = [&](int id) {
+    if (!has_stack_slot(id))
+      throw std::out_of_range{"No stack slot for local"};
+    return local_to_stack_slot[id].slot;
+  };
+  const auto assign_stack_slot = [&](int id, int slot) {
+    local_to_stack_slot[id] = stack_slot{def_idx, slot};
+  };
+  // Number of locals on the stack when entering each block, -1 for blocks
+  // not reached yet
+  used_stack_slots.assign(std::size(blocks), -1);
+  used_stack_slots[0] = 0;
+  for (std::size_t block_idx = 0; block_idx != std::size(blocks);
+       ++block_idx) {
+    const auto instrs = ctx.instrs_of(blocks[block_idx]);
+    if (used_stack_slots[block_idx] < 0)
+      throw std::out_of_range{"Block entered with unknown stack layout"};
+    int parent_local_count = used_stack_slots[block_idx];
+    int local_count = parent_local_count;
+    int stack_offset = local_count;
+    const auto sp_offset_for_local = [&](int id) {
+      return (local_count - stack_slot_of(id) - 1) * 4;
+    };
+
+    fprintf(out, ".L%d:\n", static_cast<int>(label_offset + block_idx));
+    for (auto &&expr : instrs)
+      std::visit(
+          [&](auto &&val) {
+            using val_t = std::decay_t<decltype(val)>;
+            if constexpr (std::is_same_v<val_t, anf_receive>) {
+              local_count += val.args.size;
+              parent_local_count += val.args.size;
+              stack_offset += val.args.size;
+            }
+            if constexpr (std::is_same_v<val_t, anf_global>) {
+              local_count += 1;
+            }
+            if constexpr (std::is_same_v<val_t, anf_constant>) {
+              local_count += 1;
+            }
+            if constexpr (std::is_same_v<val_t, anf_call>) {
+              local_count += 1;
+            }
+            if constexpr (std::is_same_v<val_t, anf_assoc>) {
+              if (!has_stack_slot(val.id))
                 local_count += 1;
+            }
+          },
+          expr);
+    for (auto &&expr : instrs) {
+      std::visit(
+          [&](auto &&val) {
+            using val_t = std::decay_t<decltype(val)>;
+            local_count = local_count;
+            if constexpr (std::is_same_v<val_t, anf_receive>) {
+              const auto args = ctx.operands_of(val.args);
+              if (std::size(args) > 4u) {
+                throw std::runtime_error{
+                    "Function with more than four arguments are currently "
+                    "not supported"};
               }
-            },
-            expr);
-      for (auto &&expr : block.content) {
-        std::visit(
-            [&](auto &&val) {
-              using val_t = std::decay_t<decltype(val)>;
-              local_count = local_count;
-              if constexpr (std::is_same_v<val_t, anf_receive>) {
-                if (std::size(val.args) > 4u) {
-                  throw std::runtime_error{
-                      "Function with more than four arguments are currently "
-                      "not supported"};
-                }
-                for (std::size_t i = 0; i < std::size(val.args); ++i) {
-                  local_to_stack_slot[val.args[i]] =
-                      std::size(val.args) - i - 1;
-                }
-                fprintf(out, "\tpush {");
-                for (int i = 0;
-                     static_cast<std::size_t>(i) < std::size(val.args); ++i) {
-                  fprintf(out, "r%d, ", i);
-                }
-                parent_local_count = std::size(val.args);
-                fputs("r6, lr}\n", out);
+              for (std::size_t i = 0; i < std::size(args); ++i) {
+                assign_stack_slot(args[i], std::size(args) - i - 1);
               }
-              if constexpr (std::is_same_v<val_t, anf_adjust_stack>) {
-                fprintf(out, "\tsub sp, sp, #%d\n",
-                        (local_count - parent_local_count) * 4);
+              fprintf(out, "\tpush {");
+              for (int i = 0; static_cast<std::size_t>(i) < std::size(args);
+                   ++i) {
+                fprintf(out, "r%d, ", i);
               }
-              if constexpr (std::is_same_v<val_t, anf_global>) {
-                const int stack_slot = stack_offset++;
-                local_to_stack_slot[val.id] = stack_slot;
-                fprintf(out,
-                        "\tldr r0, =\"%.*s\"\n"
-                        "\tstr r0, [sp, #%d]\n",
-                        static_cast<int>(std::size(val.name)), val.name.data(),
-                        sp_offset_for_local(val.id));
-              }
-              if constexpr (std::is_same_v<val_t, anf_constant>) {
-                const int stack_slot = stack_offset++;
-                local_to_stack_slot[val.id] = stack_slot;
-                fprintf(out,
-                        "\tldr r0, =#%d\n"
-                        "\tstr r0, [sp, #%d]\n",
-                        val.value, sp_offset_for_local(val.id));
-              }
-              if constexpr (std::is_same_v<val_t, anf_call>) {
-                if (std::size(val.arg_ids) > 4)
-                  throw std::runtime_error{"Sorry, more than 4 args are WIP"};
-                // Restore lr when tail calling
-                if (val.is_tail) {
-                  fprintf(out,
-                          "\tldr r0, [sp, #%d]\n"
-                          "\tmov lr, r0\n",
-                          (local_count + 1) * 4);
-                }
-                if (std::holds_alternative<int>(val.call_target)) {
-                  fprintf(out, "\tldr r4, [sp, #%d]\n",
-                          sp_offset_for_local(std::get<int>(val.call_target)));
-                }
-                for (std::size_t i = 0; i < std::size(val.arg_ids); ++i) {
+              parent_local_count = std::size(args);
+              fputs("r6, lr}\n", out);
+            }
+            if constexpr (std::is_same_v<val_t, anf_adjust_stack>) {
+              fprintf(out, "\tsub sp, sp, #%d\n",
+                      (local_count - parent_local_count) * 4);
+            }
+            if constexpr (std::is_same_v<val_t, anf_global>) {
+              const std::string_view name = ctx.name_of(val.name);
+              assign_stack_slot(val.id, stack_offset++);
+              fprintf(out,
+                      "\tldr r0, =\"%.*s\"\n"
+                      "\tstr r0, [sp, #%d]\n",
+                      static_cast<int>(std::size(name)), name.data(),
+                      sp_offset_for_local(val.id));
+            }
+            if constexpr (std::is_same_v<val_t, anf_constant>) {
+              assign_stack_slot(val.id, stack_offset++);
+              fprintf(out,
+                      "\tldr r0, =#%d\n"
+                      "\tstr r0, [sp, #%d]\n",
+                      val.value, sp_offset_for_local(val.id));
+            }
+            if constexpr (std::is_same_v<val_t, anf_call>) {
+              const auto args = ctx.operands_of(val.args);
+              const std::string_view name = ctx.name_of(val.name);
+              if (std::size(args) > 4)
+                throw std::runtime_error{"Sorry, more than 4 args are WIP"};
+              const inline_primitive *const primitive =
+                  val.target ? nullptr : inline_code[symbol_index(val.name)];
+              if (primitive) {
+                for (std::size_t i = 0; i < std::size(args); ++i) {
                   fprintf(out, "\tldr r%d, [sp, #%d]\n", static_cast<int>(i),
-                          sp_offset_for_local(val.arg_ids[i]));
+                          sp_offset_for_local(args[i]));
                 }
+                emit_primitive(out, primitive->op, 0, 0, 1);
                 if (val.is_tail) {
-                  fprintf(out, "\tadd sp, #%d\n", (local_count + 2) * 4);
-                  std::visit(
-                      [&](auto &&target) {
-                        using target_t = std::decay_t<decltype(target)>;
-                        if constexpr (std::is_same_v<target_t,
-                                                     std::string_view>) {
-                          fprintf(out, "\tbx \"%.*s\"\n",
-                                  static_cast<int>(std::size(target)),
-                                  std::data(target));
-                        } else {
-                          fputs("\tbx r4\n", out);
-                        }
-                      },
-                      val.call_target);
+                  fprintf(out,
+                          "\tadd sp, #%d\n"
+                          "\tpop {r6, pc}\n",
+                          local_count * 4);
                 } else {
-                  const int stack_slot = stack_offset++;
-                  local_to_stack_slot[val.res_id] = stack_slot;
-                  std::visit(
-                      [&](auto &&value) {
-                        using value_t = std::decay_t<decltype(value)>;
-                        if constexpr (std::is_same_v<value_t,
-                                                     std::string_view>) {
-                          fprintf(out, "\tblx \"%.*s\"\n",
-                                  static_cast<int>(std::size(value)),
-                                  std::data(value));
-                        } else {
-                          fputs("\tblx r4\n", out);
-                        }
-                      },
-                      val.call_target);
+                  assign_stack_slot(val.res_id, stack_offset++);
                   fprintf(out, "\tstr r0, [sp, #%d]\n",
                           sp_offset_for_local(val.res_id));
                 }
+                return;
               }
-              if constexpr (std::is_same_v<val_t, anf_assoc>) {
-                local_to_stack_slot[val.id] = local_to_stack_slot[val.alias];
-              }
-              if constexpr (std::is_same_v<val_t, anf_cond>) {
-                used_stack_slots[val.then_block] = local_count;
-                used_stack_slots[val.else_block] = local_count;
+              // Restore lr when tail calling
+              if (val.is_tail) {
                 fprintf(out,
                         "\tldr r0, [sp, #%d]\n"
-                        "\ttst r0, r0\n"
-                        "\tbeq .L%d\n"
-                        "\tb   .L%d\n",
-                        sp_offset_for_local(val.cond_id),
-                        val.else_block + label_offset,
-                        val.then_block + label_offset);
+                        "\tmov lr, r0\n",
+                        (local_count + 1) * 4);
               }
-              if constexpr (std::is_same_v<val_t, anf_return>) {
-                fprintf(out,
-                        "\tldr r0, [sp, #%d]\n"
-                        "\tadd sp, #%d\n"
-                        "\tpop {r6, pc}\n",
-                        sp_offset_for_local(val.value), local_count * 4);
+              if (val.target) {
+                fprintf(out, "\tldr r4, [sp, #%d]\n",
+                        sp_offset_for_local(val.target));
               }
-              if constexpr (std::is_same_v<val_t, anf_jump>) {
-                fprintf(out, "\tb .L%d\n", val.target + label_offset);
+              for (std::size_t i = 0; i < std::size(args); ++i) {
+                fprintf(out, "\tldr r%d, [sp, #%d]\n", static_cast<int>(i),
+                        sp_offset_for_local(args[i]));
               }
-              if constexpr (std::is_same_v<val_t, anf_global_assign>) {
+              if (val.is_tail) {
+                fprintf(out, "\tadd sp, #%d\n", (local_count + 2) * 4);
+                if (!val.target) {
+                  fprintf(out, "\tbx \"%.*s\"\n",
+                          static_cast<int>(std::size(name)), std::data(name));
+                } else {
+                  fputs("\tbx r4\n", out);
+                }
+              } else {
+                assign_stack_slot(val.res_id, stack_offset++);
+                if (!val.target) {
+                  fprintf(out, "\tblx \"%.*s\"\n",
+                          static_cast<int>(std::size(name)), std::data(name));
+                } else {
+                  fputs("\tblx r4\n", out);
+                }
+                fprintf(out, "\tstr r0, [sp, #%d]\n",
+                        sp_offset_for_local(val.res_id));
+              }
+            }
+            if constexpr (std::is_same_v<val_t, anf_assoc>) {
+              // Values assigned again, like the parameters of loops, are
+              // copied to the slot they already have. Values without a
+              // stack slot, like empty let bodies, are left undefined.
+              if (!has_stack_slot(val.id))
+                assign_stack_slot(val.id, stack_offset++);
+              if (has_stack_slot(val.alias))
                 fprintf(out,
-                        "\tldr r0, \"%.*s\"\n"
-                        "\tldr r1, [sp, #%d]\n"
-                        "\tstr r1, r0\n",
-                        static_cast<int>(std::size(val.name)), val.name.data(),
+                        "\tldr r0, [sp, #%d]\n"
+                        "\tstr r0, [sp, #%d]\n",
+                        sp_offset_for_local(val.alias),
                         sp_offset_for_local(val.id));
+            }
+            if constexpr (std::is_same_v<val_t, anf_cond>) {
+              used_stack_slots[val.then_block] = local_count;
+              used_stack_slots[val.else_block] = local_count;
+              fprintf(out,
+                      "\tldr r0, [sp, #%d]\n"
+                      "\ttst r0, r0\n"
+                      "\tbeq .L%d\n"
+                      "\tb   .L%d\n",
+                      sp_offset_for_local(val.cond_id),
+                      val.else_block + label_offset,
+                      val.then_block + label_offset);
+            }
+            if constexpr (std::is_same_v<val_t, anf_return>) {
+              fprintf(out,
+                      "\tldr r0, [sp, #%d]\n"
+                      "\tadd sp, #%d\n"
+                      "\tpop {r6, pc}\n",
+                      sp_offset_for_local(val.value), local_count * 4);
+            }
+            if constexpr (std::is_same_v<val_t, anf_jump>) {
+              // Jumps back to loop headers drop the locals of the loop body
+              if (used_stack_slots[val.target] < 0)
+                used_stack_slots[val.target] = local_count;
+              else if (local_count > used_stack_slots[val.target])
+                fprintf(out, "\tadd sp, #%d\n",
+                        (local_count - used_stack_slots[val.target]) * 4);
+              fprintf(out, "\tb .L%d\n", val.target + label_offset);
+            }
+            if constexpr (std::is_same_v<val_t, anf_global_assign>) {
+              const std::string_view name = ctx.name_of(val.name);
+              fprintf(out,
+                      "\tldr r0, \"%.*s\"\n"
+                      "\tldr r1, [sp, #%d]\n"
+                      "\tstr r1, r0\n",
+                      static_cast<int>(std::size(name)), name.data(),
+                      sp_offset_for_local(val.id));
+            }
+          },
+          expr);
+    }
+  }
+}
+
+// Keeps values in the registers chosen by register_allocator. Spilled values
+// live in a frame below the saved registers, which is set up once on entry.
+class register_code_generator {
+public:
+  register_code_generator(
+      const anf_context &ctx, FILE *out,
+      const std::vector<const inline_primitive *> &inline_code)
+      : ctx{ctx}, out{out}, inline_code{inline_code},
+        allocator{ctx, std::vector<bool>(std::begin(inline_code),
+                                         std::end(inline_code))},
+        use_counts{ctx.first_id} {}
+
+  void emit(std::size_t def_idx, int label_offset);
+
+private:
+  const value_location &location_of(int id) const {
+    return assignment->locations.get(id);
+  }
+  int sp_offset_of(int slot) const {
+    if (slot * 4 > 1020)
+      throw std::runtime_error{"Too many values spilled to the stack"};
+    return slot * 4;
+  }
+  // Returns the register holding id, loading it into scratch if it was
+  // spilled
+  int load(int id, int scratch);
+  // Stores reg to the location of id
+  void store(int id, int reg);
+  bool is_used(int id) const {
+    return location_of(id).kind != value_location::none;
+  }
+  // Register the value id should be computed in
+  int result_register(int id, int scratch) const {
+    const value_location &loc = location_of(id);
+    return loc.kind == value_location::reg ? loc.index : scratch;
+  }
+  void move_to_location(int id, int src_id);
+  void move_to_arguments(span<const int> args, int temp);
+  void emit_parallel_move(int temp);
+  void load_call_target(int target);
+  void emit_adjust_sp(const char *mnemonic, int bytes);
+  void emit_saved_registers(bool with_lr);
+  void emit_pop_saved_registers();
+  void emit_epilogue();
+  void emit_tail_epilogue(std::size_t arg_count);
+  void emit_call(const anf_call &call);
+  const inline_primitive *inline_primitive_of(const anf_expr &instr) const;
+  std::size_t fused_condition_start(span<const anf_expr> instrs) const;
+  void emit_branch(inline_op op, int ra, int rb, const anf_cond &cond,
+                   bool negated);
+  void emit_fused_branch(span<const anf_expr> condition,
+                         const anf_cond &cond);
+
+  const anf_context &ctx;
+  FILE *out;
+  const std::vector<const inline_primitive *> &inline_code;
+  register_allocator allocator;
+  const register_assignment *assignment = nullptr;
+  // Bytes of spill slots below the saved registers
+  int frame_size = 0;
+  int saved_count = 0;
+  int label_offset = 0;
+  int next_label = 0;
+  // Number of instructions reading each value
+  id_table<int> use_counts;
+  // Register to register moves done at once as pairs of destination and
+  // source
+  std::vector<std::pair<int, int>> moves;
+};
+
+int register_code_generator::load(int id, int scratch) {
+  const value_location &loc = location_of(id);
+  if (loc.kind == value_location::reg)
+    return loc.index;
+  if (loc.kind == value_location::slot)
+    fprintf(out, "\tldr %s, [sp, #%d]\n", register_name(scratch),
+            sp_offset_of(loc.index));
+  return scratch;
+}
+
+void register_code_generator::store(int id, int reg) {
+  const value_location &loc = location_of(id);
+  if (loc.kind == value_location::reg)
+    emit_move(out, loc.index, reg);
+  if (loc.kind == value_location::slot)
+    fprintf(out, "\tstr %s, [sp, #%d]\n", register_name(reg),
+            sp_offset_of(loc.index));
+}
+
+void register_code_generator::move_to_location(int id, int src_id) {
+  if (!is_used(id) || !is_used(src_id))
+    return;
+  store(id, load(src_id, result_register(id, 2)));
+}
+
+// Moves the arguments of a call into r0-r3. Values in registers are moved
+// first, as the registers of spilled values may still be needed.
+void register_code_generator::move_to_arguments(span<const int> args,
+                                                int temp) {
+  if (std::size(args) > 4)
+    throw std::runtime_error{"Sorry, more than 4 args are WIP"};
+  moves.clear();
+  for (std::size_t i = 0; i != std::size(args); ++i) {
+    const value_location &loc = location_of(args[i]);
+    if (loc.kind == value_location::reg)
+      moves.emplace_back(static_cast<int>(i), loc.index);
+  }
+  emit_parallel_move(temp);
+  for (std::size_t i = 0; i != std::size(args); ++i)
+    if (location_of(args[i]).kind == value_location::slot)
+      load(args[i], static_cast<int>(i));
+}
+
+// Sequentializes moves so no register is overwritten before it is read.
+// Cycles are broken by saving one of their registers in temp, which is ip
+// unless it holds the target of an indirect call. Functions doing these save
+// lr, so it can be used instead.
+void register_code_generator::emit_parallel_move(int temp) {
+  moves.erase(std::remove_if(std::begin(moves), std::end(moves),
+                             [](auto &&move) {
+                               return move.first == move.second;
+                             }),
+              std::end(moves));
+  while (!std::empty(moves)) {
+    const auto is_read = [this](int reg) {
+      return std::any_of(std::begin(moves), std::end(moves),
+                         [reg](auto &&move) { return move.second == reg; });
+    };
+    auto ready =
+        std::find_if(std::begin(moves), std::end(moves),
+                     [&](auto &&move) { return !is_read(move.first); });
+    if (ready == std::end(moves)) {
+      ready = std::begin(moves);
+      emit_move(out, temp, ready->first);
+      for (auto &&move : moves)
+        if (move.second == ready->first)
+          move.second = temp;
+    }
+    emit_move(out, ready->first, ready->second);
+    moves.erase(ready);
+  }
+}
+
+// Indirect calls go through ip, which is not used for arguments
+void register_code_generator::load_call_target(int target) {
+  if (!target)
+    return;
+  emit_move(out, ip, load(target, 2));
+}
+
+void register_code_generator::emit_adjust_sp(const char *mnemonic,
+                                             int bytes) {
+  // The immediate of Thumb's add and sub of sp is limited to 508
+  for (; bytes > 0; bytes -= 508)
+    fprintf(out, "\t%s sp, #%d\n", mnemonic, std::min(bytes, 508));
+}
+
+void register_code_generator::emit_saved_registers(bool with_lr) {
+  const char *separator = "";
+  for (int reg = 4; reg != 8; ++reg)
+    if (assignment->saved_registers & (1u << reg)) {
+      fprintf(out, "%sr%d", separator, reg);
+      separator = ", ";
+    }
+  if (with_lr)
+    fprintf(out, "%slr", separator);
+}
+
+// Leaf functions only pop the registers they saved and return through lr
+void register_code_generator::emit_epilogue() {
+  emit_adjust_sp("add", frame_size);
+  if (assignment->saves_lr) {
+    fputs("\tpop {", out);
+    emit_saved_registers(false);
+    fputs(assignment->saved_registers ? ", pc}\n" : "pc}\n", out);
+    return;
+  }
+  emit_pop_saved_registers();
+  fputs("\tbx lr\n", out);
+}
+
+void register_code_generator::emit_pop_saved_registers() {
+  if (!assignment->saved_registers)
+    return;
+  fputs("\tpop {", out);
+  emit_saved_registers(false);
+  fputs("}\n", out);
+}
+
+// Restores the caller's frame and lr, leaving the arguments in r0-r3 intact
+void register_code_generator::emit_tail_epilogue(std::size_t arg_count) {
+  if (!assignment->saves_lr) {
+    emit_adjust_sp("add", frame_size);
+    emit_pop_saved_registers();
+    return;
+  }
+  if (arg_count < 4) {
+    emit_adjust_sp("add", frame_size);
+    emit_pop_saved_registers();
+    fputs("\tpop {r3}\n"
+          "\tmov lr, r3\n",
+          out);
+    return;
+  }
+  // r4 is saved by functions doing tail calls with four arguments
+  fprintf(out,
+          "\tldr r4, [sp, #%d]\n"
+          "\tmov lr, r4\n",
+          frame_size + saved_count * 4);
+  emit_adjust_sp("add", frame_size);
+  fputs("\tpop {", out);
+  emit_saved_registers(false);
+  fputs("}\n"
+        "\tadd sp, #4\n",
+        out);
+}
+
+void register_code_generator::emit_call(const anf_call &call) {
+  const auto args = ctx.operands_of(call.args);
+  const std::string_view name = ctx.name_of(call.name);
+  const inline_primitive *const primitive =
+      call.target ? nullptr : inline_code[symbol_index(call.name)];
+  // Primitives are pure, so there is nothing to do for unused results
+  if (primitive && !call.is_tail && !is_used(call.res_id))
+    return;
+  if (primitive) {
+    const int ra = std::size(args) > 0 ? load(args[0], 2) : 2;
+    const int rb = std::size(args) > 1 ? load(args[1], 3) : -1;
+    const int rd = call.is_tail ? 0 : result_register(call.res_id, 2);
+    emit_primitive(out, primitive->op, rd, ra, rb);
+    if (call.is_tail)
+      emit_epilogue();
+    else
+      store(call.res_id, rd);
+    return;
+  }
+  load_call_target(call.target);
+  move_to_arguments(args, call.target ? lr : ip);
+  if (call.is_tail) {
+    emit_tail_epilogue(std::size(args));
+    if (call.target)
+      fputs("\tbx ip\n", out);
+    else
+      fprintf(out, "\tbx \"%.*s\"\n", static_cast<int>(std::size(name)),
+              std::data(name));
+    return;
+  }
+  if (call.target)
+    fputs("\tblx ip\n", out);
+  else
+    fprintf(out, "\tblx \"%.*s\"\n", static_cast<int>(std::size(name)),
+            std::data(name));
+  store(call.res_id, 0);
+}
+
+// Inline primitive computed by a call, nullptr for other instructions
+const inline_primitive *
+register_code_generator::inline_primitive_of(const anf_expr &instr) const {
+  const auto *const call = std::get_if<anf_call>(&instr);
+  if (!call || call->target || call->is_tail)
+    return nullptr;
+  return inline_code[symbol_index(call->name)];
+}
+
+// Returns the index of the first instruction computing the condition of the
+// branch ending instrs, which is fused into the branch instead of
+// materializing a boolean, or the size of instrs if there is none. These are
+// a comparison or not followed by any number of nots, each used only by the
+// next instruction, so their operands are still intact at the branch.
+std::size_t register_code_generator::fused_condition_start(
+    span<const anf_expr> instrs) const {
+  std::size_t start = std::size(instrs);
+  if (std::empty(instrs) || !std::holds_alternative<anf_cond>(instrs.back()))
+    return start;
+  int value = std::get<anf_cond>(instrs.back()).cond_id;
+  for (std::size_t i = std::size(instrs) - 1; i-- != 0;) {
+    const inline_primitive *const primitive = inline_primitive_of(instrs[i]);
+    if (!primitive || use_counts.get(value) != 1 ||
+        (!is_comparison(primitive->op) &&
+         primitive->op != inline_op::bool_not))
+      break;
+    const anf_call &call = std::get<anf_call>(instrs[i]);
+    if (call.res_id != value)
+      break;
+    start = i;
+    if (primitive->op != inline_op::bool_not)
+      break;
+    value = ctx.operands_of(call.args)[0];
+  }
+  return start;
+}
+
+// Branches to the then block if op holds for ra and rb, which is compared
+// with 0 if it is -1. Falls through if either block is next.
+void register_code_generator::emit_branch(inline_op op, int ra, int rb,
+                                          const anf_cond &cond,
+                                          bool negated) {
+  if (rb < 0)
+    fprintf(out, "\tcmp %s, #0\n", register_name(ra));
+  else
+    fprintf(out, "\tcmp %s, %s\n", register_name(ra), register_name(rb));
+  const int then_label = cond.then_block + label_offset;
+  const int else_label = cond.else_block + label_offset;
+  if (else_label == next_label) {
+    fprintf(out, "\tb%s .L%d\n", condition_code(op, negated), then_label);
+    return;
+  }
+  fprintf(out, "\tb%s .L%d\n", condition_code(op, !negated), else_label);
+  if (then_label != next_label)
+    fprintf(out, "\tb .L%d\n", then_label);
+}
+
+void register_code_generator::emit_fused_branch(span<const anf_expr> condition,
+                                                const anf_cond &cond) {
+  const anf_call &first = std::get<anf_call>(condition[0]);
+  const auto args = ctx.operands_of(first.args);
+  const inline_op op = inline_primitive_of(condition[0])->op;
+  // Every not flips the branch, a leading one tests whether its operand is
+  // not 0
+  const std::size_t nots = std::size(condition) - (op != inline_op::bool_not);
+  if (op == inline_op::bool_not)
+    emit_branch(inline_op::ne, load(args[0], 2), -1, cond, nots % 2);
+  else
+    emit_branch(op, load(args[0], 2), load(args[1], 3), cond, nots % 2);
+}
+
+void register_code_generator::emit(std::size_t def_idx, int label_offset) {
+  const auto blocks = ctx.blocks_of(ctx.defs[def_idx]);
+  assignment = &allocator.run(ctx.defs[def_idx]);
+  frame_size = assignment->spill_slots * 4;
+  saved_count = 0;
+  for (int reg = 4; reg != 8; ++reg)
+    saved_count += (assignment->saved_registers >> reg) & 1u;
+  // Peak stack use of the definition itself, including the saved registers
+  fprintf(out, "\t@ frame size: %d bytes\n",
+          frame_size + (saved_count + assignment->saves_lr) * 4);
+  this->label_offset = label_offset;
+  for (auto &&block : blocks)
+    for (auto &&instr : ctx.instrs_of(block))
+      for_each_use(ctx, instr, [this](int id) { ++use_counts[id]; });
+  for (std::size_t block_idx = 0; block_idx != std::size(blocks);
+       ++block_idx) {
+    const auto instrs = ctx.instrs_of(blocks[block_idx]);
+    const std::size_t fused_start = fused_condition_start(instrs);
+    next_label = static_cast<int>(label_offset + block_idx + 1);
+    fprintf(out, ".L%d:\n", static_cast<int>(label_offset + block_idx));
+    for (std::size_t i = 0; i != std::size(instrs); ++i) {
+      if (i >= fused_start && i + 1 != std::size(instrs))
+        continue;
+      std::visit(
+          [&](auto &&val) {
+            using val_t = std::decay_t<decltype(val)>;
+            if constexpr (std::is_same_v<val_t, anf_receive>) {
+              const auto params = ctx.operands_of(val.args);
+              if (std::size(params) > 4u) {
+                throw std::runtime_error{
+                    "Function with more than four arguments are currently "
+                    "not supported"};
               }
-            },
-            expr);
-      }
+              if (assignment->saved_registers || assignment->saves_lr) {
+                fputs("\tpush {", out);
+                emit_saved_registers(assignment->saves_lr);
+                fputs("}\n", out);
+              }
+              emit_adjust_sp("sub", frame_size);
+              // Spilled parameters are stored before the registers holding
+              // them are reused
+              moves.clear();
+              for (std::size_t i = 0; i != std::size(params); ++i) {
+                const value_location &loc = location_of(params[i]);
+                if (loc.kind == value_location::slot)
+                  store(params[i], static_cast<int>(i));
+                if (loc.kind == value_location::reg)
+                  moves.emplace_back(loc.index, static_cast<int>(i));
+              }
+              emit_parallel_move(ip);
+            }
+            if constexpr (std::is_same_v<val_t, anf_global>) {
+              if (!is_used(val.id))
+                return;
+              const std::string_view name = ctx.name_of(val.name);
+              const int rd = result_register(val.id, 2);
+              fprintf(out, "\tldr %s, =\"%.*s\"\n", register_name(rd),
+                      static_cast<int>(std::size(name)), name.data());
+              store(val.id, rd);
+            }
+            if constexpr (std::is_same_v<val_t, anf_constant>) {
+              if (!is_used(val.id))
+                return;
+              const int rd = result_register(val.id, 2);
+              if (val.value >= 0 && val.value <= 255)
+                fprintf(out, "\tmovs %s, #%d\n", register_name(rd), val.value);
+              else
+                fprintf(out, "\tldr %s, =%d\n", register_name(rd), val.value);
+              store(val.id, rd);
+            }
+            if constexpr (std::is_same_v<val_t, anf_call>)
+              emit_call(val);
+            if constexpr (std::is_same_v<val_t, anf_assoc>)
+              move_to_location(val.id, val.alias);
+            if constexpr (std::is_same_v<val_t, anf_cond>) {
+              if (fused_start + 1 < std::size(instrs))
+                emit_fused_branch(
+                    {std::data(instrs) + fused_start,
+                     std::size(instrs) - fused_start - 1},
+                    val);
+              else
+                emit_branch(inline_op::ne, load(val.cond_id, 2), -1, val,
+                            false);
+            }
+            if constexpr (std::is_same_v<val_t, anf_return>) {
+              emit_move(out, 0, load(val.value, 0));
+              emit_epilogue();
+            }
+            if constexpr (std::is_same_v<val_t, anf_jump>) {
+              if (val.target + label_offset != next_label)
+                fprintf(out, "\tb .L%d\n", val.target + label_offset);
+            }
+            if constexpr (std::is_same_v<val_t, anf_global_assign>) {
+              const std::string_view name = ctx.name_of(val.name);
+              fprintf(out, "\tldr r2, =\"%.*s\"\n",
+                      static_cast<int>(std::size(name)), name.data());
+              fprintf(out, "\tstr %s, [r2]\n",
+                      register_name(load(val.id, 3)));
+            }
+          },
+          instrs[i]);
     }
+  }
+}
+
+} // namespace
+
+void genasm(anf_context &ctx, const symbol_table &symtab, FILE *out,
+            value_placement placement) {
+  fputs("\t.arch armv5t\n"
+        "\t.thumb\n"
+        "\t.syntax unified\n"
+        "\t.section \".text\", \"ax\"\n",
+        out);
+  int label_offset = 1;
+  const std::vector<const inline_primitive *> inline_code =
+      find_inline_primitives(ctx, symtab);
+  stack_code_generator stack_generator{ctx, out, inline_code};
+  register_code_generator register_generator{ctx, out, inline_code};
+  for (std::size_t def_idx = 0; def_idx != std::size(ctx.defs); ++def_idx) {
+    auto &&def = ctx.defs[def_idx];
+    const std::string_view def_name = ctx.name_of(def.name);
+    if (def.global)
+      fprintf(out, "\t.global \"%.*s\"\n",
+              static_cast<int>(std::size(def_name)), def_name.data());
+    fprintf(out,
+            "\t.type \"%.*s\", %%function\n"
+            "\t.thumb_func\n"
+            "\"%.*s\":\n",
+            static_cast<int>(std::size(def_name)), def_name.data(),
+            static_cast<int>(std::size(def_name)), def_name.data());
+    if (placement == value_placement::stack)
+      stack_generator.emit(def_idx, label_offset);
+    else
+      register_generator.emit(def_idx, label_offset);
     fprintf(out,
             "\t.pool\n"
             "\t.size \"%.*s\", .-\"%.*s\"\n",
-            static_cast<int>(std::size(def.name)), def.name.data(),
-            static_cast<int>(std::size(def.name)), def.name.data());
-    label_offset += std::size(def.blocks);
+            static_cast<int>(std::size(def_name)), def_name.data(),
+            static_cast<int>(std::size(def_name)), def_name.data());
+    label_offset += def.block_count;
   }
 }
 
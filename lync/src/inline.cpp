@@ -0,0 +1,375 @@
+#include "anf.h"
+#include "anf_passes.h"
+#include "id_table.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace lyn {
+
+namespace {
+
+struct def_info {
+  // Visit order and lowest reachable visit order of the search for
+  // recursive definitions, -1 if not visited yet
+  int index = -1;
+  int lowlink = -1;
+  bool on_stack = false;
+  // Whether the definition may call itself, directly or through others
+  bool recursive = false;
+  // Calls of the definition by name in all definitions
+  int call_sites = 0;
+  // Instructions of the definition once its own calls are inlined
+  int size = 0;
+  bool inlinable = false;
+};
+
+bool is_terminator(const anf_expr &instr) {
+  if (const auto *const call = std::get_if<anf_call>(&instr))
+    return call->is_tail;
+  return std::holds_alternative<anf_return>(instr) ||
+         std::holds_alternative<anf_jump>(instr) ||
+         std::holds_alternative<anf_cond>(instr);
+}
+
+// Copies the blocks of called definitions into their callers. Callees are
+// visited before their callers, so calls inlined into a callee are inlined
+// along with it. Definitions calling themselves, directly or through other
+// definitions, are never inlined. Calls of names without a definition, like
+// declared externals, are left alone as well.
+class inliner {
+public:
+  inliner(anf_context &ctx, int threshold, int next_id)
+      : ctx{ctx}, threshold{threshold}, next_id{next_id},
+        renamed{ctx.first_id, -1} {}
+
+  int run();
+
+private:
+  int def_of(const anf_call &call) const {
+    if (call.target || symbol_index(call.name) >= std::size(def_of_symbol))
+      return -1;
+    return def_of_symbol[symbol_index(call.name)];
+  }
+  // Calls fun with the index of every definition called by name in def
+  template <class Fun> void for_each_callee(const anf_def &def, Fun &&fun) {
+    for (auto &&block : ctx.blocks_of(def))
+      for (auto &&instr : ctx.instrs_of(block))
+        if (const auto *const call = std::get_if<anf_call>(&instr))
+          if (const int callee = def_of(*call); callee >= 0)
+            fun(callee);
+  }
+  void find_recursive_defs(int def);
+  void measure(int def);
+  bool should_inline(const anf_call &call) const;
+  int rename(int id) const { return id ? renamed.get(id) : 0; }
+  void rewrite(anf_def &def);
+  void inline_call(const anf_call &call);
+  void emit_renamed(const anf_expr &instr, const anf_call &call, int entry,
+                    int cont);
+  int new_block();
+  template <class... Args> void emit_instr(Args &&...args) {
+    blocks[current_block].emplace_back(std::forward<Args>(args)...);
+  }
+
+  anf_context &ctx;
+  int threshold;
+  int next_id;
+  // Indexed by symbol, -1 for no definition and -2 for several
+  std::vector<int> def_of_symbol;
+  std::vector<def_info> infos;
+  // Definitions in the order they are rewritten, callees first
+  std::vector<int> order;
+  std::vector<int> visit_stack;
+  int next_index = 0;
+  // Ids of the inlined callee in the caller, -1 for ids not renamed yet
+  id_table<int> renamed;
+  std::vector<int> renamed_ids;
+  std::vector<int> defined_ids;
+
+  // Blocks of the definition being rewritten, like in anf_generator
+  std::vector<std::vector<anf_expr>> blocks;
+  std::size_t block_count = 0;
+  int current_block = 0;
+  // New index of every block of the definition being rewritten
+  std::vector<int> block_starts;
+  // Branches copied from the definition being rewritten, whose targets still
+  // refer to its old blocks
+  std::vector<std::pair<int, std::size_t>> branches;
+};
+
+// Tarjan's algorithm: Definitions are numbered in the order they are
+// visited, a definition whose callees reach no definition visited before it
+// completes a strongly connected component. Components are completed after
+// all components they call.
+void inliner::find_recursive_defs(int def) {
+  infos[def].index = infos[def].lowlink = next_index++;
+  visit_stack.push_back(def);
+  infos[def].on_stack = true;
+  for_each_callee(ctx.defs[def], [&](int callee) {
+    if (infos[callee].index < 0) {
+      find_recursive_defs(callee);
+      infos[def].lowlink = std::min(infos[def].lowlink, infos[callee].lowlink);
+    } else if (infos[callee].on_stack) {
+      infos[def].lowlink = std::min(infos[def].lowlink, infos[callee].index);
+    }
+    infos[def].recursive |= callee == def;
+  });
+  if (infos[def].lowlink != infos[def].index)
+    return;
+  const auto first = std::find(std::begin(visit_stack), std::end(visit_stack),
+                               def);
+  for (auto member = first; member != std::end(visit_stack); ++member) {
+    infos[*member].on_stack = false;
+    infos[*member].recursive |= std::end(visit_stack) - first > 1;
+    order.push_back(*member);
+  }
+  visit_stack.erase(first, std::end(visit_stack));
+}
+
+// Definitions can be inlined if they only use their own values and every
+// block of them ends by leaving it
+void inliner::measure(int def) {
+  def_info &info = infos[def];
+  const auto def_blocks = ctx.blocks_of(ctx.defs[def]);
+  info.size = 0;
+  info.inlinable = !info.recursive && !std::empty(def_blocks) &&
+                   !std::empty(ctx.instrs_of(def_blocks[0])) &&
+                   std::holds_alternative<anf_receive>(
+                       ctx.instrs_of(def_blocks[0])[0]);
+  if (!info.inlinable)
+    return;
+  defined_ids.clear();
+  for (auto &&block : def_blocks) {
+    const auto instrs = ctx.instrs_of(block);
+    if (std::empty(instrs) || !is_terminator(instrs.back()))
+      info.inlinable = false;
+    for (auto &&instr : instrs) {
+      for_each_def(ctx, instr, [this](int id) { defined_ids.push_back(id); });
+      info.size += !std::holds_alternative<anf_receive>(instr) &&
+                   !std::holds_alternative<anf_adjust_stack>(instr) &&
+                   !std::holds_alternative<anf_jump>(instr);
+    }
+  }
+  std::sort(std::begin(defined_ids), std::end(defined_ids));
+  for (auto &&block : def_blocks)
+    for (auto &&instr : ctx.instrs_of(block))
+      for_each_use(ctx, instr, [&](int id) {
+        info.inlinable &= std::binary_search(std::begin(defined_ids),
+                                             std::end(defined_ids), id);
+      });
+}
+
+// Calls cost about as much as the smallest definitions, which are inlined
+// everywhere. Larger definitions are only inlined into a single call site.
+bool inliner::should_inline(const anf_call &call) const {
+  const int callee = def_of(call);
+  if (callee < 0 || !infos[callee].inlinable)
+    return false;
+  return infos[callee].size <= threshold ||
+         (infos[callee].call_sites == 1 && infos[callee].size <= 2 * threshold);
+}
+
+int inliner::new_block() {
+  if (block_count == std::size(blocks))
+    blocks.emplace_back();
+  return static_cast<int>(block_count++);
+}
+
+// Replaces the call ending the current block by a jump to the copied blocks
+// of the callee. Their returns assign the result and jump to a new block,
+// which continues the current one.
+void inliner::inline_call(const anf_call &call) {
+  const anf_def &callee = ctx.defs[def_of(call)];
+  const auto callee_blocks = ctx.blocks_of(callee);
+  const auto args = ctx.operands_of(call.args);
+  const auto params = ctx.operands_of(
+      std::get<anf_receive>(ctx.instrs_of(callee_blocks[0])[0]).args);
+  for (std::size_t i = 0; i != std::size(params); ++i) {
+    renamed[params[i]] = args[i];
+    renamed_ids.push_back(params[i]);
+  }
+  for (auto &&block : callee_blocks)
+    for (auto &&instr : ctx.instrs_of(block))
+      for_each_def(ctx, instr, [this](int id) {
+        if (renamed[id] < 0) {
+          renamed[id] = next_id++;
+          renamed_ids.push_back(id);
+        }
+      });
+
+  const int entry = static_cast<int>(block_count);
+  const int cont = entry + static_cast<int>(std::size(callee_blocks));
+  emit_instr(anf_jump{entry});
+  for (auto &&block : callee_blocks) {
+    current_block = new_block();
+    for (auto &&instr : ctx.instrs_of(block))
+      emit_renamed(instr, call, entry, cont);
+  }
+  if (!call.is_tail) {
+    current_block = new_block();
+    emit_instr(anf_adjust_stack{});
+  }
+  for (const int id : renamed_ids)
+    renamed[id] = -1;
+  renamed_ids.clear();
+}
+
+// Copies instr of the callee, whose blocks start at entry
+void inliner::emit_renamed(const anf_expr &instr, const anf_call &call,
+                           int entry, int cont) {
+  std::visit(
+      [&](auto &&val) {
+        using val_t = std::decay_t<decltype(val)>;
+        // The parameters are replaced by the arguments
+        if constexpr (std::is_same_v<val_t, anf_receive>)
+          return;
+        if constexpr (std::is_same_v<val_t, anf_adjust_stack>)
+          emit_instr(val);
+        if constexpr (std::is_same_v<val_t, anf_global>)
+          emit_instr(anf_global{val.name, rename(val.id)});
+        if constexpr (std::is_same_v<val_t, anf_constant>)
+          emit_instr(anf_constant{val.value, rename(val.id)});
+        if constexpr (std::is_same_v<val_t, anf_call>) {
+          const auto first =
+              static_cast<std::uint32_t>(std::size(ctx.operands));
+          for (std::uint32_t i = 0; i != val.args.size; ++i)
+            ctx.operands.push_back(rename(ctx.operands[val.args.first + i]));
+          anf_call copy{rename(val.target), val.name, {first, val.args.size},
+                        rename(val.res_id), val.is_tail};
+          // Tail calls of the callee return to the caller, unless the
+          // inlined call was a tail call itself
+          if (val.is_tail && !call.is_tail) {
+            copy.res_id = next_id++;
+            copy.is_tail = false;
+            emit_instr(copy);
+            emit_instr(anf_assoc{copy.res_id, call.res_id});
+            emit_instr(anf_jump{cont});
+          } else {
+            emit_instr(copy);
+          }
+        }
+        if constexpr (std::is_same_v<val_t, anf_assoc>)
+          emit_instr(anf_assoc{rename(val.alias), rename(val.id)});
+        if constexpr (std::is_same_v<val_t, anf_cond>)
+          emit_instr(anf_cond{rename(val.cond_id), entry + val.then_block,
+                              entry + val.else_block});
+        if constexpr (std::is_same_v<val_t, anf_return>) {
+          if (call.is_tail) {
+            emit_instr(anf_return{rename(val.value)});
+          } else {
+            emit_instr(anf_assoc{rename(val.value), call.res_id});
+            emit_instr(anf_jump{cont});
+          }
+        }
+        if constexpr (std::is_same_v<val_t, anf_jump>)
+          emit_instr(anf_jump{entry + val.target});
+        if constexpr (std::is_same_v<val_t, anf_global_assign>)
+          emit_instr(anf_global_assign{val.name, rename(val.id)});
+      },
+      instr);
+}
+
+void inliner::rewrite(anf_def &def) {
+  const auto old_blocks = ctx.blocks_of(def);
+  block_starts.assign(std::size(old_blocks), 0);
+  branches.clear();
+  for (std::size_t block = 0; block != std::size(old_blocks); ++block) {
+    current_block = new_block();
+    block_starts[block] = current_block;
+    for (auto &&instr : ctx.instrs_of(old_blocks[block])) {
+      const auto *const call = std::get_if<anf_call>(&instr);
+      if (call && should_inline(*call)) {
+        inline_call(*call);
+        continue;
+      }
+      if (std::holds_alternative<anf_cond>(instr) ||
+          std::holds_alternative<anf_jump>(instr))
+        branches.emplace_back(current_block,
+                              std::size(blocks[current_block]));
+      emit_instr(instr);
+    }
+  }
+  for (auto &&[block, instr] : branches) {
+    if (auto *const cond = std::get_if<anf_cond>(&blocks[block][instr])) {
+      cond->then_block = block_starts[cond->then_block];
+      cond->else_block = block_starts[cond->else_block];
+    }
+    if (auto *const jump = std::get_if<anf_jump>(&blocks[block][instr]))
+      jump->target = block_starts[jump->target];
+  }
+  // The new blocks are appended, the old ones are dropped when compacting
+  def.first_block = static_cast<std::uint32_t>(std::size(ctx.blocks));
+  def.block_count = static_cast<std::uint32_t>(block_count);
+  for (std::size_t i = 0; i != block_count; ++i) {
+    ctx.blocks.push_back(
+        basic_block{static_cast<std::uint32_t>(std::size(ctx.instrs)),
+                    static_cast<std::uint32_t>(std::size(blocks[i]))});
+    ctx.instrs.insert(std::end(ctx.instrs), std::begin(blocks[i]),
+                      std::end(blocks[i]));
+    blocks[i].clear();
+  }
+  block_count = 0;
+}
+
+int inliner::run() {
+  if (threshold <= 0)
+    return next_id;
+  def_of_symbol.assign(ctx.stbl->size(), -1);
+  // Calls of names with several definitions are never inlined, as it is
+  // unknown which of them is called
+  for (std::size_t def = 0; def != std::size(ctx.defs); ++def) {
+    int &slot = def_of_symbol[symbol_index(ctx.defs[def].name)];
+    slot = slot == -1 ? static_cast<int>(def) : -2;
+  }
+  infos.assign(std::size(ctx.defs), def_info{});
+  for (auto &&def : ctx.defs)
+    for_each_callee(def, [this](int callee) { ++infos[callee].call_sites; });
+  for (std::size_t def = 0; def != std::size(ctx.defs); ++def)
+    if (infos[def].index < 0)
+      find_recursive_defs(static_cast<int>(def));
+
+  bool inlined = false;
+  for (const int def : order) {
+    bool has_inlined_calls = false;
+    for (auto &&block : ctx.blocks_of(ctx.defs[def]))
+      for (auto &&instr : ctx.instrs_of(block))
+        if (const auto *const call = std::get_if<anf_call>(&instr))
+          has_inlined_calls |= should_inline(*call);
+    if (has_inlined_calls) {
+      rewrite(ctx.defs[def]);
+      inlined = true;
+    }
+    measure(def);
+  }
+  if (!inlined)
+    return next_id;
+
+  std::vector<basic_block> new_blocks;
+  std::vector<anf_expr> new_instrs;
+  for (auto &&def : ctx.defs) {
+    const auto first_block = static_cast<std::uint32_t>(std::size(new_blocks));
+    for (auto &&block : ctx.blocks_of(def)) {
+      const auto first = static_cast<std::uint32_t>(std::size(new_instrs));
+      const auto instrs = ctx.instrs_of(block);
+      new_instrs.insert(std::end(new_instrs), std::begin(instrs),
+                        std::end(instrs));
+      new_blocks.push_back(basic_block{first, block.size});
+    }
+    def.first_block = first_block;
+  }
+  ctx.blocks = std::move(new_blocks);
+  ctx.instrs = std::move(new_instrs);
+  return next_id;
+}
+
+} // namespace
+
+int inline_calls(anf_context &ctx, int threshold, int next_id) {
+  return inliner{ctx, threshold, next_id}.run();
+}
+
+} // namespace lyn
@@ -0,0 +1,214 @@
+#include "interface.h"
+#include "expr.h"
+#include "types.h"
+
+#include <cstring>
+#include <map>
+#include <string>
+
+namespace lyn {
+
+namespace {
+
+class interface_writer {
+public:
+  explicit interface_writer(const string_table &stbl) : stbl{stbl} {}
+
+  void add(const toplevel_expr &expr);
+  bool write(FILE *out) const;
+
+private:
+  std::optional<std::uint32_t> add_type(const type *t);
+  std::uint32_t intern_type(interface_type_kind kind,
+                            const std::vector<std::uint32_t> &children);
+
+  const string_table &stbl;
+  std::vector<interface_entry> entries;
+  std::vector<interface_type> types;
+  std::vector<std::uint32_t> children;
+  std::string strings;
+  // Maps the kind of a type followed by its children to its index, so every
+  // distinct type is written only once
+  std::map<std::vector<std::uint32_t>, std::uint32_t> type_indices;
+};
+
+void interface_writer::add(const toplevel_expr &expr) {
+  if (!expr.value || !std::holds_alternative<lambda_expr>(expr.value->content))
+    return;
+  const auto type_idx = add_type(expr.value_type);
+  if (!type_idx)
+    return;
+  const std::string_view name = stbl[expr.name];
+  entries.push_back(interface_entry{
+      static_cast<std::uint32_t>(std::size(strings)),
+      static_cast<std::uint32_t>(std::size(name)), *type_idx});
+  strings.append(name);
+}
+
+std::optional<std::uint32_t> interface_writer::add_type(const type *t) {
+  while (t) {
+    const auto *const var = std::get_if<type_variable>(&t->content);
+    if (!var)
+      break;
+    t = var->target;
+  }
+  if (!t)
+    return std::nullopt;
+  return std::visit(
+      [this](auto &&val) -> std::optional<std::uint32_t> {
+        using val_t = std::decay_t<decltype(val)>;
+        if constexpr (std::is_same_v<val_t, int_type>)
+          return intern_type(interface_type_kind::int_, {});
+        if constexpr (std::is_same_v<val_t, bool_type>)
+          return intern_type(interface_type_kind::bool_, {});
+        if constexpr (std::is_same_v<val_t, unit_type>)
+          return intern_type(interface_type_kind::unit, {});
+        if constexpr (std::is_same_v<val_t, function_type>) {
+          std::vector<std::uint32_t> type_children;
+          for (const type *param : val.params) {
+            const auto param_idx = add_type(param);
+            if (!param_idx)
+              return std::nullopt;
+            type_children.push_back(*param_idx);
+          }
+          const auto result_idx = add_type(val.result);
+          if (!result_idx)
+            return std::nullopt;
+          type_children.push_back(*result_idx);
+          return intern_type(interface_type_kind::function, type_children);
+        }
+        if constexpr (std::is_same_v<val_t, type_variable>)
+          unreachable();
+      },
+      t->content);
+}
+
+std::uint32_t
+interface_writer::intern_type(interface_type_kind kind,
+                              const std::vector<std::uint32_t> &type_children) {
+  std::vector<std::uint32_t> key;
+  key.reserve(std::size(type_children) + 1);
+  key.push_back(static_cast<std::uint32_t>(kind));
+  key.insert(std::end(key), std::begin(type_children), std::end(type_children));
+  const auto [iter, inserted] =
+      type_indices.try_emplace(std::move(key), std::size(types));
+  if (inserted) {
+    types.push_back(
+        interface_type{kind, static_cast<std::uint32_t>(std::size(children)),
+                       static_cast<std::uint32_t>(std::size(type_children))});
+    children.insert(std::end(children), std::begin(type_children),
+                    std::end(type_children));
+  }
+  return iter->second;
+}
+
+bool interface_writer::write(FILE *out) const {
+  interface_header header = {};
+  std::memcpy(header.magic, interface_magic, sizeof(header.magic));
+  header.version = interface_version;
+  header.entry_count = std::size(entries);
+  header.type_count = std::size(types);
+  header.child_count = std::size(children);
+  header.string_size = std::size(strings);
+  const auto write_array = [out](const auto &vec) {
+    return std::empty(vec) || fwrite(std::data(vec), sizeof(vec[0]),
+                                     std::size(vec), out) == std::size(vec);
+  };
+  return fwrite(&header, sizeof(header), 1u, out) == 1u &&
+         write_array(entries) && write_array(types) &&
+         write_array(children) && write_array(strings);
+}
+
+template <class T> T read_at(const char *base, std::size_t idx) {
+  T result;
+  std::memcpy(&result, base + idx * sizeof(T), sizeof(T));
+  return result;
+}
+
+} // namespace
+
+bool write_interface(const std::vector<toplevel_expr> &exprs,
+                     const string_table &stbl, FILE *out) {
+  interface_writer writer{stbl};
+  for (auto &&expr : exprs)
+    writer.add(expr);
+  return writer.write(out);
+}
+
+std::optional<std::vector<interface_decl>>
+read_interface(const source_buffer &buffer, std::pmr::memory_resource &alloc) {
+  if (std::size(buffer) < sizeof(interface_header))
+    return std::nullopt;
+  const auto header = read_at<interface_header>(buffer.data(), 0);
+  if (std::memcmp(header.magic, interface_magic, sizeof(header.magic)) != 0 ||
+      header.version != interface_version)
+    return std::nullopt;
+  const std::uint64_t entries_offset = sizeof(interface_header);
+  const std::uint64_t types_offset =
+      entries_offset +
+      std::uint64_t{header.entry_count} * sizeof(interface_entry);
+  const std::uint64_t children_offset =
+      types_offset + std::uint64_t{header.type_count} * sizeof(interface_type);
+  const std::uint64_t strings_offset =
+      children_offset + std::uint64_t{header.child_count} * 4u;
+  if (strings_offset + header.string_size != std::size(buffer))
+    return std::nullopt;
+  const char *const strings = buffer.data() + strings_offset;
+
+  std::vector<type_expr *> types;
+  types.reserve(header.type_count);
+  for (std::uint32_t i = 0; i < header.type_count; ++i) {
+    const auto t = read_at<interface_type>(buffer.data() + types_offset, i);
+    type_expr result;
+    switch (t.kind) {
+    case interface_type_kind::int_:
+      result.content = int_type_expr{};
+      break;
+    case interface_type_kind::bool_:
+      result.content = bool_type_expr{};
+      break;
+    case interface_type_kind::unit:
+      result.content = unit_type_expr{};
+      break;
+    case interface_type_kind::function: {
+      if (!t.children_size ||
+          std::uint64_t{t.children_begin} + t.children_size >
+              header.child_count)
+        return std::nullopt;
+      std::vector<type_expr *> type_children;
+      for (std::uint32_t j = 0; j < t.children_size; ++j) {
+        const auto child = read_at<std::uint32_t>(
+            buffer.data() + children_offset, t.children_begin + j);
+        // Only refering to earlier types rules out cycles
+        if (child >= i)
+          return std::nullopt;
+        type_children.push_back(types[child]);
+      }
+      result.content = func_type_expr{spanify(alloc, type_children)};
+      break;
+    }
+    default:
+      return std::nullopt;
+    }
+    types.push_back(new (alloc.allocate(sizeof(type_expr), alignof(type_expr)))
+                        type_expr{result});
+  }
+
+  std::vector<interface_decl> decls;
+  decls.reserve(header.entry_count);
+  for (std::uint32_t i = 0; i < header.entry_count; ++i) {
+    const auto entry =
+        read_at<interface_entry>(buffer.data() + entries_offset, i);
+    if (std::uint64_t{entry.name_offset} + entry.name_size >
+            header.string_size ||
+        entry.type >= header.type_count)
+      return std::nullopt;
+    decls.push_back(
+        interface_decl{std::string_view{strings + entry.name_offset,
+                                        entry.name_size},
+                       types[entry.type]});
+  }
+  return decls;
+}
+
+} // namespace lyn
@@ -0,0 +1,39 @@
+#include "module_cache.h"
+#include "expr.h"
+
+#include <algorithm>
+
+namespace lyn {
+
+const module_cache::module *
+module_cache::find(const std::string &path) const {
+  std::lock_guard<std::mutex> lock{mutex};
+  const auto iter = modules.find(path);
+  return iter != std::end(modules) ? &iter->second : nullptr;
+}
+
+void module_cache::insert(const std::string &path, module mod) {
+  std::lock_guard<std::mutex> lock{mutex};
+  if (modules.count(path))
+    return;
+  for (auto &&item : mod.items) {
+    if (item.type)
+      item.type = copy(*item.type);
+  }
+  modules.emplace(path, std::move(mod));
+}
+
+type_expr *module_cache::copy(const type_expr &expr) {
+  type_expr result = expr;
+  if (auto *const func = std::get_if<func_type_expr>(&result.content)) {
+    std::vector<type_expr *> types;
+    std::transform(std::begin(func->types), std::end(func->types),
+                   std::back_inserter(types),
+                   [this](type_expr *type) { return copy(*type); });
+    func->types = spanify(alloc, types);
+  }
+  return new (alloc.allocate(sizeof(type_expr), alignof(type_expr)))
+      type_expr{result};
+}
+
+} // namespace lyn
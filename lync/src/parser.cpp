@@ -1,8 +1,20 @@
 #include "expr.h"
+#include "interface.h"
+#include "module_cache.h"
 #include "passes.h"
+#include "source_buffer.h"
 #include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
 #include <optional>
+#include <string>
 #include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 
 namespace lyn {
 
@@ -28,166 +40,293 @@ struct token {
   type t = type::error;
   union {
     int i;
-    std::string_view s;
+    symbol s;
   } value;
   source_location sloc = {};
 };
 
-void print_token(const token &tok) {
+void print_token(const token &tok, const string_table &stbl, FILE *out) {
   switch (tok.t) {
   case token::type::error:
-    fputs("<error>", stderr);
+    fputs("<error>", out);
     break;
   case token::type::eof:
-    fputs("<eof>", stderr);
+    fputs("<eof>", out);
     break;
   case token::type::lpar:
-    fputc('(', stderr);
+    fputc('(', out);
     break;
   case token::type::rpar:
-    fputc(')', stderr);
+    fputc(')', out);
     break;
   case token::type::arrow:
-    fputs("->", stderr);
+    fputs("->", out);
     break;
   case token::type::let:
-    fputs("let", stderr);
+    fputs("let", out);
     break;
   case token::type::lambda:
-    fputs("lambda", stderr);
+    fputs("lambda", out);
     break;
   case token::type::if_:
-    fputs("if", stderr);
+    fputs("if", out);
     break;
   case token::type::define:
-    fputs("define", stderr);
+    fputs("define", out);
     break;
   case token::type::declare:
-    fputs("declare", stderr);
+    fputs("declare", out);
     break;
   case token::type::include:
-    fputs("include", stderr);
+    fputs("include", out);
     break;
   case token::type::identifier:
-    fprintf(stderr, "\"%.*s\"", static_cast<int>(std::size(tok.value.s)),
-            std::data(tok.value.s));
+    fprintf(out, "\"%.*s\"", static_cast<int>(std::size(stbl[tok.value.s])),
+            std::data(stbl[tok.value.s]));
     break;
   case token::type::number:
-    fprintf(stderr, "%d", tok.value.i);
+    fprintf(out, "%d", tok.value.i);
     break;
   }
 }
 
+// Classification of input bytes, looked up in char_classes.
+enum char_class : std::uint8_t {
+  char_space = 1u << 0,
+  char_alpha = 1u << 1,
+  char_digit = 1u << 2,
+  char_sym = 1u << 3,
+  char_ident_start = char_alpha | char_sym,
+  char_ident = char_alpha | char_sym | char_digit,
+};
+
+constexpr std::array<std::uint8_t, 256> make_char_classes() {
+  std::array<std::uint8_t, 256> classes = {};
+  for (int c = 'a'; c <= 'z'; ++c)
+    classes[c] |= char_alpha;
+  for (int c = 'A'; c <= 'Z'; ++c)
+    classes[c] |= char_alpha;
+  for (int c = '0'; c <= '9'; ++c)
+    classes[c] |= char_digit;
+  for (const char c : std::string_view{"!$%&*+-./:<=>?@^_~"})
+    classes[static_cast<unsigned char>(c)] |= char_sym;
+  classes[' '] |= char_space;
+  classes['\t'] |= char_space;
+  classes['\n'] |= char_space;
+  return classes;
+}
+
+constexpr std::array<std::uint8_t, 256> char_classes = make_char_classes();
+
+bool has_class(char c, std::uint8_t cls) {
+  return char_classes[static_cast<unsigned char>(c)] & cls;
+}
+
+// Word-at-a-time helpers. They look at the bytes of a word in parallel and
+// set the high bit of every byte satisfying the predicate. All of them
+// require the high bit of every input byte to be clear.
+using word_t = std::uint64_t;
+
+constexpr word_t splat(unsigned char c) { return ~word_t{0} / 0xffu * c; }
+
+constexpr word_t high_bits = splat(0x80);
+
+constexpr word_t bytes_in(word_t w, unsigned char lo, unsigned char hi) {
+  return (w + splat(0x80 - lo)) & ~(w + splat(0x7f - hi)) & high_bits;
+}
+
+word_t load_word(const char *ptr) {
+  word_t w;
+  std::memcpy(&w, ptr, sizeof(w));
+  return w;
+}
+
+// Whether the word consists of spaces, tabs and newlines only
+bool is_blank_word(word_t w) {
+  return !(w & high_bits) &&
+         (bytes_in(w, ' ', ' ') | bytes_in(w, '\t', '\n')) == high_bits;
+}
+
+// Whether every byte of the word has char_ident set in char_classes. That is
+// all printable ASCII characters except for the ones excluded below.
+bool is_ident_word(word_t w) {
+  if (w & high_bits)
+    return false;
+  const word_t excluded = bytes_in(w, '"', '#') | bytes_in(w, '\'', ')') |
+                          bytes_in(w, ',', ',') | bytes_in(w, ';', ';') |
+                          bytes_in(w, '[', ']') | bytes_in(w, '`', '`') |
+                          bytes_in(w, '{', '}');
+  return (bytes_in(w, '!', '~') & ~excluded) == high_bits;
+}
+
+struct keyword {
+  std::string_view name;
+  token::type t;
+};
+
+constexpr keyword keywords[] = {
+    {"->", token::type::arrow},         {"let", token::type::let},
+    {"lambda", token::type::lambda},    {"if", token::type::if_},
+    {"define", token::type::define},    {"declare", token::type::declare},
+    {"include", token::type::include},
+};
+constexpr std::size_t number_of_keywords = std::size(keywords);
+
+// An included file that is being parsed. Stores where to continue in the
+// including file as well as what the included file contributed, so it can be
+// added to the module cache once the file is done.
 struct include_return {
-  FILE *file;
-  source_location sloc;
+  std::uint32_t file;
+  const char *cur;
+  std::string path;
+  std::vector<module_cache::item> items = {};
+  bool cacheable = true;
 };
 
 struct parse_context {
-  FILE *file;
-  source_location sloc;
+  // The file being read, owned by cc.sources
+  std::uint32_t file;
+  const char *begin;
+  const char *cur;
+  const char *end;
   compilation_context &cc;
+  // Interned keywords in the order of keywords. Only handles below
+  // keyword_limit can refer to a keyword.
+  std::array<symbol, number_of_keywords> keyword_syms = {};
+  std::uint32_t keyword_limit = 0;
+  symbol int_sym = {};
+  symbol bool_sym = {};
+  symbol unit_sym = {};
   std::vector<include_return> returns = {};
   token cur_tok = {};
   std::vector<toplevel_expr> defines = {};
+  // Position of each name in defines
+  std::unordered_map<symbol, std::size_t> define_index = {};
+  // Canonical paths of all files read so far
+  std::unordered_set<std::string> included = {};
 };
 
+void intern_keywords(parse_context &ctx) {
+  for (std::size_t i = 0; i < number_of_keywords; ++i) {
+    ctx.keyword_syms[i] = ctx.cc.stbl.intern(keywords[i].name);
+    ctx.keyword_limit =
+        std::max(ctx.keyword_limit, symbol_index(ctx.keyword_syms[i]) + 1);
+  }
+  ctx.int_sym = ctx.cc.stbl.intern("int");
+  ctx.bool_sym = ctx.cc.stbl.intern("bool");
+  ctx.unit_sym = ctx.cc.stbl.intern("unit");
+}
+
+void enter_file(parse_context &ctx, std::uint32_t file, const char *cur) {
+  const source_buffer &buffer = ctx.cc.sources.buffer(file);
+  ctx.file = file;
+  ctx.begin = buffer.begin();
+  ctx.cur = cur ? cur : ctx.begin;
+  ctx.end = buffer.end();
+}
+
+void enter_buffer(parse_context &ctx, source_buffer buffer,
+                  std::string_view file_name) {
+  enter_file(ctx, ctx.cc.sources.add(std::move(buffer), file_name), nullptr);
+}
+
+source_location here(const parse_context &ctx) {
+  return {ctx.file, static_cast<std::uint32_t>(ctx.cur - ctx.begin)};
+}
+
+// Parse errors are reported right after the current token
+source_position error_position(const parse_context &ctx) {
+  return ctx.cc.sources.position(here(ctx));
+}
+
+void finish_include(parse_context &ctx, include_return &ret) {
+  if (!ctx.cc.modules || !ret.cacheable)
+    return;
+  // Nested includes are only spliced in from the cache, so all of them need
+  // to be cached as well.
+  if (!std::all_of(std::begin(ret.items), std::end(ret.items),
+                   [&](const module_cache::item &item) {
+                     return item.type || ctx.cc.modules->find(item.name);
+                   }))
+    return;
+  ctx.cc.modules->insert(ret.path, module_cache::module{std::move(ret.items)});
+}
+
+void skip_space(parse_context &ctx) {
+  const char *cur = ctx.cur;
+  const char *const end = ctx.end;
+  while (end - cur >= static_cast<std::ptrdiff_t>(sizeof(word_t)) &&
+         is_blank_word(load_word(cur)))
+    cur += sizeof(word_t);
+  while (cur != end && has_class(*cur, char_space))
+    ++cur;
+  ctx.cur = cur;
+}
+
+const char *skip_ident(const char *cur, const char *end) {
+  while (end - cur >= static_cast<std::ptrdiff_t>(sizeof(word_t)) &&
+         is_ident_word(load_word(cur)))
+    cur += sizeof(word_t);
+  while (cur != end && has_class(*cur, char_ident))
+    ++cur;
+  return cur;
+}
+
 void lex(parse_context &ctx) {
-  const auto update_pos = [&](int c) {
-    ++ctx.sloc.col;
-    if (c == '\n') {
-      ++ctx.sloc.line;
-      ctx.sloc.col = 1;
-    }
-  };
-  const auto isalpha = [](int c) {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
-  };
-  const auto issym = [](int c) {
-    const char valid_chars[] = "!$%&*+-./:<=>?@^_~";
-    return std::any_of(std::begin(valid_chars), std::end(valid_chars),
-                       [c](char c2) { return c == c2; });
-  };
-  const auto isdigit = [](int c) { return c >= '0' && c <= '9'; };
-  const auto isspace = [](int c) { return c == ' ' || c == '\t' || c == '\n'; };
-  int c;
-  ctx.cur_tok.sloc = ctx.sloc;
-  do {
-    c = std::getc(ctx.file);
-    update_pos(c);
-  } while (isspace(c));
-  if (isalpha(c) || issym(c)) {
-    std::string result;
-    result.push_back(c);
-    while (c = std::getc(ctx.file), isalpha(c) || issym(c) || isdigit(c)) {
-      result.push_back(c);
-      update_pos(c);
-    }
-    std::ungetc(c, ctx.file);
-    if (result == "->") {
-      ctx.cur_tok.t = token::type::arrow;
-      return;
-    }
-    if (result == "let") {
-      ctx.cur_tok.t = token::type::let;
-      return;
-    }
-    if (result == "lambda") {
-      ctx.cur_tok.t = token::type::lambda;
-      return;
-    }
-    if (result == "if") {
-      ctx.cur_tok.t = token::type::if_;
-      return;
-    }
-    if (result == "define") {
-      ctx.cur_tok.t = token::type::define;
-      return;
-    }
-    if (result == "declare") {
-      ctx.cur_tok.t = token::type::declare;
-      return;
-    }
-    if (result == "include") {
-      ctx.cur_tok.t = token::type::include;
+  // Tokens are located right after the previous token
+  ctx.cur_tok.sloc = here(ctx);
+  skip_space(ctx);
+  const auto finish = [&](token::type t) { ctx.cur_tok.t = t; };
+  if (ctx.cur == ctx.end) {
+    if (std::empty(ctx.returns)) {
+      finish(token::type::eof);
       return;
     }
-    ctx.cur_tok.t = token::type::identifier;
-    ctx.cur_tok.value.s = ctx.cc.stbl.store(result);
+    auto &&ret = ctx.returns.back();
+    finish_include(ctx, ret);
+    enter_file(ctx, ret.file, ret.cur);
+    ctx.returns.pop_back();
+    lex(ctx);
     return;
   }
-  if (isdigit(c)) {
-    int result = c - '0';
-    while (c = std::getc(ctx.file), isdigit(c)) {
-      result = result * 10 + c - '0';
-      update_pos(c);
+  const char c = *ctx.cur;
+  if (has_class(c, char_ident_start)) {
+    const char *const begin = ctx.cur;
+    ctx.cur = skip_ident(begin + 1, ctx.end);
+    const std::string_view result{begin,
+                                  static_cast<std::size_t>(ctx.cur - begin)};
+    const symbol sym = ctx.cc.stbl.intern(result);
+    if (symbol_index(sym) < ctx.keyword_limit) {
+      for (std::size_t i = 0; i < number_of_keywords; ++i) {
+        if (ctx.keyword_syms[i] == sym) {
+          finish(keywords[i].t);
+          return;
+        }
+      }
     }
-    std::ungetc(c, ctx.file);
-    ctx.cur_tok.t = token::type::number;
+    ctx.cur_tok.value.s = sym;
+    finish(token::type::identifier);
+    return;
+  }
+  if (has_class(c, char_digit)) {
+    int result = 0;
+    const char *const end = ctx.end;
+    for (; ctx.cur != end && has_class(*ctx.cur, char_digit); ++ctx.cur)
+      result = result * 10 + *ctx.cur - '0';
     ctx.cur_tok.value.i = result;
+    finish(token::type::number);
     return;
   }
+  ++ctx.cur;
   if (c == '(') {
-    ctx.cur_tok.t = token::type::lpar;
+    finish(token::type::lpar);
     return;
   }
   if (c == ')') {
-    ctx.cur_tok.t = token::type::rpar;
+    finish(token::type::rpar);
     return;
   }
-  if (c == EOF) {
-    if (std::empty(ctx.returns)) {
-      ctx.cur_tok.t = token::type::eof;
-      return;
-    } else {
-      fclose(ctx.file);
-      ctx.file = ctx.returns.back().file;
-      ctx.sloc = ctx.returns.back().sloc;
-      lex(ctx);
-      return;
-    }
-  }
-  ctx.cur_tok.t = token::type::error;
+  finish(token::type::error);
 }
 
 template <class... Args>
@@ -198,49 +337,54 @@ expr *make_expr(compilation_context &cc, Args &&...args) {
 
 expr *parse_expr(parse_context &ctx);
 
-expr *parse_lambda(parse_context &ctx, const source_location &sloc) {
+expr *parse_lambda(parse_context &ctx, source_location sloc) {
   lambda_expr res;
   lex(ctx);
   if (ctx.cur_tok.t != token::type::lpar) {
-    fprintf(stderr, "%.*s:%d:%d: error: Expected parameter list\n",
-            static_cast<int>(std::size(ctx.sloc.file_name)),
-            std::data(ctx.sloc.file_name), ctx.sloc.line, ctx.sloc.col);
+    const source_position pos = error_position(ctx);
+    fprintf(ctx.cc.diag, "%.*s:%d:%d: error: Expected parameter list\n",
+            static_cast<int>(std::size(pos.file_name)),
+            std::data(pos.file_name), pos.line, pos.col);
     return nullptr;
   }
   lex(ctx);
   std::vector<variable_expr> args;
   while (ctx.cur_tok.t != token::type::rpar) {
     if (ctx.cur_tok.t != token::type::identifier) {
-      fprintf(stderr, "%.*s:%d:%d: error: Expected parameter name\n",
-              static_cast<int>(std::size(ctx.sloc.file_name)),
-              std::data(ctx.sloc.file_name), ctx.sloc.line, ctx.sloc.col);
+      const source_position pos = error_position(ctx);
+      fprintf(ctx.cc.diag, "%.*s:%d:%d: error: Expected parameter name\n",
+              static_cast<int>(std::size(pos.file_name)),
+              std::data(pos.file_name), pos.line, pos.col);
       return nullptr;
     }
     args.push_back(variable_expr{ctx.cur_tok.value.s});
     lex(ctx);
   }
-  res.params = spanify(ctx.cc.expr_alloc, args);
+  res.params = compact_spanify(ctx.cc.expr_alloc, args);
   lex(ctx);
   res.body = parse_expr(ctx);
   if (!res.body)
     return nullptr;
   if (ctx.cur_tok.t != token::type::rpar) {
-    fprintf(stderr, "%.*s:%d:%d: error: Expected closing paren after lambda\n",
-            static_cast<int>(std::size(ctx.sloc.file_name)),
-            std::data(ctx.sloc.file_name), ctx.sloc.line, ctx.sloc.col);
+    const source_position pos = error_position(ctx);
+    fprintf(ctx.cc.diag,
+            "%.*s:%d:%d: error: Expected closing paren after lambda\n",
+            static_cast<int>(std::size(pos.file_name)),
+            std::data(pos.file_name), pos.line, pos.col);
     return nullptr;
   }
   lex(ctx);
   return make_expr(ctx.cc, std::move(res), sloc);
 }
 
-expr *parse_let(parse_context &ctx, const source_location &sloc) {
+expr *parse_let(parse_context &ctx, source_location sloc) {
   let_expr res;
   lex(ctx);
   if (ctx.cur_tok.t != token::type::lpar) {
-    fprintf(stderr, "%.*s:%d:%d: error: Expected let binding list\n",
-            static_cast<int>(std::size(ctx.sloc.file_name)),
-            std::data(ctx.sloc.file_name), ctx.sloc.line, ctx.sloc.col);
+    const source_position pos = error_position(ctx);
+    fprintf(ctx.cc.diag, "%.*s:%d:%d: error: Expected let binding list\n",
+            static_cast<int>(std::size(pos.file_name)),
+            std::data(pos.file_name), pos.line, pos.col);
     return nullptr;
   }
   lex(ctx);
@@ -248,16 +392,18 @@ expr *parse_let(parse_context &ctx, const source_location &sloc) {
   while (ctx.cur_tok.t != token::type::rpar) {
     let_binding b;
     if (ctx.cur_tok.t != token::type::lpar) {
-      fprintf(stderr, "%.*s:%d:%d: error: Expected let binding\n",
-              static_cast<int>(std::size(ctx.sloc.file_name)),
-              std::data(ctx.sloc.file_name), ctx.sloc.line, ctx.sloc.col);
+      const source_position pos = error_position(ctx);
+      fprintf(ctx.cc.diag, "%.*s:%d:%d: error: Expected let binding\n",
+              static_cast<int>(std::size(pos.file_name)),
+              std::data(pos.file_name), pos.line, pos.col);
       return nullptr;
     }
     lex(ctx);
     if (ctx.cur_tok.t != token::type::identifier) {
-      fprintf(stderr, "%.*s:%d:%d: error: Expected let binding name\n",
-              static_cast<int>(std::size(ctx.sloc.file_name)),
-              std::data(ctx.sloc.file_name), ctx.sloc.line, ctx.sloc.col);
+      const source_position pos = error_position(ctx);
+      fprintf(ctx.cc.diag, "%.*s:%d:%d: error: Expected let binding name\n",
+              static_cast<int>(std::size(pos.file_name)),
+              std::data(pos.file_name), pos.line, pos.col);
       return nullptr;
     }
     b.name = ctx.cur_tok.value.s;
@@ -266,44 +412,51 @@ expr *parse_let(parse_context &ctx, const source_location &sloc) {
     if (!b.body)
       return nullptr;
     if (ctx.cur_tok.t != token::type::rpar) {
-      fprintf(stderr, "%.*s:%d:%d: error: Expected closing paren after let\n",
-              static_cast<int>(std::size(ctx.sloc.file_name)),
-              std::data(ctx.sloc.file_name), ctx.sloc.line, ctx.sloc.col);
+      const source_position pos = error_position(ctx);
+      fprintf(ctx.cc.diag,
+              "%.*s:%d:%d: error: Expected closing paren after let\n",
+              static_cast<int>(std::size(pos.file_name)),
+              std::data(pos.file_name), pos.line, pos.col);
       return nullptr;
     }
     lex(ctx);
     bindings.push_back(std::move(b));
   }
   lex(ctx);
-  res.bindings = spanify(ctx.cc.expr_alloc, bindings);
+  res.bindings = compact_spanify(ctx.cc.expr_alloc, bindings);
   std::vector<expr *> exprs;
   while (ctx.cur_tok.t != token::type::rpar) {
     exprs.push_back(parse_expr(ctx));
     if (!exprs.back())
       return nullptr;
   }
-  res.body = spanify(ctx.cc.expr_alloc, exprs);
+  res.body = compact_spanify(ctx.cc.expr_alloc, exprs);
   lex(ctx);
   return make_expr(ctx.cc, std::move(res), sloc);
 }
 
-expr *parse_if(parse_context &ctx, const source_location &sloc) {
+expr *parse_if(parse_context &ctx, source_location sloc) {
   if_expr res;
   lex(ctx);
   res.cond = parse_expr(ctx);
   if (!res.cond)
     return nullptr;
-  res.then = parse_expr(ctx);
-  if (!res.then)
+  expr *const then = parse_expr(ctx);
+  if (!then)
     return nullptr;
-  res.els = parse_expr(ctx);
-  if (!res.els)
+  expr *const els = parse_expr(ctx);
+  if (!els)
     return nullptr;
+  res.branches = static_cast<expr **>(
+      ctx.cc.expr_alloc.allocate(2 * sizeof(expr *), alignof(expr *)));
+  res.branches[0] = then;
+  res.branches[1] = els;
   if (ctx.cur_tok.t != token::type::rpar) {
-    fprintf(stderr,
+    const source_position pos = error_position(ctx);
+    fprintf(ctx.cc.diag,
             "%.*s:%d:%d: error: Expected closing paren after conditional\n",
-            static_cast<int>(std::size(ctx.sloc.file_name)),
-            std::data(ctx.sloc.file_name), ctx.sloc.line, ctx.sloc.col);
+            static_cast<int>(std::size(pos.file_name)),
+            std::data(pos.file_name), pos.line, pos.col);
     return nullptr;
   }
   lex(ctx);
@@ -346,7 +499,7 @@ expr *parse_expr(parse_context &ctx) {
           return nullptr;
         args.push_back(arg_expr);
       }
-      res.args = spanify(ctx.cc.expr_alloc, args);
+      res.args = compact_spanify(ctx.cc.expr_alloc, args);
       lex(ctx);
       return make_expr(ctx.cc, std::move(res), sloc);
     }
@@ -361,50 +514,63 @@ expr *parse_expr(parse_context &ctx) {
   case token::type::define:
   case token::type::declare:
   case token::type::include:
-    fprintf(stderr, "%.*s:%d:%d: error: Unexpected token ",
-            static_cast<int>(std::size(ctx.sloc.file_name)),
-            std::data(ctx.sloc.file_name), ctx.sloc.line, ctx.sloc.col);
-    print_token(ctx.cur_tok);
-    fputc('\n', stderr);
+    const source_position pos = error_position(ctx);
+    fprintf(ctx.cc.diag, "%.*s:%d:%d: error: Unexpected token ",
+            static_cast<int>(std::size(pos.file_name)),
+            std::data(pos.file_name), pos.line, pos.col);
+    print_token(ctx.cur_tok, ctx.cc.stbl, ctx.cc.diag);
+    fputc('\n', ctx.cc.diag);
     return nullptr;
   }
   unreachable();
 }
 
+// Returns the toplevel entry for name, appending an empty one to defines if
+// the name was not seen before.
+toplevel_expr &get_toplevel(parse_context &ctx, symbol name) {
+  const auto [iter, inserted] =
+      ctx.define_index.try_emplace(name, std::size(ctx.defines));
+  if (inserted)
+    ctx.defines.push_back(toplevel_expr{name, 0, nullptr, nullptr});
+  return ctx.defines[iter->second];
+}
+
 bool parse_def(parse_context &ctx) {
   lex(ctx);
   if (ctx.cur_tok.t != token::type::identifier) {
-    fprintf(stderr, "%.*s:%d:%d: error: Expected definition name\n",
-            static_cast<int>(std::size(ctx.sloc.file_name)),
-            std::data(ctx.sloc.file_name), ctx.sloc.line, ctx.sloc.col);
+    const source_position pos = error_position(ctx);
+    fprintf(ctx.cc.diag, "%.*s:%d:%d: error: Expected definition name\n",
+            static_cast<int>(std::size(pos.file_name)),
+            std::data(pos.file_name), pos.line, pos.col);
     return false;
   }
-  const std::string_view name = ctx.cur_tok.value.s;
+  const symbol name = ctx.cur_tok.value.s;
   lex(ctx);
   expr *const ptr = parse_expr(ctx);
   if (!ptr) {
     return false;
   }
-  const auto end = std::end(ctx.defines);
-  const auto iter = std::find_if(
-      std::begin(ctx.defines), end,
-      [name](const toplevel_expr &expr) { return expr.name == name; });
-  if (iter == end)
-    ctx.defines.push_back(toplevel_expr{name, 0, nullptr, ptr});
-  else if (iter->value) {
-    fprintf(stderr, "%.*s:%d:%d: error: Duplicate definition of \"%.*s\"\n",
-            static_cast<int>(std::size(ctx.sloc.file_name)),
-            std::data(ctx.sloc.file_name), ctx.sloc.line, ctx.sloc.col,
-            static_cast<int>(std::size(name)), std::data(name));
+  if (!std::empty(ctx.returns))
+    ctx.returns.back().cacheable = false;
+  toplevel_expr &def = get_toplevel(ctx, name);
+  if (def.value) {
+    const source_position pos = error_position(ctx);
+    fprintf(ctx.cc.diag,
+            "%.*s:%d:%d: error: Duplicate definition of \"%.*s\"\n",
+            static_cast<int>(std::size(pos.file_name)),
+            std::data(pos.file_name), pos.line, pos.col,
+            static_cast<int>(std::size(ctx.cc.stbl[name])),
+            std::data(ctx.cc.stbl[name]));
     return false;
-  } else
-    iter->value = ptr;
+  }
+  def.value = ptr;
   if (ctx.cur_tok.t != token::type::rpar) {
+    const source_position pos = error_position(ctx);
     fprintf(
-        stderr,
+        ctx.cc.diag,
         "%.*s:%d:%d: error: Expected closing paren after closing definition\n",
-        static_cast<int>(std::size(ctx.sloc.file_name)),
-        std::data(ctx.sloc.file_name), ctx.sloc.line, ctx.sloc.col);
+        static_cast<int>(std::size(pos.file_name)),
+        std::data(pos.file_name), pos.line, pos.col);
     return false;
   }
   lex(ctx);
@@ -419,12 +585,12 @@ type_expr *make_type_expr(parse_context &ctx, const type_expr &expr) {
 type_expr *parse_type_expr(parse_context &ctx) {
   if (ctx.cur_tok.t == token::type::identifier) {
     const auto ident = ctx.cur_tok.value.s;
-    if (ident == "int") {
+    if (ident == ctx.int_sym) {
       return make_type_expr(ctx, type_expr{int_type_expr{}});
     }
-    if (ident == "bool")
+    if (ident == ctx.bool_sym)
       return make_type_expr(ctx, type_expr{bool_type_expr{}});
-    if (ident == "unit")
+    if (ident == ctx.unit_sym)
       return make_type_expr(ctx, type_expr{unit_type_expr{}});
   }
   if (ctx.cur_tok.t == token::type::lpar) {
@@ -445,12 +611,56 @@ type_expr *parse_type_expr(parse_context &ctx) {
   return nullptr;
 }
 
+bool add_decl(parse_context &ctx, symbol name, type_expr *type) {
+  toplevel_expr &decl = get_toplevel(ctx, name);
+  if (decl.type_value)
+    return false;
+  decl.type_value = type;
+  return true;
+}
+
+// Adds the declarations of a cached module, recursing into the modules it
+// includes unless they were included before.
+bool splice_module(parse_context &ctx, const module_cache::module &mod) {
+  for (auto &&item : mod.items) {
+    if (item.type) {
+      if (!add_decl(ctx, ctx.cc.stbl.intern(item.name), item.type))
+        return false;
+      continue;
+    }
+    if (!ctx.included.insert(item.name).second)
+      continue;
+    ctx.cc.included_files.push_back(item.name);
+    if (!splice_module(ctx, *ctx.cc.modules->find(item.name)))
+      return false;
+  }
+  return true;
+}
+
+// Adds the declarations of a binary module interface
+bool include_interface(parse_context &ctx, const source_buffer &buffer,
+                       std::string_view file_name) {
+  const auto decls = read_interface(buffer, ctx.cc.expr_alloc);
+  if (!decls) {
+    fprintf(ctx.cc.diag, "%.*s: error: Invalid module interface\n",
+            static_cast<int>(std::size(file_name)), std::data(file_name));
+    return false;
+  }
+  for (auto &&decl : *decls) {
+    if (!add_decl(ctx, ctx.cc.stbl.intern(decl.name), decl.type))
+      return false;
+    if (!std::empty(ctx.returns))
+      ctx.returns.back().items.push_back({std::string{decl.name}, decl.type});
+  }
+  return true;
+}
+
 bool parse_decl(parse_context &ctx) {
   lex(ctx);
   if (ctx.cur_tok.t != token::type::identifier) {
     return false;
   }
-  const std::string_view name = ctx.cur_tok.value.s;
+  const symbol name = ctx.cur_tok.value.s;
   lex(ctx);
   type_expr *const ptr = parse_type_expr(ctx);
   if (!ptr) {
@@ -459,17 +669,12 @@ bool parse_decl(parse_context &ctx) {
   if (ctx.cur_tok.t != token::type::rpar) {
     return false;
   }
-  lex(ctx);
-  const auto end = std::end(ctx.defines);
-  const auto iter = std::find_if(
-      std::begin(ctx.defines), end,
-      [name](const toplevel_expr &expr) { return expr.name == name; });
-  if (iter == end)
-    ctx.defines.push_back(toplevel_expr{name, 0, ptr, nullptr});
-  else if (iter->type_value)
+  if (!add_decl(ctx, name, ptr))
     return false;
-  else
-    iter->type_value = ptr;
+  if (!std::empty(ctx.returns))
+    ctx.returns.back().items.push_back(
+        {std::string{ctx.cc.stbl[name]}, ptr});
+  lex(ctx);
   return true;
 }
 
@@ -477,15 +682,51 @@ bool parse_include(parse_context &ctx) {
   lex(ctx);
   if (ctx.cur_tok.t != token::type::identifier)
     return false;
-  const std::string_view include_file = ctx.cur_tok.value.s;
+  const std::string_view include_file = ctx.cc.stbl[ctx.cur_tok.value.s];
   lex(ctx);
   if (ctx.cur_tok.t != token::type::rpar)
     return false;
-  ctx.returns.push_back({ctx.file, ctx.sloc});
-  ctx.file = std::fopen(std::string{include_file}.c_str(), "r");
-  if (!ctx.file)
+  std::error_code ec;
+  const std::string path =
+      std::filesystem::canonical(std::filesystem::path{include_file}, ec)
+          .string();
+  if (ec) {
+    const source_position pos = error_position(ctx);
+    fprintf(ctx.cc.diag, "%.*s:%d:%d: error: Could not find \"%.*s\"\n",
+            static_cast<int>(std::size(pos.file_name)),
+            std::data(pos.file_name), pos.line, pos.col,
+            static_cast<int>(std::size(include_file)),
+            std::data(include_file));
     return false;
-  ctx.sloc = {include_file};
+  }
+  if (!std::empty(ctx.returns))
+    ctx.returns.back().items.push_back({path, nullptr});
+  if (!ctx.included.insert(path).second) {
+    lex(ctx);
+    return true;
+  }
+  ctx.cc.included_files.push_back(path);
+  if (ctx.cc.modules) {
+    if (const auto *const cached = ctx.cc.modules->find(path)) {
+      if (!splice_module(ctx, *cached))
+        return false;
+      lex(ctx);
+      return true;
+    }
+  }
+  auto buffer = source_buffer::open(path.c_str());
+  if (!buffer)
+    return false;
+  if (std::size(path) >= std::size(interface_extension) &&
+      path.compare(std::size(path) - std::size(interface_extension),
+                   std::string::npos, interface_extension) == 0) {
+    if (!include_interface(ctx, *buffer, include_file))
+      return false;
+    lex(ctx);
+    return true;
+  }
+  ctx.returns.push_back({ctx.file, ctx.cur, path});
+  enter_buffer(ctx, std::move(*buffer), include_file);
   lex(ctx);
   return true;
 }
@@ -506,12 +747,31 @@ bool parse_toplevel(parse_context &ctx) {
 } // namespace
 
 std::optional<std::vector<toplevel_expr>>
-parse(FILE *f, std::string_view file_name, compilation_context &cc) {
-  parse_context ctx{f, {file_name, 1, 1}, cc};
+parse(source_buffer buffer, std::string_view file_name,
+      compilation_context &cc) {
+  parse_context ctx{0, nullptr, nullptr, nullptr, cc};
+  intern_keywords(ctx);
+  std::error_code ec;
+  const auto path =
+      std::filesystem::canonical(std::filesystem::path{file_name}, ec);
+  if (!ec)
+    ctx.included.insert(path.string());
+  enter_buffer(ctx, std::move(buffer), file_name);
   lex(ctx);
   if (!parse_toplevel(ctx))
     return std::nullopt;
   return std::move(ctx.defines);
 }
 
+std::optional<std::vector<toplevel_expr>>
+parse(FILE *f, std::string_view file_name, compilation_context &cc) {
+  auto buffer = source_buffer::read(f);
+  if (!buffer) {
+    fprintf(cc.diag, "%.*s: error: Could not read input\n",
+            static_cast<int>(std::size(file_name)), std::data(file_name));
+    return std::nullopt;
+  }
+  return parse(std::move(*buffer), file_name, cc);
+}
+
 } // namespace lyn
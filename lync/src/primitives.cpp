@@ -6,8 +6,9 @@ const primitive_info primitives[number_of_primitives] = {
     {"+", primitive_type::int_int_int},
     {"-", primitive_type::int_int_int},
     {"*", primitive_type::int_int_int},
-    {"/", primitive_type::int_int_int},
-    {"%", primitive_type::int_int_int},
+    // Division by zero is up to the runtime
+    {"/", primitive_type::int_int_int, false, true},
+    {"%", primitive_type::int_int_int, false, true},
     {"shl", primitive_type::int_int_int},
     {"shr", primitive_type::int_int_int},
     {"lor", primitive_type::int_int_int},
@@ -2,12 +2,13 @@
 
 #include <algorithm>
 #include <cstdio>
+#include <string_view>
 
 namespace lyn {
 
 namespace {
 
-void print_int_list(const std::vector<int> &lst, FILE *out) {
+void print_int_list(span<const int> lst, FILE *out) {
   if (std::empty(lst))
     return;
   fprintf(out, "%d", lst.front());
@@ -21,19 +22,20 @@ void print_anf(anf_context &ctx, FILE *out) {
   for (auto &&def : ctx.defs) {
     if (def.global)
       fputs("<global> ", out);
-    fprintf(out, "%.*s:\n", static_cast<int>(std::size(def.name)),
-            def.name.data());
-    for (std::size_t i = 0; i < std::size(def.blocks); ++i) {
-      auto &&block = def.blocks[i];
+    const std::string_view def_name = ctx.name_of(def.name);
+    fprintf(out, "%.*s:\n", static_cast<int>(std::size(def_name)),
+            def_name.data());
+    const auto blocks = ctx.blocks_of(def);
+    for (std::size_t i = 0; i < std::size(blocks); ++i) {
       fprintf(out, ".L%d:\n", static_cast<int>(i));
-      for (auto &&inst : block.content) {
+      for (auto &&inst : ctx.instrs_of(blocks[i])) {
         std::visit(
-            [out](auto &&val) {
+            [&ctx, out](auto &&val) {
               using val_t = std::decay_t<decltype(val)>;
               if constexpr (std::is_same_v<val_t, anf_receive>) {
                 fputs("\t", out);
-                print_int_list(val.args, out);
-                if (!std::empty(val.args)) {
+                print_int_list(ctx.operands_of(val.args), out);
+                if (val.args.size != 0) {
                   fputs(" <- ", out);
                 }
                 fputs("receive\n", out);
@@ -42,50 +44,27 @@ void print_anf(anf_context &ctx, FILE *out) {
                 fputs("\tadjust_stack\n", out);
               }
               if constexpr (std::is_same_v<val_t, anf_global>) {
+                const std::string_view name = ctx.name_of(val.name);
                 fprintf(out, "\t%d <- global \"%.*s\"\n", val.id,
-                        static_cast<int>(std::size(val.name)), val.name.data());
+                        static_cast<int>(std::size(name)), name.data());
               }
               if constexpr (std::is_same_v<val_t, anf_constant>) {
                 fprintf(out, "\t%d <- const %d\n", val.id, val.value);
               }
               if constexpr (std::is_same_v<val_t, anf_call>) {
-                if (val.is_tail) {
+                if (val.is_tail)
                   fputs("\ttailcall ", out);
-                  std::visit(
-                      [&](auto &&target) {
-                        using target_t = std::decay_t<decltype(target)>;
-                        if constexpr (std::is_same_v<target_t, int>) {
-                          fprintf(out, "%d(", target);
-                        }
-                        if constexpr (std::is_same_v<target_t,
-                                                     std::string_view>) {
-                          fprintf(out, "\"%.*s\"(",
-                                  static_cast<int>(std::size(target)),
-                                  std::data(target));
-                        }
-                      },
-                      val.call_target);
-                  print_int_list(val.arg_ids, out);
-                  fputs(")\n", out);
-                } else {
+                else
                   fprintf(out, "\t%d <- call ", val.res_id);
-                  std::visit(
-                      [&](auto &&target) {
-                        using target_t = std::decay_t<decltype(target)>;
-                        if constexpr (std::is_same_v<target_t, int>) {
-                          fprintf(out, "%d(", target);
-                        }
-                        if constexpr (std::is_same_v<target_t,
-                                                     std::string_view>) {
-                          fprintf(out, "\"%.*s\"(",
-                                  static_cast<int>(std::size(target)),
-                                  std::data(target));
-                        }
-                      },
-                      val.call_target);
-                  print_int_list(val.arg_ids, out);
-                  fputs(")\n", out);
+                if (val.target) {
+                  fprintf(out, "%d(", val.target);
+                } else {
+                  const std::string_view name = ctx.name_of(val.name);
+                  fprintf(out, "\"%.*s\"(", static_cast<int>(std::size(name)),
+                          std::data(name));
                 }
+                print_int_list(ctx.operands_of(val.args), out);
+                fputs(")\n", out);
               }
               if constexpr (std::is_same_v<val_t, anf_assoc>) {
                 fprintf(out, "\t%d <- alias %d\n", val.id, val.alias);
@@ -95,9 +74,9 @@ void print_anf(anf_context &ctx, FILE *out) {
                         val.else_block);
               }
               if constexpr (std::is_same_v<val_t, anf_global_assign>) {
+                const std::string_view name = ctx.name_of(val.name);
                 fprintf(out, "\tassign_global \"%.*s\" <- %d\n",
-                        static_cast<int>(std::size(val.name)), val.name.data(),
-                        val.id);
+                        static_cast<int>(std::size(name)), name.data(), val.id);
               }
               if constexpr (std::is_same_v<val_t, anf_return>) {
                 fprintf(out, "\tret %d\n", val.value);
@@ -0,0 +1,316 @@
+#include "regalloc.h"
+
+#include <algorithm>
+#include <climits>
+#include <stdexcept>
+#include <utility>
+
+namespace lyn {
+
+namespace {
+
+constexpr int caller_saved_registers[] = {0, 1, 2, 3};
+constexpr int callee_saved_registers[] = {4, 5, 6, 7};
+constexpr int register_count = 8;
+// Registers left to the code generator for spilled values
+constexpr int first_scratch_register = 2;
+
+bool test_bit(const std::uint64_t *set, int bit) {
+  return (set[bit / 64] >> (bit % 64)) & 1u;
+}
+
+void set_bit(std::uint64_t *set, int bit) {
+  set[bit / 64] |= std::uint64_t{1} << (bit % 64);
+}
+
+template <class Fun>
+void for_each_bit(const std::uint64_t *set, std::size_t words, Fun &&fun) {
+  for (std::size_t word = 0; word != words; ++word)
+    for (std::uint64_t bits = set[word]; bits; bits &= bits - 1)
+      fun(static_cast<int>(word * 64 + __builtin_ctzll(bits)));
+}
+
+// Calls fun with the index of every block control may continue at after
+// leaving block
+template <class Fun>
+void for_each_successor(const anf_context &ctx, const basic_block &block,
+                        Fun &&fun) {
+  const auto instrs = ctx.instrs_of(block);
+  if (std::empty(instrs))
+    return;
+  if (const auto *const cond = std::get_if<anf_cond>(&instrs.back())) {
+    fun(cond->then_block);
+    fun(cond->else_block);
+  }
+  if (const auto *const jump = std::get_if<anf_jump>(&instrs.back()))
+    fun(jump->target);
+}
+
+} // namespace
+
+register_allocator::register_allocator(const anf_context &ctx,
+                                       std::vector<bool> inline_calls)
+    : ctx{ctx}, inline_calls{std::move(inline_calls)},
+      result{id_table<value_location>{ctx.first_id}},
+      value_indices{ctx.first_id} {}
+
+int register_allocator::index_of(int id) {
+  value_ref &ref = value_indices[id];
+  if (ref.generation != generation) {
+    ref = value_ref{generation, static_cast<int>(std::size(value_ids))};
+    value_ids.push_back(id);
+    intervals.push_back(live_interval{INT_MAX, -1, false, false, -1, -1});
+  }
+  return ref.index;
+}
+
+const register_assignment &register_allocator::run(const anf_def &def) {
+  ++generation;
+  value_ids.clear();
+  intervals.clear();
+  result.saved_registers = 0;
+  result.saves_lr = false;
+  bool stores_globals = false;
+  const auto blocks = ctx.blocks_of(def);
+  for (auto &&block : blocks)
+    for (auto &&instr : ctx.instrs_of(block)) {
+      for_each_def(ctx, instr, [this](int id) { index_of(id); });
+      for_each_use(ctx, instr, [this](int id) { index_of(id); });
+      stores_globals |= std::holds_alternative<anf_global_assign>(instr);
+    }
+  compute_liveness(blocks);
+  build_intervals(blocks);
+  const unsigned forced_registers = result.saved_registers;
+  result.scratch_registers = stores_globals;
+  scan();
+  if (result.spill_slots && !result.scratch_registers) {
+    result.saved_registers = forced_registers;
+    result.scratch_registers = true;
+    scan();
+  }
+  return result;
+}
+
+// Backwards data flow analysis of the values live at the start and the end
+// of every block
+void register_allocator::compute_liveness(span<const basic_block> blocks) {
+  words_per_set = (std::size(value_ids) + 63) / 64;
+  const std::size_t set_size = std::size(blocks) * words_per_set;
+  live_in.assign(set_size, 0);
+  live_out.assign(set_size, 0);
+  used_before_def.assign(set_size, 0);
+  defined.assign(set_size, 0);
+  for (std::size_t b = 0; b != std::size(blocks); ++b) {
+    std::uint64_t *const uses = std::data(used_before_def) + b * words_per_set;
+    std::uint64_t *const defs = std::data(defined) + b * words_per_set;
+    for (auto &&instr : ctx.instrs_of(blocks[b])) {
+      for_each_use(ctx, instr, [&](int id) {
+        if (!test_bit(defs, index_of(id)))
+          set_bit(uses, index_of(id));
+      });
+      for_each_def(ctx, instr,
+                   [&](int id) { set_bit(defs, index_of(id)); });
+    }
+  }
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (std::size_t b = std::size(blocks); b-- != 0;) {
+      std::uint64_t *const in = std::data(live_in) + b * words_per_set;
+      std::uint64_t *const out = std::data(live_out) + b * words_per_set;
+      for_each_successor(ctx, blocks[b], [&](int succ) {
+        const std::uint64_t *const succ_in =
+            std::data(live_in) + succ * words_per_set;
+        for (std::size_t word = 0; word != words_per_set; ++word)
+          out[word] |= succ_in[word];
+      });
+      const std::size_t offset = b * words_per_set;
+      for (std::size_t word = 0; word != words_per_set; ++word) {
+        const std::uint64_t value = used_before_def[offset + word] |
+                                    (out[word] & ~defined[offset + word]);
+        changed |= value != in[word];
+        in[word] = value;
+      }
+    }
+  }
+  // Values live when entering the definition belong to an enclosing one
+  for (std::size_t word = 0; word != words_per_set; ++word)
+    if (!std::empty(blocks) && live_in[word])
+      throw std::out_of_range{"No register or stack slot for local"};
+}
+
+// Instruction k reads its operands at position 2k and writes its results at
+// position 2k + 1. The interval of a value spans all positions it is live at,
+// including the blocks it is live through.
+void register_allocator::build_intervals(span<const basic_block> blocks) {
+  call_positions.clear();
+  bool four_argument_tail_call = false;
+  const auto extend = [this](int value, int pos, bool use) {
+    live_interval &interval = intervals[value];
+    interval.start = std::min(interval.start, pos);
+    interval.end = std::max(interval.end, pos);
+    interval.used |= use;
+  };
+  int k = 0;
+  for (std::size_t b = 0; b != std::size(blocks); ++b) {
+    const int first = k;
+    for (auto &&instr : ctx.instrs_of(blocks[b])) {
+      for_each_use(ctx, instr,
+                   [&](int id) { extend(index_of(id), 2 * k, true); });
+      for_each_def(ctx, instr,
+                   [&](int id) { extend(index_of(id), 2 * k + 1, false); });
+      if (const auto *const receive = std::get_if<anf_receive>(&instr)) {
+        const auto params = ctx.operands_of(receive->args);
+        for (std::size_t i = 0; i < std::size(params) && i < 4; ++i)
+          intervals[index_of(params[i])].hint_reg = static_cast<int>(i);
+      }
+      if (const auto *const call = std::get_if<anf_call>(&instr)) {
+        if (!is_inline_call(*call) && !call->is_tail) {
+          call_positions.push_back(2 * k);
+          intervals[index_of(call->res_id)].hint_reg = 0;
+        }
+        // Indirect tail calls keep their target in ip, so moving their
+        // arguments needs lr as well
+        result.saves_lr |= !is_inline_call(*call) &&
+                           (!call->is_tail || call->target);
+        four_argument_tail_call |= call->is_tail && call->args.size >= 4;
+      }
+      if (const auto *const assoc = std::get_if<anf_assoc>(&instr))
+        if (assoc->alias)
+          intervals[index_of(assoc->id)].hint_value = index_of(assoc->alias);
+      ++k;
+    }
+    if (k == first)
+      continue;
+    const std::size_t offset = b * words_per_set;
+    for_each_bit(std::data(live_in) + offset, words_per_set,
+                 [&](int value) { extend(value, 2 * first, true); });
+    for_each_bit(std::data(live_out) + offset, words_per_set,
+                 [&](int value) { extend(value, 2 * k - 1, true); });
+  }
+  // The code restoring lr for a tail call needs a free register, when all of
+  // r0-r3 hold arguments r4 is used
+  if (result.saves_lr && four_argument_tail_call)
+    result.saved_registers |= 1u << 4;
+  for (auto &&interval : intervals) {
+    const auto call = std::lower_bound(std::begin(call_positions),
+                                       std::end(call_positions),
+                                       interval.start);
+    interval.crosses_call =
+        call != std::end(call_positions) && *call < interval.end;
+  }
+}
+
+void register_allocator::spill(int value) {
+  spilled.push_back(value);
+}
+
+// Spilled values share a slot when their intervals do not overlap. Like the
+// registers, slots are handed out in the order the intervals start.
+void register_allocator::assign_spill_slots() {
+  std::sort(std::begin(spilled), std::end(spilled), [this](int lhs, int rhs) {
+    return intervals[lhs].start < intervals[rhs].start;
+  });
+  // Value occupying each slot, -1 for free ones
+  slot_owners.clear();
+  for (const int value : spilled) {
+    int slot = 0;
+    while (slot < static_cast<int>(std::size(slot_owners)) &&
+           slot_owners[slot] >= 0 &&
+           intervals[slot_owners[slot]].end >= intervals[value].start)
+      ++slot;
+    if (slot == static_cast<int>(std::size(slot_owners)))
+      slot_owners.push_back(value);
+    else
+      slot_owners[slot] = value;
+    result.locations[value_ids[value]] =
+        value_location{value_location::slot, slot};
+  }
+  result.spill_slots = static_cast<int>(std::size(slot_owners));
+}
+
+// Linear scan: Values are visited by the start of their intervals, values
+// whose intervals ended give their registers back. If no register is left,
+// the value whose interval ends last is spilled.
+void register_allocator::scan() {
+  spilled.clear();
+  const int caller_saved_count =
+      result.scratch_registers
+          ? first_scratch_register
+          : static_cast<int>(std::size(caller_saved_registers));
+  order.clear();
+  for (std::size_t value = 0; value != std::size(intervals); ++value) {
+    if (intervals[value].used)
+      order.push_back(static_cast<int>(value));
+    else
+      result.locations[value_ids[value]] = value_location{};
+  }
+  std::sort(std::begin(order), std::end(order), [this](int lhs, int rhs) {
+    return intervals[lhs].start < intervals[rhs].start;
+  });
+  int owner[register_count];
+  std::fill(std::begin(owner), std::end(owner), -1);
+  active.clear();
+  const auto register_of = [this](int value) {
+    return result.locations[value_ids[value]].index;
+  };
+  for (const int value : order) {
+    const live_interval &interval = intervals[value];
+    active.erase(std::remove_if(std::begin(active), std::end(active),
+                                [&](int other) {
+                                  if (intervals[other].end >= interval.start)
+                                    return false;
+                                  owner[register_of(other)] = -1;
+                                  return true;
+                                }),
+                 std::end(active));
+    const auto allowed = [&](int reg) {
+      return reg >= 4 ||
+             (reg >= 0 && reg < caller_saved_count && !interval.crosses_call);
+    };
+    int hint = interval.hint_reg;
+    if (interval.hint_value >= 0) {
+      const value_location &hinted =
+          result.locations[value_ids[interval.hint_value]];
+      if (hinted.kind == value_location::reg)
+        hint = hinted.index;
+    }
+    int reg = -1;
+    if (hint >= 0 && allowed(hint) && owner[hint] < 0)
+      reg = hint;
+    if (reg < 0 && !interval.crosses_call)
+      for (const int candidate : caller_saved_registers)
+        if (candidate < caller_saved_count && owner[candidate] < 0) {
+          reg = candidate;
+          break;
+        }
+    if (reg < 0)
+      for (const int candidate : callee_saved_registers)
+        if (owner[candidate] < 0) {
+          reg = candidate;
+          break;
+        }
+    if (reg < 0) {
+      int victim = -1;
+      for (const int other : active)
+        if (allowed(register_of(other)) &&
+            (victim < 0 || intervals[other].end > intervals[victim].end))
+          victim = other;
+      if (victim < 0 || intervals[victim].end <= interval.end) {
+        spill(value);
+        continue;
+      }
+      reg = register_of(victim);
+      spill(victim);
+      active.erase(std::find(std::begin(active), std::end(active), victim));
+    }
+    owner[reg] = value;
+    active.push_back(value);
+    result.locations[value_ids[value]] =
+        value_location{value_location::reg, reg};
+    if (reg >= 4)
+      result.saved_registers |= 1u << reg;
+  }
+  assign_spill_slots();
+}
+
+} // namespace lyn
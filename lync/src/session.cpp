@@ -0,0 +1,241 @@
+#include "session.h"
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include <variant>
+
+namespace lyn {
+
+namespace {
+
+void collect_references(const expr &value, const symbol_table &symtab,
+                        std::vector<int> &references) {
+  std::visit(
+      [&](auto &&expr) {
+        using expr_t = std::decay_t<decltype(expr)>;
+        if constexpr (std::is_same_v<expr_t, variable_expr>) {
+          if (expr.id >= symtab.get_first_global_id() &&
+              expr.id < symtab.get_first_local_id())
+            references.push_back(expr.id);
+        }
+        if constexpr (std::is_same_v<expr_t, apply_expr>) {
+          collect_references(*expr.func, symtab, references);
+          for (auto &&arg : expr.args)
+            collect_references(*arg, symtab, references);
+        }
+        if constexpr (std::is_same_v<expr_t, lambda_expr>) {
+          collect_references(*expr.body, symtab, references);
+        }
+        if constexpr (std::is_same_v<expr_t, let_expr>) {
+          for (auto &&binding : expr.bindings)
+            collect_references(*binding.body, symtab, references);
+          for (auto &&body : expr.body)
+            collect_references(*body, symtab, references);
+        }
+        if constexpr (std::is_same_v<expr_t, if_expr>) {
+          collect_references(*expr.cond, symtab, references);
+          collect_references(*expr.then(), symtab, references);
+          collect_references(*expr.els(), symtab, references);
+        }
+      },
+      value.content);
+}
+
+bool equal(const type_expr &lhs, const type_expr &rhs) {
+  if (lhs.content.index() != rhs.content.index())
+    return false;
+  const auto *const lhs_func = std::get_if<func_type_expr>(&lhs.content);
+  if (!lhs_func)
+    return true;
+  const auto &rhs_func = std::get<func_type_expr>(rhs.content);
+  return std::equal(std::begin(lhs_func->types), std::end(lhs_func->types),
+                    std::begin(rhs_func.types), std::end(rhs_func.types),
+                    [](const type_expr *lhs, const type_expr *rhs) {
+                      return equal(*lhs, *rhs);
+                    });
+}
+
+} // namespace
+
+session::session(FILE *diag)
+    : checker{cc.type_alloc, diag, cc.sources, lyn::first_local_id} {
+  cc.diag = diag;
+  register_primitives(cc);
+  cc.symtab.start_interleaved_registering();
+  checker.setup_primitive_types(cc.symtab, cc.stbl);
+}
+
+const session::definition *session::find(int id) const {
+  const std::size_t idx = id - cc.symtab.get_first_global_id();
+  return idx < std::size(definitions) ? &definitions[idx] : nullptr;
+}
+
+std::vector<int> session::collect_affected(
+    const std::unordered_map<int, definition> &changed) const {
+  const int first_global_id = cc.symtab.get_first_global_id();
+  const auto lookup = [&](int id) -> const definition * {
+    const auto iter = changed.find(id);
+    return iter != std::end(changed) ? &iter->second : find(id);
+  };
+  std::vector<std::vector<int>> users(std::size(definitions));
+  for (auto &&def : definitions)
+    for (const int ref : def.references)
+      users[ref - first_global_id].push_back(def.decl.id);
+
+  std::vector<int> affected;
+  std::vector<bool> queued;
+  const auto enqueue = [&](int id) {
+    const std::size_t idx = id - first_global_id;
+    if (idx >= std::size(queued))
+      queued.resize(idx + 1);
+    if (queued[idx])
+      return;
+    queued[idx] = true;
+    affected.push_back(id);
+  };
+  for (auto &&[id, def] : changed)
+    enqueue(id);
+  // Types of globals are not generalized, so type information flows through
+  // undeclared globals in both directions: Definitions referring to an
+  // affected global have to be checked again, and so do the undeclared
+  // globals referred to by an affected definition, as their type variables
+  // may still carry constraints from the previous check.
+  const auto enqueue_undeclared = [&](const std::vector<int> &references) {
+    for (const int ref : references)
+      if (const definition *const def = lookup(ref); !def->decl.type_value)
+        enqueue(ref);
+  };
+  for (std::size_t i = 0; i < std::size(affected); ++i) {
+    const int id = affected[i];
+    if (const std::size_t idx = id - first_global_id; idx < std::size(users))
+      for (const int user : users[idx])
+        enqueue(user);
+    enqueue_undeclared(lookup(id)->references);
+    if (const definition *const old = find(id))
+      enqueue_undeclared(old->references);
+  }
+  std::sort(std::begin(affected), std::end(affected));
+  return affected;
+}
+
+std::optional<std::vector<symbol>>
+session::update(source_buffer buffer, std::string_view file_name) {
+  auto forms = parse(std::move(buffer), file_name, cc);
+  if (!forms)
+    return std::nullopt;
+
+  // Register names seen for the first time and merge the new forms with the
+  // current state of their definitions
+  std::vector<std::pair<symbol, int>> previous_bindings;
+  std::unordered_map<int, definition> changed;
+  std::vector<int> converted;
+  for (auto &&form : *forms) {
+    int id = cc.symtab[form.name];
+    if (id < cc.symtab.get_first_global_id()) {
+      previous_bindings.emplace_back(form.name, id);
+      id = cc.symtab.register_global(form.name);
+    }
+    const definition *const old = find(id);
+    // Including a module again repeats declarations which did not change
+    if (old && !form.value && old->decl.type_value &&
+        equal(*form.type_value, *old->decl.type_value))
+      continue;
+    definition staged;
+    staged.decl = form;
+    staged.decl.id = id;
+    if (old) {
+      if (!staged.decl.type_value)
+        staged.decl.type_value = old->decl.type_value;
+      if (!staged.decl.value) {
+        staged.decl.value = old->decl.value;
+        staged.references = old->references;
+      }
+    }
+    changed[id] = std::move(staged);
+    if (form.value)
+      converted.push_back(id);
+  }
+  const auto reject = [&] {
+    for (auto &&[name, id] : previous_bindings)
+      cc.symtab.restore_binding(name, id);
+    return std::nullopt;
+  };
+  const int first_converted_id = cc.symtab.get_next_id();
+  for (const int id : converted) {
+    definition &def = changed[id];
+    if (!alpha_convert(def.decl, cc))
+      return reject();
+    collect_references(*def.decl.value, cc.symtab, def.references);
+    std::sort(std::begin(def.references), std::end(def.references));
+    def.references.erase(
+        std::unique(std::begin(def.references), std::end(def.references)),
+        std::end(def.references));
+  }
+
+  if (std::empty(changed))
+    return std::vector<symbol>{};
+  const std::vector<int> affected = collect_affected(changed);
+  const auto staged_decl = [&](int id) -> toplevel_expr & {
+    const auto iter = changed.find(id);
+    return iter != std::end(changed)
+               ? iter->second.decl
+               : definitions[id - cc.symtab.get_first_global_id()].decl;
+  };
+  // Number the locals of the dependents again, so the ids used by the code
+  // generated below stay close together
+  for (const int id : affected) {
+    toplevel_expr &decl = staged_decl(id);
+    if (decl.value && decl.first_local_id < first_converted_id)
+      alpha_convert(decl, cc);
+  }
+  std::vector<std::pair<int, type *>> previous_types;
+  for (const int id : affected) {
+    if (find(id))
+      previous_types.emplace_back(id, checker.get_type_for_id(id));
+    checker.register_toplevel(staged_decl(id));
+  }
+  for (const int id : affected) {
+    if (!checker.check_toplevel(staged_decl(id), cc.stbl)) {
+      for (auto &&[id, type] : previous_types)
+        checker.register_type(id, type);
+      return reject();
+    }
+  }
+
+  const std::size_t needed =
+      affected.back() - cc.symtab.get_first_global_id() + 1;
+  if (std::size(definitions) < needed)
+    definitions.resize(needed);
+  for (auto &&[id, def] : changed) {
+    definition &slot = definitions[id - cc.symtab.get_first_global_id()];
+    slot.decl = def.decl;
+    slot.references = std::move(def.references);
+  }
+  std::vector<symbol> checked;
+  for (const int id : affected) {
+    definition &def = definitions[id - cc.symtab.get_first_global_id()];
+    if (!def.decl.value)
+      continue;
+    std::vector<toplevel_expr> single{def.decl};
+    def.code = genanf(single, cc);
+    checked.push_back(def.decl.name);
+  }
+  return checked;
+}
+
+anf_context session::code_for(const std::vector<symbol> &names) const {
+  anf_context result;
+  result.stbl = &cc.stbl;
+  result.first_id = cc.symtab.get_next_id();
+  for (const symbol name : names) {
+    const definition *const def = find(cc.symtab[name]);
+    if (!def || !def->code)
+      continue;
+    result.first_id = std::min(result.first_id, def->code->first_id);
+    append_anf(result, *def->code);
+  }
+  return result;
+}
+
+} // namespace lyn
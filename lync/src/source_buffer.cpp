@@ -0,0 +1,114 @@
+#include "source_buffer.h"
+
+#include <cstring>
+#include <utility>
+
+#if __has_include(<sys/mman.h>) && __has_include(<sys/stat.h>)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define LYN_HAVE_MMAP 1
+#else
+#define LYN_HAVE_MMAP 0
+#endif
+
+namespace lyn {
+
+namespace {
+
+constexpr std::size_t read_block_size = 64u * 1024u;
+
+} // namespace
+
+source_buffer::source_buffer(source_buffer &&other) noexcept
+    : m_data{std::exchange(other.m_data, "")},
+      m_size{std::exchange(other.m_size, 0u)},
+      m_mapped{std::exchange(other.m_mapped, false)},
+      m_storage{std::move(other.m_storage)} {}
+
+source_buffer &source_buffer::operator=(source_buffer &&other) noexcept {
+  if (this != &other) {
+    reset();
+    m_data = std::exchange(other.m_data, "");
+    m_size = std::exchange(other.m_size, 0u);
+    m_mapped = std::exchange(other.m_mapped, false);
+    m_storage = std::move(other.m_storage);
+  }
+  return *this;
+}
+
+source_buffer::~source_buffer() { reset(); }
+
+void source_buffer::reset() {
+#if LYN_HAVE_MMAP
+  if (m_mapped)
+    munmap(const_cast<char *>(m_data), m_size);
+#endif
+  m_data = "";
+  m_size = 0u;
+  m_mapped = false;
+  m_storage.reset();
+}
+
+std::optional<source_buffer> source_buffer::open(const char *path) {
+  FILE *const file = std::fopen(path, "rb");
+  if (!file)
+    return std::nullopt;
+  auto result = read(file);
+  std::fclose(file);
+  return result;
+}
+
+std::optional<source_buffer> source_buffer::read(FILE *file) {
+  source_buffer result;
+#if LYN_HAVE_MMAP
+  // Only map files we are reading from the beginning, otherwise we would
+  // have to deal with page alignment of the offset.
+  struct stat info;
+  if (fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode) &&
+      std::ftell(file) == 0) {
+    if (info.st_size == 0)
+      return result;
+    void *const mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE,
+                               fileno(file), 0);
+    if (mapping != MAP_FAILED) {
+      result.m_data = static_cast<const char *>(mapping);
+      result.m_size = info.st_size;
+      result.m_mapped = true;
+      return result;
+    }
+  }
+#endif
+  std::size_t capacity = 0u;
+  for (;;) {
+    if (result.m_size == capacity) {
+      capacity = capacity ? capacity * 2 : read_block_size;
+      std::unique_ptr<char[]> grown{new char[capacity]};
+      if (result.m_size)
+        std::memcpy(grown.get(), result.m_storage.get(), result.m_size);
+      result.m_storage = std::move(grown);
+    }
+    const std::size_t read_bytes =
+        std::fread(result.m_storage.get() + result.m_size, 1u,
+                   capacity - result.m_size, file);
+    result.m_size += read_bytes;
+    if (read_bytes == 0u)
+      break;
+  }
+  if (std::ferror(file))
+    return std::nullopt;
+  result.m_data = result.m_storage ? result.m_storage.get() : "";
+  return result;
+}
+
+source_buffer source_buffer::copy(std::string_view text) {
+  source_buffer result;
+  if (std::empty(text))
+    return result;
+  result.m_storage.reset(new char[std::size(text)]);
+  std::memcpy(result.m_storage.get(), std::data(text), std::size(text));
+  result.m_data = result.m_storage.get();
+  result.m_size = std::size(text);
+  return result;
+}
+
+} // namespace lyn
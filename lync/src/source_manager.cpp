@@ -0,0 +1,36 @@
+#include "source_manager.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <iterator>
+#include <utility>
+
+namespace lyn {
+
+std::uint32_t source_manager::add(source_buffer buffer,
+                                  std::string_view file_name) {
+  files.push_back(file{std::move(buffer), std::string{file_name}});
+  return static_cast<std::uint32_t>(std::size(files) - 1);
+}
+
+source_position source_manager::position(source_location sloc) const {
+  assert(sloc.file < std::size(files));
+  const file &f = files[sloc.file];
+  if (std::empty(f.line_starts)) {
+    f.line_starts.push_back(0u);
+    const char *const begin = f.buffer.begin();
+    const char *const end = f.buffer.end();
+    for (const char *cur = begin;
+         (cur = static_cast<const char *>(std::memchr(cur, '\n', end - cur)));
+         ++cur)
+      f.line_starts.push_back(static_cast<std::uint32_t>(cur + 1 - begin));
+  }
+  const auto line_end = std::upper_bound(std::begin(f.line_starts),
+                                         std::end(f.line_starts), sloc.offset);
+  const auto line = line_end - std::begin(f.line_starts);
+  return {f.name, static_cast<int>(line),
+          static_cast<int>(sloc.offset - *(line_end - 1)) + 1};
+}
+
+} // namespace lyn
@@ -0,0 +1,76 @@
+#include "string_table.h"
+
+namespace lyn {
+
+namespace {
+
+constexpr std::size_t initial_slot_count = 256u;
+
+} // namespace
+
+std::size_t string_table::hash_string(std::string_view str) {
+  // FNV-1a
+  std::uint64_t hash = 14695981039346656037ull;
+  for (const char c : str) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ull;
+  }
+  return static_cast<std::size_t>(hash);
+}
+
+std::size_t string_table::find_slot(std::string_view target,
+                                    std::size_t hash) const {
+  const std::size_t mask = std::size(slots) - 1;
+  std::size_t idx = hash & mask;
+  while (slots[idx]) {
+    const entry &e = strings[slots[idx] - 1];
+    if (e.hash == hash && e.str == target)
+      break;
+    idx = (idx + 1) & mask;
+  }
+  return idx;
+}
+
+void string_table::grow() {
+  std::vector<std::uint32_t> old_slots = std::move(slots);
+  slots.assign(std::empty(old_slots) ? initial_slot_count
+                                     : std::size(old_slots) * 2,
+               0u);
+  const std::size_t mask = std::size(slots) - 1;
+  for (const std::uint32_t handle : old_slots) {
+    if (!handle)
+      continue;
+    std::size_t idx = strings[handle - 1].hash & mask;
+    while (slots[idx])
+      idx = (idx + 1) & mask;
+    slots[idx] = handle;
+  }
+}
+
+symbol string_table::intern(std::string_view target) {
+  // Keep the load factor at or below one half
+  if ((std::size(strings) + 1) * 2 > std::size(slots))
+    grow();
+  const std::size_t hash = hash_string(target);
+  const std::size_t idx = find_slot(target, hash);
+  if (slots[idx])
+    return symbol{slots[idx] - 1};
+  const std::string_view copy(
+      static_cast<char *>(std::memcpy(alloc.allocate(std::size(target), 1u),
+                                      target.data(), std::size(target))),
+      std::size(target));
+  strings.push_back(entry{copy, hash});
+  slots[idx] = static_cast<std::uint32_t>(std::size(strings));
+  return symbol{slots[idx] - 1};
+}
+
+std::optional<symbol> string_table::find(std::string_view target) const {
+  if (std::empty(slots))
+    return std::nullopt;
+  const std::size_t idx = find_slot(target, hash_string(target));
+  if (!slots[idx])
+    return std::nullopt;
+  return symbol{slots[idx] - 1};
+}
+
+} // namespace lyn
@@ -0,0 +1,164 @@
+#include "anf.h"
+#include "anf_passes.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace lyn {
+
+namespace {
+
+// Turns tail calls of a definition to itself into a loop: The receive of the
+// parameters gets a block of its own, the rest of the definition starts at
+// the loop header following it. Self tail calls assign their arguments to
+// the parameters and jump back to the header, so no frame is set up again.
+class tail_loop_builder {
+public:
+  tail_loop_builder(anf_context &ctx, int next_id)
+      : ctx{ctx}, next_id{next_id} {}
+
+  int run();
+
+private:
+  bool is_self_tail_call(const anf_def &def, const anf_expr &instr) const {
+    const auto *const call = std::get_if<anf_call>(&instr);
+    return call && call->is_tail && !call->target && call->name == def.name;
+  }
+  bool has_self_tail_call(const anf_def &def) const;
+  void rewrite(anf_def &def);
+  void emit_block(span<const anf_expr> instrs, const anf_def &def);
+  void emit_assignments(const anf_call &call);
+
+  anf_context &ctx;
+  int next_id;
+  span<const int> params;
+  // Parameters still to be assigned, paired with the values assigned
+  std::vector<std::pair<int, int>> pending;
+
+  std::vector<basic_block> new_blocks;
+  std::vector<anf_expr> new_instrs;
+};
+
+bool tail_loop_builder::has_self_tail_call(const anf_def &def) const {
+  const auto blocks = ctx.blocks_of(def);
+  if (std::empty(blocks))
+    return false;
+  const auto entry = ctx.instrs_of(blocks[0]);
+  if (std::empty(entry) || !std::holds_alternative<anf_receive>(entry[0]))
+    return false;
+  for (auto &&block : blocks)
+    for (auto &&instr : ctx.instrs_of(block))
+      if (is_self_tail_call(def, instr))
+        return true;
+  return false;
+}
+
+// Blocks move up by one, as the receive of the parameters is split off the
+// first block
+void tail_loop_builder::emit_block(span<const anf_expr> instrs,
+                                   const anf_def &def) {
+  const auto first = static_cast<std::uint32_t>(std::size(new_instrs));
+  for (auto &&instr : instrs) {
+    if (is_self_tail_call(def, instr)) {
+      emit_assignments(std::get<anf_call>(instr));
+      new_instrs.emplace_back(anf_jump{1});
+      continue;
+    }
+    if (const auto *const cond = std::get_if<anf_cond>(&instr))
+      new_instrs.emplace_back(
+          anf_cond{cond->cond_id, cond->then_block + 1, cond->else_block + 1});
+    else if (const auto *const jump = std::get_if<anf_jump>(&instr))
+      new_instrs.emplace_back(anf_jump{jump->target + 1});
+    else
+      new_instrs.push_back(instr);
+  }
+  new_blocks.push_back(basic_block{
+      first, static_cast<std::uint32_t>(std::size(new_instrs)) - first});
+}
+
+// Assigns the arguments to the parameters as if all at once. A parameter is
+// only assigned once no other argument still needs its old value, cycles
+// are broken by copying one of the parameters first.
+void tail_loop_builder::emit_assignments(const anf_call &call) {
+  const auto args = ctx.operands_of(call.args);
+  pending.clear();
+  for (std::size_t i = 0; i != std::size(params); ++i)
+    if (args[i] != params[i])
+      pending.emplace_back(params[i], args[i]);
+  while (!std::empty(pending)) {
+    const auto is_read = [this](int id) {
+      return std::any_of(std::begin(pending), std::end(pending),
+                         [id](auto &&assignment) {
+                           return assignment.second == id;
+                         });
+    };
+    auto ready = std::find_if(
+        std::begin(pending), std::end(pending),
+        [&](auto &&assignment) { return !is_read(assignment.first); });
+    if (ready == std::end(pending)) {
+      ready = std::begin(pending);
+      const int copy = next_id++;
+      new_instrs.emplace_back(anf_assoc{ready->first, copy});
+      for (auto &&assignment : pending)
+        if (assignment.second == ready->first)
+          assignment.second = copy;
+    }
+    new_instrs.emplace_back(anf_assoc{ready->second, ready->first});
+    pending.erase(ready);
+  }
+}
+
+void tail_loop_builder::rewrite(anf_def &def) {
+  const auto blocks = ctx.blocks_of(def);
+  const auto entry = ctx.instrs_of(blocks[0]);
+  params = ctx.operands_of(std::get<anf_receive>(entry[0]).args);
+  const auto first_block = static_cast<std::uint32_t>(std::size(new_blocks));
+  const auto first = static_cast<std::uint32_t>(std::size(new_instrs));
+  new_instrs.push_back(entry[0]);
+  new_instrs.emplace_back(anf_jump{1});
+  new_blocks.push_back(basic_block{first, 2});
+  emit_block({std::data(entry) + 1, std::size(entry) - 1}, def);
+  for (std::size_t block = 1; block != std::size(blocks); ++block)
+    emit_block(std::as_const(ctx).instrs_of(blocks[block]), def);
+  def.first_block = first_block;
+  def.block_count = static_cast<std::uint32_t>(std::size(new_blocks)) -
+                    first_block;
+}
+
+int tail_loop_builder::run() {
+  if (std::none_of(
+          std::begin(ctx.defs), std::end(ctx.defs),
+          [this](const anf_def &def) { return has_self_tail_call(def); }))
+    return next_id;
+  new_blocks.reserve(std::size(ctx.blocks) + std::size(ctx.defs));
+  new_instrs.reserve(std::size(ctx.instrs) + std::size(ctx.defs));
+  for (auto &&def : ctx.defs) {
+    if (has_self_tail_call(def)) {
+      rewrite(def);
+      continue;
+    }
+    const auto blocks = ctx.blocks_of(def);
+    def.first_block = static_cast<std::uint32_t>(std::size(new_blocks));
+    for (auto &&block : blocks) {
+      const auto first = static_cast<std::uint32_t>(std::size(new_instrs));
+      const auto instrs = ctx.instrs_of(block);
+      new_instrs.insert(std::end(new_instrs), std::begin(instrs),
+                        std::end(instrs));
+      new_blocks.push_back(basic_block{first, block.size});
+    }
+  }
+  ctx.blocks = std::move(new_blocks);
+  ctx.instrs = std::move(new_instrs);
+  return next_id;
+}
+
+} // namespace
+
+int loop_self_tail_calls(anf_context &ctx, int next_id) {
+  return tail_loop_builder{ctx, next_id}.run();
+}
+
+} // namespace lyn
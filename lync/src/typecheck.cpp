@@ -1,261 +1,355 @@
 #include "expr.h"
+#include "name_resolver.h"
 #include "passes.h"
 #include "primitives.h"
 #include "symbol_table.h"
+#include "typecheck.h"
 #include "types.h"
 
 #include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <stdexcept>
 #include <type_traits>
-#include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace lyn {
 
 namespace {
 
-void print_type(type *lhs);
-void print_type(int_type) { fputs("int", stderr); }
-void print_type(bool_type) { fputs("bool", stderr); }
-void print_type(unit_type) { fputs("unit", stderr); }
-void print_type(const function_type &type) {
+// Resolver for definitions that went through alpha_convert already
+struct resolved_names {
+  bool resolve(variable_expr &, const source_location &) { return true; }
+  int push_scope() const { return 0; }
+  void bind(symbol, int &) {}
+  void pop_scope(int) {}
+};
 
-  fputs("(-> ", stderr);
-  for (auto &&param : type.params) {
-    print_type(param);
-    fputc(' ', stderr);
+// Returns the representative of t, pointing all type variables on the way
+// directly to it
+type *find(type *t) {
+  type *root = t;
+  for (;;) {
+    const auto *const var = std::get_if<type_variable>(&root->content);
+    if (!var || !var->target)
+      break;
+    root = var->target;
   }
-  print_type(type.result);
-  fputc(')', stderr);
+  while (t != root)
+    t = std::exchange(std::get<type_variable>(t->content).target, root);
+  return root;
 }
-void print_type(const type_variable &var) {
-  if (!var.target) {
-    fputs("[ ]", stderr);
-  } else {
-    print_type(var.target);
+
+void print_type(type *lhs, FILE *out);
+void print_type(int_type, FILE *out) { fputs("int", out); }
+void print_type(bool_type, FILE *out) { fputs("bool", out); }
+void print_type(unit_type, FILE *out) { fputs("unit", out); }
+void print_type(const function_type &type, FILE *out) {
+
+  fputs("(-> ", out);
+  for (auto &&param : type.params) {
+    print_type(param, out);
+    fputc(' ', out);
   }
+  print_type(type.result, out);
+  fputc(')', out);
 }
-void print_type(type *lhs) {
-  std::visit([](auto &&expr) { print_type(expr); }, lhs->content);
+void print_type(const type_variable &, FILE *out) { fputs("[ ]", out); }
+void print_type(type *lhs, FILE *out) {
+  std::visit([out](auto &&expr) { print_type(expr, out); },
+             find(lhs)->content);
 }
 
-bool unify(type *lhs, type *rhs) {
+bool is_ground(type *t) {
   return std::visit(
-      [=](auto &&lhs_val, auto &&rhs_val) {
-        using lhs_t = std::decay_t<decltype(lhs_val)>;
-        using rhs_t = std::decay_t<decltype(rhs_val)>;
-        if constexpr (std::is_same_v<lhs_t, type_variable>) {
-          if (!lhs_val.target) {
-            lhs_val.target = rhs;
-            return true;
-          }
-          return unify(lhs_val.target, rhs);
-        }
-        if (std::is_same_v<rhs_t, type_variable>) {
-          return unify(rhs, lhs);
-        }
-        constexpr bool types_match = std::is_same_v<lhs_t, rhs_t>;
-        if (!types_match) {
-          return false;
-        }
-        if (std::is_same_v<lhs_t, int_type> ||
-            std::is_same_v<lhs_t, bool_type> ||
-            std::is_same_v<lhs_t, unit_type>) {
-          return true;
-        }
-        if constexpr (types_match && std::is_same_v<lhs_t, function_type>) {
-          return std::equal(std::begin(lhs_val.params),
-                            std::end(lhs_val.params),
-                            std::begin(rhs_val.params),
-                            std::end(rhs_val.params), unify) &&
-                 unify(lhs_val.result, rhs_val.result);
-        }
+      [](auto &&val) {
+        using val_t = std::decay_t<decltype(val)>;
+        if constexpr (std::is_same_v<val_t, function_type>)
+          return val.ground;
+        return !std::is_same_v<val_t, type_variable>;
       },
-      lhs->content, rhs->content);
+      t->content);
 }
 
-class typecheck_t {
-public:
-  explicit typecheck_t(std::pmr::monotonic_buffer_resource &alloc)
-      : alloc{alloc} {
-    int_t = new (alloc_type()) type{int_type{}};
-    bool_t = new (alloc_type()) type{bool_type{}};
-    unit_t = new (alloc_type()) type{unit_type{}};
+// Checks whether the unbound type variable var occurs in t
+bool occurs(const type *var, type *t) {
+  std::vector<type *> pending{t};
+  while (!std::empty(pending)) {
+    type *const current = find(pending.back());
+    pending.pop_back();
+    if (current == var)
+      return true;
+    const auto *const func = std::get_if<function_type>(&current->content);
+    if (!func)
+      continue;
+    pending.insert(std::end(pending), std::begin(func->params),
+                   std::end(func->params));
+    pending.push_back(func->result);
   }
+  return false;
+}
 
-  type *visit(expr &target);
-
-  void setup_primitive_types(const symbol_table &stable);
-  void register_typevar(int id) {
-    id_to_type[id] = new (alloc_type()) type{type_variable{}};
+bool unify(type *lhs, type *rhs) {
+  // Pairs are taken from the back, so parameters are unified from left to
+  // right before the result, just like a recursive descent would
+  std::vector<std::pair<type *, type *>> pending{{lhs, rhs}};
+  while (!std::empty(pending)) {
+    type *lhs_root = find(pending.back().first);
+    type *rhs_root = find(pending.back().second);
+    pending.pop_back();
+    if (lhs_root == rhs_root)
+      continue;
+    // Distinct ground types are never structurally equal
+    if (is_ground(lhs_root) && is_ground(rhs_root))
+      return false;
+    auto *lhs_var = std::get_if<type_variable>(&lhs_root->content);
+    auto *rhs_var = std::get_if<type_variable>(&rhs_root->content);
+    if (lhs_var && rhs_var) {
+      if (lhs_var->rank < rhs_var->rank) {
+        lhs_var->target = rhs_root;
+      } else {
+        rhs_var->target = lhs_root;
+        if (lhs_var->rank == rhs_var->rank)
+          ++lhs_var->rank;
+      }
+      continue;
+    }
+    if (rhs_var) {
+      std::swap(lhs_root, rhs_root);
+      std::swap(lhs_var, rhs_var);
+    }
+    if (lhs_var) {
+      if (occurs(lhs_root, rhs_root))
+        return false;
+      lhs_var->target = rhs_root;
+      continue;
+    }
+    if (lhs_root->content.index() != rhs_root->content.index())
+      return false;
+    const auto *const lhs_func =
+        std::get_if<function_type>(&lhs_root->content);
+    if (!lhs_func)
+      continue;
+    const auto &rhs_func = std::get<function_type>(rhs_root->content);
+    if (std::size(lhs_func->params) != std::size(rhs_func.params))
+      return false;
+    pending.emplace_back(lhs_func->result, rhs_func.result);
+    for (std::size_t i = std::size(lhs_func->params); i-- > 0;)
+      pending.emplace_back(lhs_func->params[i], rhs_func.params[i]);
   }
-  void register_type(int id, type *t) { id_to_type[id] = t; }
+  return true;
+}
 
-  type *get_type_for_id(int id) { return id_to_type.at(id); }
+} // namespace
 
-  type *import_type_expr(const type_expr &expr) {
-    return std::visit(
-        [this](auto &&type_expr) {
-          using type_expr_t = std::decay_t<decltype(type_expr)>;
-          if (std::is_same_v<type_expr_t, int_type_expr>)
-            return int_t;
-          if (std::is_same_v<type_expr_t, bool_type_expr>)
-            return bool_t;
-          if (std::is_same_v<type_expr_t, unit_type_expr>)
-            return unit_t;
-          if constexpr (std::is_same_v<type_expr_t, func_type_expr>) {
-            assert(!std::empty(type_expr.types));
-            std::vector<type *> args;
-            std::transform(
-                std::begin(type_expr.types), std::end(type_expr.types) - 1,
-                std::back_inserter(args),
-                [this](auto &&expr) { return import_type_expr(*expr); });
-            return new (alloc_type())
-                type{function_type{spanify(alloc, args),
-                                   import_type_expr(*type_expr.types.back())}};
-          }
-          unreachable();
-        },
-        expr.content);
-  }
+typecheck_t::typecheck_t(std::pmr::monotonic_buffer_resource &alloc, FILE *diag,
+                         const source_manager &sources, int first_local_id)
+    : alloc{alloc}, diag{diag}, sources{sources},
+      first_local_id{first_local_id} {
+  int_t = new (alloc_type()) type{int_type{}};
+  bool_t = new (alloc_type()) type{bool_type{}};
+  unit_t = new (alloc_type()) type{unit_type{}};
+}
 
-private:
-  void *alloc_type() { return alloc.allocate(sizeof(type), alignof(type)); }
+type *typecheck_t::import_type_expr(const type_expr &expr) {
+  return std::visit(
+      [this](auto &&type_expr) {
+        using type_expr_t = std::decay_t<decltype(type_expr)>;
+        if (std::is_same_v<type_expr_t, int_type_expr>)
+          return int_t;
+        if (std::is_same_v<type_expr_t, bool_type_expr>)
+          return bool_t;
+        if (std::is_same_v<type_expr_t, unit_type_expr>)
+          return unit_t;
+        if constexpr (std::is_same_v<type_expr_t, func_type_expr>) {
+          assert(!std::empty(type_expr.types));
+          std::vector<type *> args;
+          std::transform(
+              std::begin(type_expr.types), std::end(type_expr.types) - 1,
+              std::back_inserter(args),
+              [this](auto &&expr) { return import_type_expr(*expr); });
+          return make_function_type(args,
+                                    import_type_expr(*type_expr.types.back()));
+        }
+        unreachable();
+      },
+      expr.content);
+}
 
-  std::pmr::monotonic_buffer_resource &alloc;
-  std::unordered_map<int, type *> id_to_type;
-  type *int_t;
-  type *bool_t;
-  type *unit_t;
-};
+type *typecheck_t::make_function_type(std::vector<type *> &params,
+                                      type *result) {
+  result = find(result);
+  bool ground = is_ground(result);
+  std::size_t hash = reinterpret_cast<std::uintptr_t>(result);
+  for (auto &&param : params) {
+    param = find(param);
+    ground = ground && is_ground(param);
+    hash = hash * 31u + reinterpret_cast<std::uintptr_t>(param);
+  }
+  if (!ground)
+    return new (alloc_type())
+        type{function_type{spanify(alloc, params), result}};
+  const auto [begin, end] = function_types.equal_range(hash);
+  for (auto iter = begin; iter != end; ++iter) {
+    const auto &candidate = std::get<function_type>(iter->second->content);
+    if (candidate.result == result &&
+        std::equal(std::begin(candidate.params), std::end(candidate.params),
+                   std::begin(params), std::end(params)))
+      return iter->second;
+  }
+  type *const interned = new (alloc_type())
+      type{function_type{spanify(alloc, params), result, true}};
+  function_types.emplace(hash, interned);
+  return interned;
+}
 
 type *typecheck_t::visit(expr &target) {
-  const auto typecheck_value = [this, &target](auto &&expr) -> type * {
+  resolved_names names;
+  return infer(target, names);
+}
+
+template <class Resolver>
+type *typecheck_t::infer(expr &target, Resolver &names) {
+  const auto typecheck_value = [&](auto &&expr) -> type * {
     using expr_t = std::decay_t<decltype(expr)>;
     if constexpr (std::is_same_v<expr_t, constant_expr>) {
       return int_t;
     }
     if constexpr (std::is_same_v<expr_t, variable_expr>) {
-      return id_to_type.at(expr.id);
+      if (!names.resolve(expr, target.sloc))
+        return nullptr;
+      return get_type_for_id(expr.id);
     }
     if constexpr (std::is_same_v<expr_t, apply_expr>) {
-      auto *const ftype = visit(*expr.func);
+      auto *const ftype = infer(*expr.func, names);
       if (!ftype)
         return nullptr;
-      function_type ft;
       std::vector<type *> params;
       for (auto &&arg : expr.args) {
-        const auto arg_t = visit(*arg);
+        const auto arg_t = infer(*arg, names);
         if (!arg_t)
           return nullptr;
         params.push_back(arg_t);
       }
-      ft.params = spanify(alloc, params);
+      // Calls of known functions unify the arguments directly, the applied
+      // function type is only built for unknown functions and diagnostics
+      const auto *const known =
+          std::get_if<function_type>(&find(ftype)->content);
+      if (known && std::size(known->params) == std::size(params) &&
+          std::equal(std::begin(params), std::end(params),
+                     std::begin(known->params), unify))
+        return known->result;
       type *const result = new (alloc_type()) type{type_variable{}};
-      ft.result = result;
-      if (auto *const applied_type = new (alloc_type()) type{std::move(ft)};
-          !unify(applied_type, ftype)) {
-        fprintf(stderr, "%.*s:%d:%d: error: applying function of type ",
-                static_cast<int>(std::size(target.sloc.file_name)),
-                std::data(target.sloc.file_name), target.sloc.line,
-                target.sloc.col);
-        print_type(ftype);
-        fputs(" where ", stderr);
-        print_type(applied_type);
-        fputs(" is expected\n", stderr);
+      if (auto *const applied_type = new (alloc_type())
+              type{function_type{spanify(alloc, params), result}};
+          known || !unify(applied_type, ftype)) {
+        const source_position pos = sources.position(target.sloc);
+        fprintf(diag, "%.*s:%d:%d: error: applying function of type ",
+                static_cast<int>(std::size(pos.file_name)),
+                std::data(pos.file_name), pos.line, pos.col);
+        print_type(ftype, diag);
+        fputs(" where ", diag);
+        print_type(applied_type, diag);
+        fputs(" is expected\n", diag);
         return nullptr;
       }
       return result;
     }
     if constexpr (std::is_same_v<expr_t, lambda_expr>) {
       std::vector<type *> args;
+      const auto current_scope = names.push_scope();
       for (auto &&param : expr.params) {
+        names.bind(param.name, param.id);
         type *const arg = new (alloc_type()) type{type_variable{}};
-        id_to_type[param.id] = arg;
+        type_for_id(param.id) = arg;
         args.push_back(arg);
       }
-      auto *const ret = visit(*expr.body);
+      auto *const ret = infer(*expr.body, names);
+      names.pop_scope(current_scope);
       if (!ret)
         return nullptr;
-      return new (alloc_type()) type{function_type{spanify(alloc, args), ret}};
+      return make_function_type(args, ret);
     }
     if constexpr (std::is_same_v<expr_t, let_expr>) {
+      std::vector<type *> binding_types;
       for (auto &&binding : expr.bindings) {
-        id_to_type[binding.id] = visit(*binding.body);
+        type *const binding_type = infer(*binding.body, names);
+        if (!binding_type)
+          return nullptr;
+        binding_types.push_back(binding_type);
       }
-      if (std::empty(expr.body)) {
-        return unit_t;
+      const auto current_scope = names.push_scope();
+      for (std::size_t i = 0; i < std::size(expr.bindings); ++i) {
+        names.bind(expr.bindings[i].name, expr.bindings[i].id);
+        type_for_id(expr.bindings[i].id) = binding_types[i];
       }
-      if (!std::all_of(
-              std::begin(expr.body), std::end(expr.body) - 1,
-              [this](lyn::expr *ptr) { return visit(*ptr) != nullptr; }))
-        return nullptr;
-      return visit(*expr.body.back());
+      type *result = unit_t;
+      for (lyn::expr *body : expr.body)
+        if (!(result = infer(*body, names)))
+          break;
+      names.pop_scope(current_scope);
+      return result;
     }
     if constexpr (std::is_same_v<expr_t, if_expr>) {
-      auto *const cond_t = visit(*expr.cond);
+      auto *const cond_t = infer(*expr.cond, names);
       if (!cond_t)
         return nullptr;
       if (!unify(bool_t, cond_t)) {
-        fprintf(stderr, "%.*s:%d:%d: error: Using expression of type ",
-                static_cast<int>(std::size(target.sloc.file_name)),
-                std::data(target.sloc.file_name), target.sloc.line,
-                target.sloc.col);
-        print_type(cond_t);
-        fputs(" in if condition\n", stderr);
+        const source_position pos = sources.position(target.sloc);
+        fprintf(diag, "%.*s:%d:%d: error: Using expression of type ",
+                static_cast<int>(std::size(pos.file_name)),
+                std::data(pos.file_name), pos.line, pos.col);
+        print_type(cond_t, diag);
+        fputs(" in if condition\n", diag);
         return nullptr;
       }
-      auto *const then_t = visit(*expr.then);
+      auto *const then_t = infer(*expr.then(), names);
       if (!then_t)
         return nullptr;
-      auto *const else_t = visit(*expr.els);
+      auto *const else_t = infer(*expr.els(), names);
       if (!else_t)
         return nullptr;
       if (!unify(then_t, else_t)) {
-        fprintf(stderr, "%.*s:%d:%d: error: if branches do not unify\n",
-                static_cast<int>(std::size(target.sloc.file_name)),
-                std::data(target.sloc.file_name), target.sloc.line,
-                target.sloc.col);
-        fprintf(stderr, "%.*s:%d:%d: info: then branch of type ",
-                static_cast<int>(std::size(expr.then->sloc.file_name)),
-                std::data(expr.then->sloc.file_name), expr.then->sloc.line,
-                expr.then->sloc.col);
-        print_type(then_t);
-        fputc('\n', stderr);
-        fprintf(stderr, "%.*s:%d:%d: info: else branch of type ",
-                static_cast<int>(std::size(expr.els->sloc.file_name)),
-                std::data(expr.els->sloc.file_name), expr.els->sloc.line,
-                expr.els->sloc.col);
-        print_type(else_t);
-        fputc('\n', stderr);
+        const source_position pos = sources.position(target.sloc);
+        fprintf(diag, "%.*s:%d:%d: error: if branches do not unify\n",
+                static_cast<int>(std::size(pos.file_name)),
+                std::data(pos.file_name), pos.line, pos.col);
+        const source_position then_pos = sources.position(expr.then()->sloc);
+        fprintf(diag, "%.*s:%d:%d: info: then branch of type ",
+                static_cast<int>(std::size(then_pos.file_name)),
+                std::data(then_pos.file_name), then_pos.line, then_pos.col);
+        print_type(then_t, diag);
+        fputc('\n', diag);
+        const source_position else_pos = sources.position(expr.els()->sloc);
+        fprintf(diag, "%.*s:%d:%d: info: else branch of type ",
+                static_cast<int>(std::size(else_pos.file_name)),
+                std::data(else_pos.file_name), else_pos.line, else_pos.col);
+        print_type(else_t, diag);
+        fputc('\n', diag);
         return nullptr;
       }
       return then_t;
     }
   };
-  return target.type = std::visit(typecheck_value, target.content);
+  return std::visit(typecheck_value, target.content);
 }
 
-void typecheck_t::setup_primitive_types(const symbol_table &symtab) {
-  // TODO: Is there really no way to create a std::initializer list for a
-  // function template call but to bind the brace init list to an auto variable?
-  auto bi_int_args = {int_t, int_t};
-  type *bi_int = new (alloc_type())
-      type{function_type{spanify(alloc, bi_int_args), int_t}};
-  auto uni_int_args = {int_t};
-  type *uni_int = new (alloc_type())
-      type{function_type{spanify(alloc, uni_int_args), int_t}};
-  type *comp_int = new (alloc_type())
-      type{function_type{spanify(alloc, bi_int_args), bool_t}};
-  auto bi_bool_args = {bool_t, bool_t};
-  type *bi_bool = new (alloc_type())
-      type{function_type{spanify(alloc, bi_bool_args), bool_t}};
-  auto uni_bool_args = {bool_t};
-  type *uni_bool = new (alloc_type())
-      type{function_type{spanify(alloc, uni_bool_args), bool_t}};
+void typecheck_t::setup_primitive_types(const symbol_table &symtab,
+                                        const string_table &stbl) {
+  std::vector<type *> bi_int_args{int_t, int_t};
+  type *bi_int = make_function_type(bi_int_args, int_t);
+  type *comp_int = make_function_type(bi_int_args, bool_t);
+  std::vector<type *> uni_int_args{int_t};
+  type *uni_int = make_function_type(uni_int_args, int_t);
+  std::vector<type *> bi_bool_args{bool_t, bool_t};
+  type *bi_bool = make_function_type(bi_bool_args, bool_t);
+  std::vector<type *> uni_bool_args{bool_t};
+  type *uni_bool = make_function_type(uni_bool_args, bool_t);
 
   for (auto &&primitive : primitives) {
-    id_to_type[symtab[primitive.name]] = [&] {
+    type_for_id(symtab[*stbl.find(primitive.name)]) = [&] {
       switch (primitive.type) {
       case primitive_type::int_int_int:
         return bi_int;
@@ -277,43 +371,79 @@ void typecheck_t::setup_primitive_types(const symbol_table &symtab) {
   }
 }
 
-} // namespace
+void typecheck_t::register_toplevel(const toplevel_expr &expr) {
+  if (expr.type_value)
+    register_type(expr.id, import_type_expr(*expr.type_value));
+  else
+    register_typevar(expr.id);
+}
 
-bool typecheck(std::vector<toplevel_expr> &exprs, const symbol_table &symtab,
-               std::pmr::monotonic_buffer_resource &alloc) {
-  typecheck_t functor{alloc};
-  functor.setup_primitive_types(symtab);
-  for (auto &expr : exprs) {
-    if (expr.type_value)
-      functor.register_type(expr.id,
-                            functor.import_type_expr(*expr.type_value));
-    else
-      functor.register_typevar(expr.id);
-  }
-  for (auto &&expr : exprs) {
-    if (!expr.value)
-      continue;
-    type *const expr_type = functor.visit(*expr.value);
-    if (!expr_type)
-      return false;
-    type *const decl_type = functor.get_type_for_id(expr.id);
-    if (!unify(expr_type, decl_type)) {
-      fprintf(stderr,
-              "%.*s:%d:%d: error: Function definition \"%.*s\" is of "
-              "unexpected type:\n"
-              "info: Definition is of type: ",
-              static_cast<int>(std::size(expr.value->sloc.file_name)),
-              std::data(expr.value->sloc.file_name), expr.value->sloc.line,
-              expr.value->sloc.col, static_cast<int>(std::size(expr.name)),
-              std::data(expr.name));
-      print_type(expr_type);
-      fprintf(stderr, "\ninfo: Expected type: ");
-      print_type(decl_type);
-      fputc('\n', stderr);
-      return false;
-    }
+bool typecheck_t::check_toplevel(toplevel_expr &expr,
+                                 const string_table &stbl) {
+  resolved_names names;
+  return check_value(expr, stbl, names);
+}
+
+bool typecheck_t::check_toplevel(toplevel_expr &expr,
+                                 const string_table &stbl,
+                                 name_resolver &names) {
+  return check_value(expr, stbl, names);
+}
+
+template <class Resolver>
+bool typecheck_t::check_value(toplevel_expr &expr, const string_table &stbl,
+                              Resolver &names) {
+  if (!expr.value)
+    return true;
+  local_types.reset(expr.first_local_id);
+  type *const expr_type = infer(*expr.value, names);
+  if (!expr_type)
+    return false;
+  expr.value_type = expr_type;
+  type *const decl_type = get_type_for_id(expr.id);
+  if (!unify(expr_type, decl_type)) {
+    const source_position pos = sources.position(expr.value->sloc);
+    fprintf(diag,
+            "%.*s:%d:%d: error: Function definition \"%.*s\" is of "
+            "unexpected type:\n"
+            "info: Definition is of type: ",
+            static_cast<int>(std::size(pos.file_name)),
+            std::data(pos.file_name), pos.line, pos.col,
+            static_cast<int>(std::size(stbl[expr.name])),
+            std::data(stbl[expr.name]));
+    print_type(expr_type, diag);
+    fprintf(diag, "\ninfo: Expected type: ");
+    print_type(decl_type, diag);
+    fputc('\n', diag);
+    return false;
   }
   return true;
 }
 
+bool typecheck(std::vector<toplevel_expr> &exprs, compilation_context &cc) {
+  typecheck_t functor{cc.type_alloc, cc.diag, cc.sources,
+                      cc.symtab.get_first_local_id()};
+  functor.setup_primitive_types(cc.symtab, cc.stbl);
+  for (auto &expr : exprs)
+    functor.register_toplevel(expr);
+  return std::all_of(std::begin(exprs), std::end(exprs), [&](auto &&expr) {
+    return functor.check_toplevel(expr, cc.stbl);
+  });
+}
+
+bool resolve_and_typecheck(std::vector<toplevel_expr> &exprs,
+                           compilation_context &cc) {
+  register_globals(exprs, cc);
+  typecheck_t functor{cc.type_alloc, cc.diag, cc.sources,
+                      cc.symtab.get_first_local_id()};
+  functor.setup_primitive_types(cc.symtab, cc.stbl);
+  for (auto &expr : exprs)
+    functor.register_toplevel(expr);
+  name_resolver names{cc};
+  return std::all_of(std::begin(exprs), std::end(exprs), [&](auto &&expr) {
+    expr.first_local_id = cc.symtab.get_next_id();
+    return functor.check_toplevel(expr, cc.stbl, names);
+  });
+}
+
 } // namespace lyn
@@ -0,0 +1,265 @@
+#include <anf.h>
+#include <expr.h>
+#include <gtest/gtest.h>
+#include <passes.h>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include "test_helpers.h"
+
+namespace {
+
+class anf_test : public lyn::test::anf_fixture {
+protected:
+  // Names of the functions called by the definition name, in order
+  std::vector<std::string> calls_of(std::string_view name) const {
+    std::vector<std::string> calls;
+    for (auto &&block : ctx->blocks_of(def_of(name)))
+      for (auto &&instr : ctx->instrs_of(block))
+        if (const auto *const call = std::get_if<lyn::anf_call>(&instr))
+          calls.emplace_back(call->target ? "<indirect>"
+                                          : ctx->name_of(call->name));
+    return calls;
+  }
+
+  // Constants returned by the definition name right after creating them
+  std::vector<int> returned_constants(std::string_view name) const {
+    std::vector<int> result;
+    for (auto &&block : ctx->blocks_of(def_of(name))) {
+      const auto instrs = ctx->instrs_of(block);
+      for (std::size_t i = 1; i < std::size(instrs); ++i) {
+        const auto *const constant =
+            std::get_if<lyn::anf_constant>(&instrs[i - 1]);
+        const auto *const ret = std::get_if<lyn::anf_return>(&instrs[i]);
+        if (constant && ret && ret->value == constant->id)
+          result.push_back(constant->value);
+      }
+    }
+    return result;
+  }
+};
+
+using dead_code_elim = anf_test;
+
+} // namespace
+
+TEST_F(dead_code_elim, removes_unused_pure_computations) {
+  const std::string source = "(define main\n"
+                             "  (lambda (x)\n"
+                             "    (let ((a (* (+ x 1) 2))\n"
+                             "          (b (- x 1)))\n"
+                             "      x)))\n";
+  compile(source);
+  EXPECT_EQ(calls_of("main"), std::vector<std::string>{});
+}
+
+TEST_F(dead_code_elim, keeps_calls_with_effects) {
+  const std::string source = "(define main\n"
+                             "  (lambda (x)\n"
+                             "    (let ((a (/ x 0))) x)))\n";
+  compile(source);
+  EXPECT_EQ(calls_of("main"), std::vector<std::string>{"/"});
+}
+
+TEST_F(dead_code_elim, removes_divisions_by_nonzero_constants) {
+  const std::string source = "(define main\n"
+                             "  (lambda (x y)\n"
+                             "    (let ((a (/ x 2))\n"
+                             "          (b (% x 3))\n"
+                             "          (c (/ x y)))\n"
+                             "      x)))\n";
+  compile(source);
+  EXPECT_EQ(calls_of("main"), std::vector<std::string>{"/"});
+}
+
+TEST_F(dead_code_elim, removes_calls_of_pure_functions) {
+  const std::string source = "(define inc (lambda (x) (+ x 1)))\n"
+                             "(define twice (lambda (x) (inc (inc x))))\n"
+                             "(define loop (lambda (x) (loop x)))\n"
+                             "(define main\n"
+                             "  (lambda (x)\n"
+                             "    (let ((a (twice x))\n"
+                             "          (b (loop x)))\n"
+                             "      x)))\n";
+  // The calls are removed, not inlined
+  cc.inline_threshold = 0;
+  compile(source);
+  EXPECT_EQ(calls_of("main"), std::vector<std::string>{"loop"});
+}
+
+TEST_F(anf_test, folds_primitives_with_known_arguments) {
+  compile("(define main\n"
+          "  (lambda (x)\n"
+          "    (let ((a (shl 1 4)))\n"
+          "      (- (* a 3) (neg 2)))))\n"
+          "(define wraps (lambda (x) (+ 2147483647 1)))\n"
+          "(define divides (lambda (x) (+ (/ 7 2) (% 7 0))))\n");
+  EXPECT_EQ(calls_of("main"), std::vector<std::string>{});
+  EXPECT_EQ(returned_constants("main"), std::vector<int>{50});
+  EXPECT_EQ(returned_constants("wraps"), std::vector<int>{-2147483647 - 1});
+  // Division by zero is left to the runtime
+  EXPECT_EQ(calls_of("divides"), (std::vector<std::string>{"%", "+"}));
+}
+
+TEST_F(anf_test, removes_branches_not_taken) {
+  compile("(define main\n"
+          "  (lambda (x)\n"
+          "    (+ x (if (< 2 1) (* x x) (if true 3 x)))))\n"
+          "(define pick (lambda (x) (if false x 1)))\n");
+  EXPECT_EQ(std::size(ctx->blocks_of(def_of("main"))), 1u);
+  EXPECT_EQ(calls_of("main"), std::vector<std::string>{"+"});
+  EXPECT_EQ(std::size(ctx->blocks_of(def_of("pick"))), 1u);
+  EXPECT_EQ(returned_constants("pick"), std::vector<int>{1});
+}
+
+TEST_F(anf_test, keeps_branches_on_unknown_conditions) {
+  compile("(define main (lambda (x) (if (= x 0) (= 1 1) false)))\n");
+  EXPECT_EQ(std::size(ctx->blocks_of(def_of("main"))), 3u);
+  EXPECT_EQ(returned_constants("main"), (std::vector<int>{1, 0}));
+}
+
+TEST_F(anf_test, self_tail_calls_become_loops) {
+  compile("(define gcd\n"
+          "  (lambda (a b)\n"
+          "    (if (= b 0) a (gcd b (% a b)))))\n"
+          "(define swap (lambda (a b) (if (< a b) (swap b a) a)))\n");
+  EXPECT_EQ(calls_of("gcd"), (std::vector<std::string>{"=", "%"}));
+  const auto blocks = ctx->blocks_of(def_of("gcd"));
+  ASSERT_EQ(std::size(blocks), 4u);
+  const auto entry = ctx->instrs_of(blocks[0]);
+  ASSERT_EQ(std::size(entry), 2u);
+  EXPECT_TRUE(std::holds_alternative<lyn::anf_receive>(entry[0]));
+  EXPECT_EQ(std::get<lyn::anf_jump>(entry[1]).target, 1);
+  EXPECT_EQ(std::get<lyn::anf_jump>(ctx->instrs_of(blocks[3]).back()).target,
+            1);
+  // Swapping the parameters needs a copy of one of them
+  EXPECT_EQ(calls_of("swap"), std::vector<std::string>{"<"});
+  int assignments = 0;
+  for (auto &&block : ctx->blocks_of(def_of("swap")))
+    for (auto &&instr : ctx->instrs_of(block))
+      assignments += std::holds_alternative<lyn::anf_assoc>(instr);
+  EXPECT_EQ(assignments, 3);
+}
+
+TEST_F(anf_test, inlines_small_definitions) {
+  compile("(declare ext (-> int int))\n"
+          "(define sq (lambda (x) (* x x)))\n"
+          "(define abs (lambda (x) (if (< x 0) (neg x) x)))\n"
+          "(define main (lambda (a) (+ (abs (ext a)) (sq 3))))\n"
+          "(define wrap (lambda (a) (abs a)))\n");
+  // The square of the constant argument is folded
+  EXPECT_EQ(calls_of("main"),
+            (std::vector<std::string>{"ext", "<", "neg", "+"}));
+  EXPECT_EQ(calls_of("wrap"), (std::vector<std::string>{"<", "neg"}));
+  // Tail calls of the callee stay tail calls of the caller
+  int tail_calls = 0;
+  for (auto &&block : ctx->blocks_of(def_of("wrap")))
+    for (auto &&instr : ctx->instrs_of(block))
+      if (const auto *const call = std::get_if<lyn::anf_call>(&instr))
+        tail_calls += call->is_tail;
+  EXPECT_EQ(tail_calls, 1);
+}
+
+TEST_F(anf_test, does_not_inline_recursive_definitions) {
+  compile("(define even (lambda (n) (if (= n 0) true (odd (- n 1)))))\n"
+          "(define odd (lambda (n) (if (= n 0) false (even (- n 1)))))\n"
+          "(define count (lambda (n) (if (= n 0) 0 (count (- n 1)))))\n"
+          "(define main (lambda (n) (+ (count n) (if (even n) 1 2))))\n");
+  EXPECT_EQ(calls_of("even"), (std::vector<std::string>{"=", "-", "odd"}));
+  EXPECT_EQ(calls_of("main"),
+            (std::vector<std::string>{"count", "even", "+"}));
+}
+
+TEST_F(anf_test, inlining_follows_the_threshold) {
+  cc.inline_threshold = 0;
+  compile("(define inc (lambda (x) (+ x 1)))\n"
+          "(define main (lambda (x) (inc x)))\n");
+  EXPECT_EQ(calls_of("main"), std::vector<std::string>{"inc"});
+}
+
+TEST_F(anf_test, lifts_lambdas_which_are_only_called) {
+  cc.inline_threshold = 0;
+  compile("(define main\n"
+          "  (lambda (a b)\n"
+          "    (let ((add (lambda (x) (+ a x))))\n"
+          "      (add (add b)))))\n");
+  ASSERT_EQ(std::size(ctx->defs), 2u);
+  const std::string lifted{ctx->name_of(ctx->defs[1].name)};
+  EXPECT_FALSE(ctx->defs[1].global);
+  EXPECT_EQ(calls_of("main"), (std::vector<std::string>{lifted, lifted}));
+  // The free variable is passed after the argument
+  const auto params = ctx->operands_of(
+      std::get<lyn::anf_receive>(
+          ctx->instrs_of(ctx->blocks_of(ctx->defs[1])[0])[0])
+          .args);
+  EXPECT_EQ(std::size(params), 2u);
+  const auto main_params = ctx->operands_of(
+      std::get<lyn::anf_receive>(
+          ctx->instrs_of(ctx->blocks_of(def_of("main"))[0])[0])
+          .args);
+  for (auto &&block : ctx->blocks_of(def_of("main"))) {
+    for (auto &&instr : ctx->instrs_of(block)) {
+      if (const auto *const call = std::get_if<lyn::anf_call>(&instr)) {
+        EXPECT_EQ(ctx->operands_of(call->args)[1], main_params[0]);
+      }
+    }
+  }
+}
+
+TEST_F(anf_test, drops_lifted_lambdas_once_inlined) {
+  compile("(define main\n"
+          "  (lambda (a b)\n"
+          "    (let ((add (lambda (x) (+ a x))))\n"
+          "      (add (add b)))))\n");
+  ASSERT_EQ(std::size(ctx->defs), 1u);
+  EXPECT_EQ(calls_of("main"), (std::vector<std::string>{"+", "+"}));
+}
+
+TEST_F(anf_test, resolves_calls_of_known_functions) {
+  cc.inline_threshold = 0;
+  compile("(declare ext (-> int int))\n"
+          "(declare other (-> int int))\n"
+          "(define inc (lambda (x) (+ x 1)))\n"
+          "(define main\n"
+          "  (lambda (c x)\n"
+          "    (let ((f inc) (g (if (= c 0) ext ext)) (h +))\n"
+          "      (+ (f x) (+ (g x) (h x 2))))))\n"
+          "(define pick\n"
+          "  (lambda (c x) ((if (= c 0) ext other) x)))\n");
+  EXPECT_EQ(calls_of("main"),
+            (std::vector<std::string>{"=", "inc", "ext", "+", "+", "+"}));
+  // The loads of the functions are no longer used and removed
+  for (auto &&block : ctx->blocks_of(def_of("main")))
+    for (auto &&instr : ctx->instrs_of(block))
+      EXPECT_FALSE(std::holds_alternative<lyn::anf_global>(instr));
+  EXPECT_EQ(calls_of("pick"), (std::vector<std::string>{"=", "<indirect>"}));
+}
+
+TEST_F(anf_test, lifted_lambdas_do_not_clash_with_globals) {
+  cc.inline_threshold = 0;
+  compile("(define fun35 (lambda (y) (* y 7)))\n"
+          "(define main\n"
+          "  (lambda (a)\n"
+          "    (let ((f (lambda (x) (+ a x))))\n"
+          "      (f (f 1)))))\n"
+          "(define use (lambda (z) (fun35 z)))\n");
+  ASSERT_EQ(std::size(ctx->defs), 4u);
+  const std::string lifted{ctx->name_of(ctx->defs[3].name)};
+  EXPECT_NE(lifted, "fun35");
+  EXPECT_EQ(calls_of("main"), (std::vector<std::string>{lifted, lifted}));
+  EXPECT_EQ(calls_of("use"), std::vector<std::string>{"fun35"});
+  EXPECT_EQ(calls_of("fun35"), std::vector<std::string>{"*"});
+}
+
+TEST_F(anf_test, inlines_globals_named_like_lifted_lambdas) {
+  compile("(define fun35 (lambda (y) (* y 7)))\n"
+          "(define main\n"
+          "  (lambda (a)\n"
+          "    (let ((f (lambda (x) (+ a x))))\n"
+          "      (f (f 1)))))\n"
+          "(define use (lambda (z) (fun35 z)))\n");
+  EXPECT_EQ(calls_of("main"), (std::vector<std::string>{"+", "+"}));
+  EXPECT_EQ(calls_of("use"), std::vector<std::string>{"*"});
+}
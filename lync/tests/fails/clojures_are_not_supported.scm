@@ -1,4 +1,4 @@
 (define this-is-fine
   (lambda (a)
     (let ((this-is-not (lambda (b) (+ a b))))
-      0)))
+      this-is-not)))
@@ -0,0 +1,2 @@
+(define self-application
+  (lambda (f) (f f)))
@@ -0,0 +1,167 @@
+#include <anf.h>
+#include <cstdio>
+#include <expr.h>
+#include <gtest/gtest.h>
+#include <passes.h>
+#include <string>
+
+#include "test_helpers.h"
+
+namespace {
+
+std::string compile_to_asm(
+    const std::string &source,
+    lyn::value_placement placement = lyn::value_placement::registers) {
+  lyn::compilation_context cc;
+  auto defs = lyn::test::check_string(source, cc);
+  if (!defs)
+    return {};
+  const auto ctx = lyn::genanf(*defs, cc);
+  FILE *const out = std::tmpfile();
+  lyn::genasm(*ctx, cc.symtab, out, placement);
+  return lyn::test::read_and_close(out);
+}
+
+} // namespace
+
+TEST(genasm, primitives_are_emitted_inline) {
+  const std::string code =
+      compile_to_asm("(define main\n"
+                     "  (lambda (a b)\n"
+                     "    (if (< a b) (- b a) (land a b))))\n");
+  EXPECT_EQ(code.find("blx"), std::string::npos);
+  EXPECT_EQ(code.find("bx \""), std::string::npos);
+  EXPECT_NE(code.find("\tcmp r0, r1\n\tbge .L3\n"), std::string::npos);
+  EXPECT_NE(code.find("\tsubs r0, r1, r0\n"), std::string::npos);
+  EXPECT_NE(code.find("\tands r0, r1\n"), std::string::npos);
+}
+
+TEST(genasm, primitives_shadowed_by_declarations_are_called) {
+  const std::string code =
+      compile_to_asm("(declare not (-> int int))\n"
+                     "(define main (lambda (a) (+ (not a) 1)))\n");
+  EXPECT_NE(code.find("\tblx \"not\"\n"), std::string::npos);
+  EXPECT_EQ(code.find("rsbs"), std::string::npos);
+}
+
+TEST(genasm, squares_multiply_distinct_registers) {
+  const std::string code =
+      compile_to_asm("(define sq (lambda (x) (* x x)))\n");
+  EXPECT_NE(code.find("\tmov ip, r1\n"
+                      "\tmovs r1, r0\n"
+                      "\tmuls r0, r1\n"
+                      "\tmov r1, ip\n"),
+            std::string::npos);
+  EXPECT_EQ(code.find("\tmuls r0, r0\n"), std::string::npos);
+}
+
+TEST(genasm, comparisons_are_fused_into_branches) {
+  const std::string code =
+      compile_to_asm("(define main\n"
+                     "  (lambda (a b)\n"
+                     "    (if (not (<= a b)) 1 2)))\n");
+  EXPECT_NE(code.find(".L1:\n"
+                      "\tcmp r0, r1\n"
+                      "\tble .L3\n"
+                      ".L2:\n"),
+            std::string::npos);
+  EXPECT_EQ(code.find("\n1:\n"), std::string::npos);
+}
+
+TEST(genasm, comparisons_used_as_values_are_materialized) {
+  const std::string code =
+      compile_to_asm("(define main\n"
+                     "  (lambda (a b)\n"
+                     "    (let ((c (= a b))) (if c c false))))\n");
+  EXPECT_NE(code.find("\tsubs r0, r0, r1\n"), std::string::npos);
+  EXPECT_NE(code.find("\tcmp r0, #0\n"
+                      "\tbeq .L3\n"),
+            std::string::npos);
+}
+
+TEST(genasm, division_is_called) {
+  const std::string code =
+      compile_to_asm("(define main (lambda (a b) (+ (/ a b) (% a b))))\n");
+  EXPECT_NE(code.find("\tblx \"/\"\n"), std::string::npos);
+  EXPECT_NE(code.find("\tblx \"%\"\n"), std::string::npos);
+  // The quotient is kept in a register preserved by the second call
+  EXPECT_NE(code.find("\tblx \"/\"\n\tmovs r6, r0\n"), std::string::npos);
+  EXPECT_NE(code.find("\tadds r0, r6, r0\n"), std::string::npos);
+}
+
+TEST(genasm, values_stay_in_registers) {
+  const std::string code =
+      compile_to_asm("(define main (lambda (a b) (+ (* a a) (- a b))))\n");
+  EXPECT_EQ(code.find("[sp"), std::string::npos);
+  EXPECT_EQ(code.find("\tsub sp"), std::string::npos);
+}
+
+TEST(genasm, leaf_functions_keep_lr) {
+  const std::string code =
+      compile_to_asm("(define main (lambda (a b) (+ (* a a) (- a b))))\n"
+                     "(define id (lambda (x) x))\n");
+  EXPECT_EQ(code.find("push"), std::string::npos);
+  EXPECT_EQ(code.find("pop"), std::string::npos);
+  EXPECT_NE(code.find("\t@ frame size: 0 bytes\n"
+                      ".L2:\n"
+                      "\tbx lr\n"),
+            std::string::npos);
+}
+
+TEST(genasm, calls_save_lr) {
+  const std::string code =
+      compile_to_asm("(declare g (-> int int))\n"
+                     "(define main (lambda (a) (+ a (g a))))\n");
+  EXPECT_NE(code.find("\tpush {r4, lr}\n"), std::string::npos);
+  EXPECT_NE(code.find("\tpop {r4, pc}\n"), std::string::npos);
+}
+
+TEST(genasm, arguments_are_swapped_through_a_free_register) {
+  const std::string code =
+      compile_to_asm("(declare g (-> int int int))\n"
+                     "(define swap (lambda (a b) (g b a)))\n");
+  EXPECT_NE(code.find("\tmov ip, r0\n"
+                      "\tmovs r0, r1\n"
+                      "\tmov r1, ip\n"),
+            std::string::npos);
+}
+
+TEST(genasm, self_tail_calls_loop_without_frame_setup) {
+  const std::string code =
+      compile_to_asm("(define count\n"
+                     "  (lambda (n acc)\n"
+                     "    (if (= n 0) acc (count (- n 1) (+ acc 2)))))\n");
+  EXPECT_EQ(code.find("bx \""), std::string::npos);
+  EXPECT_EQ(code.find("push"), std::string::npos);
+  EXPECT_NE(code.find("\tb .L2\n"), std::string::npos);
+}
+
+TEST(genasm, values_are_spilled_when_registers_run_out) {
+  const std::string code =
+      compile_to_asm("(declare f (-> int int))\n"
+                     "(define main\n"
+                     "  (lambda (a)\n"
+                     "    (let ((b (f 1)) (c (f 2)) (d (f 3)) (e (f 4))\n"
+                     "          (g (f 5)))\n"
+                     "      (+ a (+ b (+ c (+ d (+ e g))))))))\n");
+  EXPECT_NE(code.find("\t@ frame size: 24 bytes\n"
+                      ".L1:\n"
+                      "\tpush {r4, r5, r6, r7, lr}\n"
+                      "\tsub sp, #4\n"),
+            std::string::npos);
+  EXPECT_NE(code.find(", [sp, #0]\n"), std::string::npos);
+  EXPECT_NE(code.find("\tadd sp, #4\n"
+                      "\tpop {r4, r5, r6, r7, pc}\n"),
+            std::string::npos);
+}
+
+TEST(genasm, stack_placement_keeps_values_on_the_stack) {
+  const std::string code =
+      compile_to_asm("(define main (lambda (a b) (- a b)))\n",
+                     lyn::value_placement::stack);
+  EXPECT_NE(code.find("\tpush {r0, r1, r6, lr}\n"), std::string::npos);
+  EXPECT_NE(code.find("\tldr r0, [sp, #4]\n"
+                      "\tldr r1, [sp, #8]\n"
+                      "\tsubs r0, r0, r1\n"),
+            std::string::npos);
+}
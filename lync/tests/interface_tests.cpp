@@ -0,0 +1,93 @@
+#include <cstdio>
+#include <expr.h>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <interface.h>
+#include <passes.h>
+#include <source_buffer.h>
+#include <string>
+
+#include "test_helpers.h"
+
+namespace {
+
+using lyn::test::check_string;
+
+class interface_test : public lyn::test::temp_dir_test {
+protected:
+  std::string write_interface(const std::string &name,
+                              const std::string &source) {
+    lyn::compilation_context cc;
+    const auto defs = check_string(source, cc);
+    EXPECT_TRUE(defs);
+    const auto path = (dir / name).string();
+    FILE *const out = std::fopen(path.c_str(), "wb");
+    EXPECT_TRUE(out);
+    if (defs && out) {
+      EXPECT_TRUE(lyn::write_interface(*defs, cc.stbl, out));
+    }
+    if (out)
+      std::fclose(out);
+    return path;
+  }
+};
+
+TEST_F(interface_test, exports_typed_definitions) {
+  const auto path =
+      write_interface("lib.lyni", "(define add (lambda (a b) (+ a b)))\n"
+                                  "(define pos (lambda (a) (< 0 a)))\n"
+                                  "(define id (lambda (a) a))\n");
+  const auto buffer = lyn::source_buffer::open(path.c_str());
+  ASSERT_TRUE(buffer);
+  std::pmr::monotonic_buffer_resource alloc;
+  const auto decls = lyn::read_interface(*buffer, alloc);
+  ASSERT_TRUE(decls);
+  // id is polymorphic and cannot be declared
+  ASSERT_EQ(std::size(*decls), 2u);
+  EXPECT_EQ((*decls)[0].name, "add");
+  EXPECT_EQ((*decls)[1].name, "pos");
+  const auto *const pos =
+      std::get_if<lyn::func_type_expr>(&(*decls)[1].type->content);
+  ASSERT_TRUE(pos);
+  ASSERT_EQ(std::size(pos->types), 2u);
+  EXPECT_TRUE(std::holds_alternative<lyn::int_type_expr>(
+      pos->types[0]->content));
+  EXPECT_TRUE(std::holds_alternative<lyn::bool_type_expr>(
+      pos->types[1]->content));
+}
+
+TEST_F(interface_test, included_interface_is_typechecked_against) {
+  const auto path =
+      write_interface("lib.lyni", "(define add (lambda (a b) (+ a b)))\n");
+  lyn::compilation_context cc;
+  const auto defs = check_string(
+      "(include " + path + ")\n(define f (lambda (x) (add x 1)))\n", cc);
+  ASSERT_TRUE(defs);
+  ASSERT_EQ(std::size(*defs), 2u);
+  EXPECT_EQ(cc.stbl[(*defs)[0].name], "add");
+  EXPECT_FALSE((*defs)[0].value);
+
+  lyn::compilation_context bad_cc;
+  bad_cc.diag = std::tmpfile();
+  EXPECT_FALSE(check_string(
+      "(include " + path + ")\n(define f (lambda (x) (add true x)))\n",
+      bad_cc));
+  std::fclose(bad_cc.diag);
+}
+
+TEST_F(interface_test, invalid_interface_is_rejected) {
+  const auto path = write_interface("lib.lyni", "(define f (lambda () 1))\n");
+  std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1u);
+  const auto buffer = lyn::source_buffer::open(path.c_str());
+  ASSERT_TRUE(buffer);
+  std::pmr::monotonic_buffer_resource alloc;
+  EXPECT_FALSE(lyn::read_interface(*buffer, alloc));
+
+  std::ofstream{path} << "(declare f (-> int))\n";
+  const auto text = lyn::source_buffer::open(path.c_str());
+  ASSERT_TRUE(text);
+  EXPECT_FALSE(lyn::read_interface(*text, alloc));
+}
+
+} // namespace
@@ -0,0 +1,109 @@
+#include <expr.h>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <module_cache.h>
+#include <passes.h>
+#include <string>
+
+#include "test_helpers.h"
+
+namespace {
+
+using lyn::test::parse_string;
+
+TEST(parser, declaration_and_definition_are_merged) {
+  lyn::compilation_context cc;
+  const auto defs = parse_string("(declare f (-> int int))\n"
+                                 "(define g (lambda (x) x))\n"
+                                 "(define f (lambda (x) (g x)))\n",
+                                 cc);
+  ASSERT_TRUE(defs);
+  ASSERT_EQ(std::size(*defs), 2u);
+  EXPECT_EQ(cc.stbl[(*defs)[0].name], "f");
+  EXPECT_TRUE((*defs)[0].type_value);
+  EXPECT_TRUE((*defs)[0].value);
+  EXPECT_EQ(cc.stbl[(*defs)[1].name], "g");
+  EXPECT_FALSE((*defs)[1].type_value);
+}
+
+TEST(parser, duplicate_definition_is_rejected) {
+  lyn::compilation_context cc;
+  EXPECT_FALSE(parse_string("(define f (lambda () 1))\n"
+                            "(define f (lambda () 2))\n",
+                            cc));
+}
+
+using include_test = lyn::test::temp_dir_test;
+
+TEST_F(include_test, diamond_include_is_read_once) {
+  const auto decls = write_file("decls.scm", "(declare f (-> int int))\n");
+  const auto util =
+      write_file("util.scm", "(include " + decls + ")\n"
+                             "(declare g (-> int int))\n");
+  lyn::compilation_context cc;
+  const auto defs = parse_string(
+      "(include " + decls + ")\n(include " + util + ")\n", cc);
+  ASSERT_TRUE(defs);
+  EXPECT_EQ(std::size(*defs), 2u);
+  EXPECT_EQ(std::size(cc.included_files), 2u);
+}
+
+TEST_F(include_test, cached_module_is_spliced_in) {
+  const auto decls = write_file("decls.scm", "(declare f (-> int int))\n");
+  const auto util =
+      write_file("util.scm", "(include " + decls + ")\n"
+                             "(declare g (-> int bool))\n");
+  const std::string source = "(include " + util + ")\n"
+                             "(define h (lambda (x) (g (f x))))\n";
+  lyn::module_cache modules;
+  {
+    lyn::compilation_context cc;
+    cc.modules = &modules;
+    ASSERT_TRUE(parse_string(source, cc));
+  }
+  EXPECT_TRUE(modules.find(std::filesystem::canonical(decls).string()));
+  EXPECT_TRUE(modules.find(std::filesystem::canonical(util).string()));
+  // Later compilations do not read the files again
+  write_file("decls.scm", "(not valid");
+  write_file("util.scm", "(not valid");
+  lyn::compilation_context cc;
+  cc.modules = &modules;
+  const auto defs = parse_string(source, cc);
+  ASSERT_TRUE(defs);
+  ASSERT_EQ(std::size(*defs), 3u);
+  EXPECT_EQ(cc.stbl[(*defs)[0].name], "f");
+  EXPECT_EQ(cc.stbl[(*defs)[1].name], "g");
+  EXPECT_TRUE((*defs)[1].type_value);
+  EXPECT_EQ(std::size(cc.included_files), 2u);
+}
+
+TEST_F(include_test, modules_with_definitions_are_not_cached) {
+  const auto helpers =
+      write_file("helpers.scm", "(define f (lambda (x) x))\n");
+  lyn::module_cache modules;
+  lyn::compilation_context cc;
+  cc.modules = &modules;
+  ASSERT_TRUE(parse_string("(include " + helpers + ")\n", cc));
+  EXPECT_FALSE(modules.find(std::filesystem::canonical(helpers).string()));
+}
+
+TEST(parser, toplevel_lookup_merges_many_definitions) {
+  constexpr int count = 100000;
+  // The declarations come first, so every definition is looked up
+  std::string source;
+  for (int i = 0; i < count; ++i)
+    source += "(declare fun" + std::to_string(i) + " (-> int int))\n";
+  for (int i = count; i-- != 0;)
+    source += "(define fun" + std::to_string(i) + " (lambda (x) x))\n";
+  lyn::compilation_context cc;
+  const auto defs = parse_string(source, cc);
+  ASSERT_TRUE(defs);
+  ASSERT_EQ(std::size(*defs), static_cast<std::size_t>(count));
+  for (int i = 0; i < count; ++i) {
+    const auto &def = (*defs)[i];
+    ASSERT_EQ(cc.stbl[def.name], "fun" + std::to_string(i));
+    ASSERT_TRUE(def.type_value && def.value);
+  }
+}
+
+} // namespace
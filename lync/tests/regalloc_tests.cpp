@@ -0,0 +1,126 @@
+#include <anf.h>
+#include <expr.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <passes.h>
+#include <regalloc.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include "test_helpers.h"
+
+namespace {
+
+class regalloc_test : public lyn::test::anf_fixture {
+protected:
+  void compile(const std::string &source) {
+    anf_fixture::compile(source);
+    if (HasFatalFailure())
+      return;
+    allocator = std::make_unique<lyn::register_allocator>(
+        *ctx, std::vector<bool>(ctx->stbl->size()));
+  }
+
+  const lyn::register_assignment &run(std::string_view name) {
+    return allocator->run(def_of(name));
+  }
+
+  // Ids received as parameters by the definition name
+  std::vector<int> params_of(std::string_view name) const {
+    const auto &receive = std::get<lyn::anf_receive>(
+        ctx->instrs_of(ctx->blocks_of(def_of(name))[0])[0]);
+    const auto params = ctx->operands_of(receive.args);
+    return {std::begin(params), std::end(params)};
+  }
+
+  std::unique_ptr<lyn::register_allocator> allocator;
+};
+
+} // namespace
+
+TEST_F(regalloc_test, parameters_stay_in_their_registers) {
+  compile("(declare f (-> int int int int))\n"
+          "(define main (lambda (a b c) (f c b a)))\n");
+  const auto &assignment = run("main");
+  const auto params = params_of("main");
+  for (int i = 0; i != 3; ++i) {
+    const auto loc = assignment.locations.get(params[i]);
+    EXPECT_EQ(loc.kind, lyn::value_location::reg);
+    EXPECT_EQ(loc.index, i);
+  }
+  EXPECT_EQ(assignment.saved_registers, 0u);
+  EXPECT_EQ(assignment.spill_slots, 0);
+}
+
+TEST_F(regalloc_test, values_live_across_calls_are_preserved) {
+  compile("(declare f (-> int int))\n"
+          "(define main (lambda (a b) (+ (f a) (+ a b))))\n");
+  const auto &assignment = run("main");
+  for (const int param : params_of("main")) {
+    const auto loc = assignment.locations.get(param);
+    EXPECT_EQ(loc.kind, lyn::value_location::reg);
+    EXPECT_GE(loc.index, 4);
+    EXPECT_TRUE(assignment.saved_registers & (1u << loc.index));
+  }
+}
+
+TEST_F(regalloc_test, unused_values_get_no_location) {
+  compile("(define main (lambda (a b) b))\n");
+  const auto &assignment = run("main");
+  const auto params = params_of("main");
+  EXPECT_EQ(assignment.locations.get(params[0]).kind,
+            lyn::value_location::none);
+  EXPECT_EQ(assignment.locations.get(params[1]).kind,
+            lyn::value_location::reg);
+}
+
+TEST_F(regalloc_test, spilling_reserves_scratch_registers) {
+  compile("(declare f (-> int int))\n"
+          "(define main\n"
+          "  (lambda (a)\n"
+          "    (let ((b (f 1)) (c (f 2)) (d (f 3)) (e (f 4))\n"
+          "          (g (f 5)))\n"
+          "      (+ a (+ b (+ c (+ d (+ e g))))))))\n");
+  const auto &assignment = run("main");
+  EXPECT_EQ(assignment.spill_slots, 1);
+  EXPECT_TRUE(assignment.scratch_registers);
+  EXPECT_EQ(assignment.saved_registers, 0xf0u);
+}
+
+TEST_F(regalloc_test, captured_values_are_rejected) {
+  // The lambda escapes, so it is neither lifted nor inlined
+  compile("(define main\n"
+          "  (lambda (x)\n"
+          "    (let ((f (lambda (y) (+ x y)))) f)))\n");
+  ASSERT_EQ(std::size(ctx->defs), 2u);
+  for (auto &&def : ctx->defs) {
+    if (ctx->name_of(def.name) != "main") {
+      EXPECT_THROW(allocator->run(def), std::out_of_range);
+    }
+  }
+}
+
+TEST_F(regalloc_test, spilled_values_share_slots_when_not_live_together) {
+  compile("(declare f (-> int int))\n"
+          "(define main\n"
+          "  (lambda (a)\n"
+          "    (let ((s (+ a (let ((b (f 1)) (c (f 2)) (d (f 3)) (e (f 4))\n"
+          "                        (g (f 5)))\n"
+          "                    (+ b (+ c (+ d (+ e g))))))))\n"
+          "      (+ s (let ((b (f 1)) (c (f 2)) (d (f 3)) (e (f 4))\n"
+          "                 (g (f 5)))\n"
+          "             (+ b (+ c (+ d (+ e g)))))))))\n");
+  const auto &assignment = run("main");
+  EXPECT_EQ(assignment.spill_slots, 1);
+  int spilled = 0;
+  for (auto &&block : ctx->blocks_of(ctx->defs.back()))
+    for (auto &&instr : ctx->instrs_of(block))
+      lyn::for_each_def(*ctx, instr, [&](int id) {
+        spilled += assignment.locations.get(id).kind ==
+                   lyn::value_location::slot;
+      });
+  EXPECT_EQ(spilled, 2);
+}
@@ -0,0 +1,96 @@
+#include <anf.h>
+#include <cstdio>
+#include <gtest/gtest.h>
+#include <session.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::optional<std::vector<std::string>> update(lyn::session &session,
+                                               const std::string &source) {
+  const auto names =
+      session.update(lyn::source_buffer::copy(source), "<test>");
+  if (!names)
+    return std::nullopt;
+  std::vector<std::string> result;
+  for (const lyn::symbol name : *names)
+    result.emplace_back(session.context().stbl[name]);
+  return result;
+}
+
+using names = std::vector<std::string>;
+
+TEST(session, redefinition_checks_dependents_only) {
+  lyn::session session;
+  ASSERT_EQ(update(session, "(declare inc (-> int int))\n"
+                            "(define inc (lambda (x) (+ x 1)))\n"
+                            "(define use (lambda () (inc 2)))\n"
+                            "(define other (lambda (y) (* y y)))\n"),
+            (names{"inc", "use", "other"}));
+  EXPECT_EQ(update(session, "(define inc (lambda (x) (+ x 2)))"),
+            (names{"inc", "use"}));
+  EXPECT_EQ(update(session, "(define other (lambda (y) (+ y y)))"),
+            (names{"other"}));
+  const auto ctx = session.code_for(
+      {*session.context().stbl.find("inc"),
+       *session.context().stbl.find("other")});
+  ASSERT_EQ(std::size(ctx.defs), 2u);
+  EXPECT_EQ(ctx.name_of(ctx.defs[0].name), "inc");
+  EXPECT_EQ(ctx.name_of(ctx.defs[1].name), "other");
+}
+
+TEST(session, inferred_types_follow_redefinitions) {
+  lyn::session session;
+  ASSERT_TRUE(update(session, "(define f (lambda (x) (+ x 1)))\n"
+                              "(define g (lambda () (f 1)))\n"));
+  // g constrains the type of f, so both have to be checked again
+  EXPECT_EQ(update(session, "(define f (lambda (x) (< x 1)))"),
+            (names{"f", "g"}));
+  EXPECT_TRUE(update(session, "(define h (lambda () (if (g) 1 2)))"));
+}
+
+TEST(session, rejected_update_leaves_session_unchanged) {
+  lyn::session session{std::tmpfile()};
+  ASSERT_TRUE(update(session, "(declare f (-> int int))\n"
+                              "(define f (lambda (x) x))\n"
+                              "(declare g (-> int))\n"
+                              "(define g (lambda () (f 1)))\n"));
+  EXPECT_FALSE(update(session, "(define f (lambda (x) (< x 1)))"));
+  EXPECT_FALSE(update(session, "(define new (lambda () (f true)))"));
+  // The rejected definition did not leave a binding behind
+  EXPECT_FALSE(update(session, "(define h (lambda () (new)))"));
+  EXPECT_EQ(update(session, "(define h (lambda () (+ (f 1) (g))))"),
+            (names{"h"}));
+}
+
+TEST(session, repeated_declarations_do_not_trigger_checks) {
+  lyn::session session;
+  ASSERT_TRUE(update(session, "(declare f (-> int int))\n"
+                              "(define g (lambda () (f 1)))\n"));
+  EXPECT_EQ(update(session, "(declare f (-> int int))"), names{});
+  EXPECT_EQ(update(session, "(declare f (-> int bool))"), names{"g"});
+}
+
+TEST(session, update_work_is_independent_of_session_size) {
+  constexpr int count = 5000;
+  std::string source;
+  for (int i = 0; i < count; ++i) {
+    const std::string name = "fun" + std::to_string(i);
+    source += "(declare " + name + " (-> int int))\n";
+    source += "(define " + name + " (lambda (x) (+ x " + std::to_string(i) +
+              ")))\n";
+  }
+  lyn::session session;
+  ASSERT_TRUE(update(session, source));
+  // Only the redefined function is checked and compiled again
+  const auto changed = session.update(
+      lyn::source_buffer::copy("(define fun42 (lambda (x) (- x 42)))"),
+      "<test>");
+  ASSERT_TRUE(changed);
+  ASSERT_EQ(std::size(*changed), 1u);
+  EXPECT_EQ(session.context().stbl[(*changed)[0]], "fun42");
+  EXPECT_EQ(std::size(session.code_for(*changed).defs), 1u);
+}
+
+} // namespace
@@ -0,0 +1,36 @@
+#include <gtest/gtest.h>
+#include <source_buffer.h>
+#include <source_manager.h>
+
+namespace {
+
+TEST(source_manager, computes_lines_and_columns) {
+  lyn::source_manager sources;
+  const auto file =
+      sources.add(lyn::source_buffer::copy("(a\n\tbc\n\nd)"), "file.scm");
+  const auto first = sources.position({file, 0u});
+  EXPECT_EQ("file.scm", first.file_name);
+  EXPECT_EQ(1, first.line);
+  EXPECT_EQ(1, first.col);
+  const auto tab = sources.position({file, 5u});
+  EXPECT_EQ(2, tab.line);
+  EXPECT_EQ(3, tab.col);
+  const auto line_end = sources.position({file, 6u});
+  EXPECT_EQ(2, line_end.line);
+  EXPECT_EQ(4, line_end.col);
+  const auto end = sources.position({file, 10u});
+  EXPECT_EQ(4, end.line);
+  EXPECT_EQ(3, end.col);
+}
+
+TEST(source_manager, keeps_files_apart) {
+  lyn::source_manager sources;
+  const auto first = sources.add(lyn::source_buffer::copy("a\nb"), "a.scm");
+  const auto second = sources.add(lyn::source_buffer::copy("c"), "c.scm");
+  EXPECT_NE(first, second);
+  EXPECT_EQ(2, sources.position({first, 2u}).line);
+  EXPECT_EQ("c.scm", sources.position({second, 0u}).file_name);
+  EXPECT_EQ(1, sources.position({second, 0u}).line);
+}
+
+} // namespace
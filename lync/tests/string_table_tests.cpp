@@ -0,0 +1,35 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <string_table.h>
+
+namespace {
+
+TEST(string_table, interning_deduplicates) {
+  lyn::string_table stbl;
+  const std::string first = "name";
+  const std::string second = "name";
+  EXPECT_EQ(stbl.intern(first), stbl.intern(second));
+  EXPECT_EQ(stbl.size(), 1u);
+}
+
+TEST(string_table, handles_are_dense) {
+  lyn::string_table stbl;
+  EXPECT_EQ(lyn::symbol_index(stbl.intern("a")), 0u);
+  EXPECT_EQ(lyn::symbol_index(stbl.intern("b")), 1u);
+  EXPECT_EQ(lyn::symbol_index(stbl.intern("a")), 0u);
+  EXPECT_EQ(lyn::symbol_index(stbl.intern("c")), 2u);
+}
+
+TEST(string_table, handles_map_back_to_strings) {
+  lyn::string_table stbl;
+  std::vector<lyn::symbol> syms;
+  for (int i = 0; i < 10000; ++i)
+    syms.push_back(stbl.intern("sym" + std::to_string(i)));
+  for (int i = 0; i < 10000; ++i) {
+    EXPECT_EQ(stbl[syms[i]], "sym" + std::to_string(i));
+    EXPECT_EQ(stbl.find("sym" + std::to_string(i)), syms[i]);
+  }
+  EXPECT_FALSE(stbl.find("not-interned"));
+}
+
+} // namespace
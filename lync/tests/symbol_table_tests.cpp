@@ -1,37 +1,62 @@
 #include <gtest/gtest.h>
+#include <string_table.h>
 #include <symbol_table.h>
 
 namespace {
 
 TEST(symbol_table, can_access_registered_primitive) {
 
+  lyn::string_table stbl;
   lyn::symbol_table symtab;
-  const std::string primitive_name = "prim";
+  const auto primitive_name = stbl.intern("prim");
   const auto id = symtab.register_primitive(primitive_name);
   EXPECT_EQ(id, symtab[primitive_name]);
 }
 
 TEST(symbol_table, registered_names_get_different_ids) {
+  lyn::string_table stbl;
   lyn::symbol_table symtab;
-  const std::string prim1 = "prim1";
-  const std::string prim2 = "prim2";
+  const auto prim1 = stbl.intern("prim1");
+  const auto prim2 = stbl.intern("prim2");
   const auto id1 = symtab.register_primitive(prim1);
   const auto id2 = symtab.register_primitive(prim2);
   EXPECT_NE(id1, id2);
 }
 
 TEST(symbol_table, can_shadow_global) {
+  lyn::string_table stbl;
   lyn::symbol_table symtab;
-  const std::string name = "name";
+  const auto name = stbl.intern("name");
   const auto id1 = symtab.register_primitive(name);
   symtab.start_global_registering();
   symtab.start_local_registering();
-  lyn::scope scope;
-  const auto id2 = symtab.register_local(name, scope);
+  const lyn::scope scope = symtab.push_scope();
+  const auto id2 = symtab.register_local(name);
   ASSERT_NE(id1, id2);
   EXPECT_EQ(id2, symtab[name]);
   symtab.pop_scope(scope);
   EXPECT_EQ(id1, symtab[name]);
 }
 
+TEST(symbol_table, nested_scopes_restore_outer_bindings) {
+  lyn::string_table stbl;
+  lyn::symbol_table symtab;
+  const auto name = stbl.intern("name");
+  const auto other = stbl.intern("other");
+  symtab.start_global_registering();
+  symtab.start_local_registering();
+  const lyn::scope outer = symtab.push_scope();
+  const auto outer_id = symtab.register_local(name);
+  const lyn::scope inner = symtab.push_scope();
+  symtab.register_local(name);
+  const auto twice_id = symtab.register_local(name);
+  symtab.register_local(other);
+  EXPECT_EQ(twice_id, symtab[name]);
+  symtab.pop_scope(inner);
+  EXPECT_EQ(outer_id, symtab[name]);
+  EXPECT_EQ(0, symtab[other]);
+  symtab.pop_scope(outer);
+  EXPECT_EQ(0, symtab[name]);
+}
+
 } // namespace
@@ -0,0 +1,95 @@
+#ifndef LYN_TEST_HELPERS_H
+#define LYN_TEST_HELPERS_H
+
+#include <anf.h>
+#include <cstdio>
+#include <expr.h>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <memory>
+#include <optional>
+#include <passes.h>
+#include <source_buffer.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace lyn::test {
+
+// Parses source as the contents of a file named <test>
+inline std::optional<std::vector<toplevel_expr>>
+parse_string(const std::string &source, compilation_context &cc) {
+  return parse(source_buffer::copy(source), "<test>", cc);
+}
+
+// Parses and checks source, either with the fused pass or with the separate
+// alpha_convert and typecheck passes
+inline std::optional<std::vector<toplevel_expr>>
+check_string(const std::string &source, compilation_context &cc,
+             bool fused = true) {
+  auto defs = parse_string(source, cc);
+  if (!defs)
+    return std::nullopt;
+  if (fused ? !resolve_and_typecheck(*defs, cc)
+            : !alpha_convert(*defs, cc) || !typecheck(*defs, cc))
+    return std::nullopt;
+  return defs;
+}
+
+// Everything written to file so far, closes file
+inline std::string read_and_close(FILE *file) {
+  std::string result(std::ftell(file), '\0');
+  std::rewind(file);
+  std::fread(result.data(), 1u, std::size(result), file);
+  std::fclose(file);
+  return result;
+}
+
+// Compiles the source of a test to the intermediate format in ctx, with
+// the options set in cc
+class anf_fixture : public ::testing::Test {
+protected:
+  void compile(const std::string &source) {
+    auto defs = check_string(source, cc);
+    ASSERT_TRUE(defs);
+    ctx = genanf(*defs, cc);
+  }
+
+  const anf_def &def_of(std::string_view name) const {
+    for (auto &&def : ctx->defs)
+      if (ctx->name_of(def.name) == name)
+        return def;
+    throw std::out_of_range{"No definition"};
+  }
+
+  compilation_context cc;
+  std::unique_ptr<anf_context, delete_anf> ctx;
+};
+
+// Gives every test an empty directory of its own, which is removed again
+// after the test
+class temp_dir_test : public ::testing::Test {
+protected:
+  void SetUp() override {
+    const auto *const test =
+        ::testing::UnitTest::GetInstance()->current_test_info();
+    dir = std::filesystem::temp_directory_path() /
+          (std::string{"lync-"} + test->test_suite_name() + "-" + test->name());
+    std::filesystem::create_directories(dir);
+  }
+  void TearDown() override { std::filesystem::remove_all(dir); }
+
+  std::string write_file(const std::string &name, const std::string &content) {
+    const auto path = (dir / name).string();
+    std::ofstream{path} << content;
+    return path;
+  }
+
+  std::filesystem::path dir;
+};
+
+} // namespace lyn::test
+
+#endif
@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <anf.h>
+#include <cstdio>
+#include <expr.h>
+#include <gtest/gtest.h>
+#include <passes.h>
+#include <string>
+#include <typecheck.h>
+#include <vector>
+#include <types.h>
+
+#include "test_helpers.h"
+
+namespace {
+
+bool check_string(const std::string &source, lyn::compilation_context &cc) {
+  return lyn::test::check_string(source, cc, false).has_value();
+}
+
+// Every function forwards to the previous one, so the type variables of
+// their parameters and results are unified into one long chain starting at
+// the type of fun0, which every user of fun0 has to resolve
+std::string make_forwarding_chain(int count) {
+  std::string source = "(define fun0 (lambda (x) x))\n";
+  for (int i = 1; i < count; ++i)
+    source += "(define fun" + std::to_string(i) + " (lambda (x) (fun" +
+              std::to_string(i - 1) + " x)))\n";
+  for (int i = 0; i < count; ++i)
+    source += "(define use" + std::to_string(i) +
+              " (lambda () (+ 1 (fun0 1))))\n";
+  return source;
+}
+
+// Compiles source to the intermediate format, either with the separate
+// alpha_convert and typecheck passes or with the fused pass
+std::string compile_to_anf(const std::string &source, bool fused) {
+  lyn::compilation_context cc;
+  auto defs = lyn::test::check_string(source, cc, fused);
+  if (!defs)
+    return {};
+  const auto ctx = lyn::genanf(*defs, cc);
+  FILE *const out = std::tmpfile();
+  lyn::print_anf(*ctx, out);
+  return lyn::test::read_and_close(out);
+}
+
+// Number of bound type variables passed on the longest way from t to a
+// type, without compressing the paths
+int longest_chain(const lyn::type *t) {
+  int length = 0;
+  int inner = 0;
+  for (;;) {
+    if (const auto *const var = std::get_if<lyn::type_variable>(&t->content);
+        var && var->target) {
+      t = var->target;
+      ++length;
+      continue;
+    }
+    if (const auto *const func = std::get_if<lyn::function_type>(&t->content)) {
+      for (const lyn::type *param : func->params)
+        inner = std::max(inner, longest_chain(param));
+      inner = std::max(inner, longest_chain(func->result));
+    }
+    return std::max(length, inner);
+  }
+}
+
+TEST(typecheck, self_application_fails_occurs_check) {
+  lyn::compilation_context cc;
+  cc.diag = std::tmpfile();
+  EXPECT_FALSE(check_string("(define f (lambda (x) (x x)))\n", cc));
+  std::fclose(cc.diag);
+}
+
+TEST(typecheck, ground_function_types_are_shared) {
+  lyn::compilation_context cc;
+  lyn::typecheck_t checker{cc.type_alloc, cc.diag, cc.sources, 1};
+  lyn::type *const int_t = checker.import_type_expr({lyn::int_type_expr{}});
+  std::vector<lyn::type *> params{int_t, int_t};
+  lyn::type *const result = checker.import_type_expr({lyn::bool_type_expr{}});
+  std::vector<lyn::type *> same_params = params;
+  lyn::type *const fun = checker.make_function_type(params, result);
+  EXPECT_EQ(fun, checker.make_function_type(same_params, result));
+  EXPECT_NE(fun, checker.make_function_type(same_params, int_t));
+
+  std::vector<lyn::type *> open_params{
+      new (cc.type_alloc.allocate(sizeof(lyn::type), alignof(lyn::type)))
+          lyn::type{lyn::type_variable{}}};
+  std::vector<lyn::type *> same_open_params = open_params;
+  EXPECT_NE(checker.make_function_type(open_params, result),
+            checker.make_function_type(same_open_params, result));
+}
+
+TEST(typecheck, fused_pass_matches_separate_passes) {
+  const std::string source =
+      "(define twice (lambda (f x) (f (f x))))\n"
+      "(define inc (lambda (x) (+ x 1)))\n"
+      "(define main (lambda ()\n"
+      "  (let ((x 1) (y (twice inc 2)))\n"
+      "    (let ((x (+ x y)))\n"
+      "      (if (< x y) ((lambda (x) (twice inc x)) y) x)))))\n" +
+      make_forwarding_chain(10);
+  const std::string separate = compile_to_anf(source, false);
+  ASSERT_FALSE(std::empty(separate));
+  EXPECT_EQ(separate, compile_to_anf(source, true));
+}
+
+TEST(typecheck, long_unification_chains_stay_shallow) {
+  constexpr int count = 4096;
+  lyn::compilation_context cc;
+  auto defs = lyn::test::parse_string(make_forwarding_chain(count), cc);
+  ASSERT_TRUE(defs && lyn::alpha_convert(*defs, cc));
+  lyn::typecheck_t checker{cc.type_alloc, cc.diag, cc.sources,
+                           cc.symtab.get_first_local_id()};
+  checker.setup_primitive_types(cc.symtab, cc.stbl);
+  for (auto &&def : *defs)
+    checker.register_toplevel(def);
+  for (auto &&def : *defs)
+    ASSERT_TRUE(checker.check_toplevel(def, cc.stbl));
+  // Union by rank bounds the chains by the logarithm of the number of
+  // variables unified, a naive union would chain all of them
+  int longest = 0;
+  for (auto &&def : *defs)
+    longest = std::max(longest, longest_chain(checker.get_type_for_id(def.id)));
+  EXPECT_LE(longest, 13);
+}
+
+} // namespace